@@ -17,6 +17,14 @@ local function error1(ret, err)
 end
 
 uv.Buffer = native.Buffer
+-- Channel carries messages from any thread to the loop which created it.
+-- channel:send(...) marshals the values like Thread.spawn does and may be
+-- called in any thread which got the channel, e.g. as an argument of
+-- spawn. channel:recv() returns the values of the next message and is
+-- called in a coroutine of the creating loop; it yields until a message
+-- arrives, and returns nothing once the channel is closed and drained.
+-- Messages sent in a burst are taken in one wakeup.
+uv.Channel = native.Channel
 uv.Handle = native.Handle
 uv.Pipe = native.Pipe
 uv.Process = native.Process
@@ -25,10 +33,82 @@ uv.SockAddr = native.SockAddr
 uv.SockAddrV4 = native.SockAddrV4
 uv.SockAddrV6 = native.SockAddrV6
 uv.Tcp = native.Tcp
+uv.Thread = native.Thread
 uv.Timer = native.Timer
 uv.Tty = native.Tty
 uv.Udp = native.Udp
 
+-- spawnShards spreads the datagrams to a UDP port among n threads, each
+-- with its own loop. Every thread binds a Udp handle to addr with
+-- Udp.REUSEPORT, so that the kernel picks the thread by flow hash, and calls
+-- fn with the handle and the rest of the arguments. fn is a function or a
+-- chunk string, passed like in Thread.spawn. The port of addr must not be 0
+-- since the threads bind it independently. Returns the array of Threads,
+-- whose join returns the results of fn. Worker processes get their share
+-- the same way, by binding the same address with Udp.REUSEPORT.
+local function udpShard(source, host, port, flags, ...)
+  local uv = require 'couv'
+  local handle = uv.Udp.new()
+  handle:bind(uv.SockAddr.create(host, port), flags)
+  return (loadstring or load)(source)(handle, ...)
+end
+
+uv.Udp.spawnShards = function(addr, n, fn, flags, ...)
+  local threads = {}
+  if addr:port() == 0 then
+    error('port must not be 0', 2)
+  end
+  if type(fn) == 'function' then
+    fn = string.dump(fn)
+  end
+  flags = flags or 0
+  if flags % (2 * uv.Udp.REUSEPORT) < uv.Udp.REUSEPORT then
+    flags = flags + uv.Udp.REUSEPORT
+  end
+  for i = 1, n do
+    threads[i] = uv.Thread.spawn(udpShard, fn, addr:host(), addr:port(),
+        flags, ...)
+  end
+  return threads
+end
+
+-- spawn runs source, a chunk string or a function, in a new OS thread with
+-- its own lua_State and loop. The chunk gets the arguments and its results
+-- are returned by thread:join() after true, or false and the error message
+-- are returned if it fails. A function is dumped, so it loses upvalues; it
+-- must require 'couv' itself and need not call uv.run(). The arguments and
+-- results are marshalled: nil, booleans, numbers, strings, Buffers,
+-- Channels and tables of them. A Buffer without other users is moved and
+-- becomes empty.
+local threadSpawn = native.Thread.spawn
+uv.Thread.spawn = function(source, ...)
+  if type(source) == 'function' then
+    source = string.dump(source)
+  end
+  return threadSpawn(source, ...)
+end
+
+-- work runs fn, a function or a chunk string, on the threadpool in one of
+-- the worker lua_States, and returns its results. It must be called in a
+-- coroutine, which yields until fn is done, and raises the error of fn.
+-- Like Thread.spawn, a function is dumped and loses upvalues, and the
+-- arguments and results are marshalled. Each worker caches the loaded fn,
+-- so calling work with the same fn again does not load it again. fn must
+-- not use handles or run the loop.
+local function workResults(ok, ...)
+  if not ok then
+    error(..., 3)
+  end
+  return ...
+end
+
+uv.work = function(fn, ...)
+  if type(fn) == 'function' then
+    fn = string.dump(fn)
+  end
+  return workResults(native.work(fn, ...))
+end
+
 -- core
 uv.chdir = native.chdir
 uv.cpuInfo = native.cpuInfo
@@ -42,6 +122,7 @@ uv.getTotalMemory = native.getTotalMemory
 uv.interfaceAddresses = native.interfaceAddresses
 uv.kill = native.kill
 uv.loadavg = native.loadavg
+uv.proxy = native.proxy
 uv.hrtime = native.hrtime
 uv.residentSetMemory = native.residentSetMemory
 uv.sleep = native.sleep
@@ -166,11 +247,11 @@ end
 
 
 native._Stream.read = function(handle)
-  local nread, buf
+  local nread, buf, err
   repeat
-    nread, buf = native._Stream._read(handle)
+    nread, buf, err = native._Stream._read(handle)
   until nread
-  return nread, buf
+  return nread, buf, err
 end
 
 native._Stream.shutdown = function(...)
@@ -186,6 +267,211 @@ native._Tcp.connect = function(...)
   return error0(native._Tcp._connect(...))
 end
 
+native._Tcp.write = function(...)
+  return error0(native._Tcp._write(...))
+end
+
+-- connectHost resolves host and races connects to its addresses, returning
+-- the first connected Tcp handle. opts.delay is the msecs between attempts.
+native.Tcp.connectHost = function(...)
+  return error1(native.Tcp._connectHost(...))
+end
+
+
+-- TcpPool keeps idle connected Tcp handles per destination for reuse.
+--
+--   local pool = uv.TcpPool.new{maxPerHost=8, idleTimeout=30000}
+--   local handle = pool:checkout(addr)
+--   ... use handle, then stopRead() it before ...
+--   pool:release(handle)   -- or pool:discard(handle) if it is broken
+--
+-- checkout yields while the destination has maxPerHost connections in use.
+-- close closes the idle connections, raises ECANCELED in the waiting
+-- checkouts, and makes the handles released later be closed.
+
+local TcpPool = {}
+TcpPool.__index = TcpPool
+
+uv.TcpPool = {}
+
+uv.TcpPool.new = function(options)
+  options = options or {}
+  return setmetatable({
+    maxPerHost = options.maxPerHost or 8,
+    idleTimeout = options.idleTimeout or 30000,
+    hosts = {},
+    owners = {},
+  }, TcpPool)
+end
+
+local function poolKey(addr)
+  return addr:host() .. '|' .. addr:port()
+end
+
+function TcpPool:_host(addr)
+  local key = poolKey(addr)
+  local host = self.hosts[key]
+  if not host then
+    host = {addr = addr, count = 0, idle = {}, waiters = {}}
+    self.hosts[key] = host
+  end
+  return host
+end
+
+-- hand over a handle, or the right to connect, to the oldest waiter.
+function TcpPool:_wakeup(host, handle)
+  local waiter = table.remove(host.waiters, 1)
+  if not waiter then
+    return false
+  end
+  waiter.handle = handle
+  waiter.woken = true
+  local ok, err = coroutine.resume(waiter.co)
+  if not ok then
+    error(err, 0)
+  end
+  return true
+end
+
+function TcpPool:_startTimer()
+  if self.timer then
+    return
+  end
+  self.timer = uv.Timer.new()
+  self.timer:start(function()
+    self:_evict()
+  end, self.idleTimeout, self.idleTimeout)
+  -- idle connections must not keep the loop alive.
+  self.timer:unref()
+end
+
+function TcpPool:_evict()
+  local now = uv.now()
+  for _, host in pairs(self.hosts) do
+    local idle = host.idle
+    local i = 1
+    while i <= #idle do
+      if now - idle[i].since >= self.idleTimeout then
+        local handle = table.remove(idle, i).handle
+        self.owners[handle] = nil
+        host.count = host.count - 1
+        handle:closeNoWait()
+      else
+        i = i + 1
+      end
+    end
+  end
+end
+
+function TcpPool:checkout(addr)
+  if self.closed then
+    error('pool is closed', 2)
+  end
+  local host = self:_host(addr)
+  while true do
+    local entry = table.remove(host.idle)
+    while entry do
+      if entry.handle:isAlive() then
+        return entry.handle
+      end
+      self.owners[entry.handle] = nil
+      host.count = host.count - 1
+      entry.handle:close()
+      entry = table.remove(host.idle)
+    end
+
+    if host.count < self.maxPerHost then
+      host.count = host.count + 1
+      local handle = uv.Tcp.new()
+      local ok, err = pcall(handle.connect, handle, addr)
+      if not ok then
+        host.count = host.count - 1
+        handle:close()
+        self:_wakeup(host)
+        error(err, 2)
+      end
+      self.owners[handle] = host
+      return handle
+    end
+
+    local waiter = {co = coroutine.running()}
+    table.insert(host.waiters, waiter)
+    repeat
+      coroutine.yield()
+    until waiter.woken
+    if waiter.err then
+      error(waiter.err, 2)
+    end
+    if waiter.handle then
+      return waiter.handle
+    end
+  end
+end
+
+function TcpPool:release(handle)
+  local host = self.owners[handle]
+  if not host then
+    error('handle is not checked out of this pool', 2)
+  end
+  if self.closed then
+    self.owners[handle] = nil
+    host.count = host.count - 1
+    handle:closeNoWait()
+    return
+  end
+  if self:_wakeup(host, handle) then
+    return
+  end
+  table.insert(host.idle, {handle = handle, since = uv.now()})
+  self:_startTimer()
+end
+
+function TcpPool:discard(handle)
+  local host = self.owners[handle]
+  if not host then
+    error('handle is not checked out of this pool', 2)
+  end
+  self.owners[handle] = nil
+  host.count = host.count - 1
+  if not handle:isClosing() then
+    handle:close()
+  end
+  self:_wakeup(host)
+end
+
+function TcpPool:close()
+  local firstErr
+  self.closed = true
+  for _, host in pairs(self.hosts) do
+    for _, entry in ipairs(host.idle) do
+      self.owners[entry.handle] = nil
+      host.count = host.count - 1
+      entry.handle:closeNoWait()
+    end
+    host.idle = {}
+  end
+  if self.timer then
+    self.timer:close()
+    self.timer = nil
+  end
+  -- wake all the waiters before raising an error of one of them.
+  for _, host in pairs(self.hosts) do
+    local waiters = host.waiters
+    host.waiters = {}
+    for _, waiter in ipairs(waiters) do
+      waiter.woken = true
+      waiter.err = 'ECANCELED'
+      local ok, err = coroutine.resume(waiter.co)
+      if not ok and not firstErr then
+        firstErr = err
+      end
+    end
+  end
+  if firstErr then
+    error(firstErr, 0)
+  end
+end
+
 
 native._Pipe.connect = function(...)
   return error0(native._Pipe._connect(...))
@@ -200,18 +486,186 @@ native._Pipe.read2 = function(...)
 end
 
 
+-- recv returns nread, buf and addr. The info table is returned too after
+-- setGro, setTimestamps, setPktInfo or setRecvDrops. It has segmentSize
+-- for coalesced datagrams, the kernel receive timestamp in secs with its
+-- delay until now in nsecs, and dstAddr and ifindex of the local end. Pass
+-- dstAddr as the source to send to reply from it. info.truncated is set
+-- for datagrams longer than the buffer, and info.drops is the count of
+-- datagrams dropped by the kernel. Receive errors, like ECONNREFUSED on a
+-- connected handle, are raised.
 native._Udp.recv = function(handle)
-  local nread, buf, addr
+  local nread, buf, addr, info
   repeat
-    nread, buf, addr = native._Udp._recv(handle)
-  until nread
-  return nread, buf, addr
+    nread, buf, addr, info = native._Udp._recv(handle)
+  until nread ~= nil
+  if nread == false then
+    error(buf, 2)
+  end
+  return nread, buf, addr, info
+end
+
+-- recvBatch returns an array of {nread, buf, addr} entries and its count.
+-- Pass the array of the previous call to reuse its entry tables.
+native._Udp.recvBatch = function(handle, entries)
+  local ret, n
+  repeat
+    ret, n = native._Udp._recvBatch(handle, entries)
+  until ret ~= nil
+  if ret == false then
+    error(n, 2)
+  end
+  return ret, n
 end
 
 native._Udp.send = function(...)
   return error0(native._Udp._send(...))
 end
 
+-- sendBatch sends an array of {bufs, addr} and returns the status array,
+-- which has true or the error name for each datagram. With pacing, the
+-- whole batch waits for its bytes to be released, and ECANCELED is raised
+-- if the handle is closed meanwhile.
+native._Udp.sendBatch = function(...)
+  local statuses
+  repeat
+    statuses = native._Udp._sendBatch(...)
+  until statuses
+  if type(statuses) == 'string' then
+    error(statuses, 2)
+  end
+  return statuses
+end
+
+-- sendSegmented sends a Buffer or string as datagrams of segSize bytes.
+-- It is paced like sendBatch.
+native._Udp.sendSegmented = function(...)
+  local statuses
+  repeat
+    statuses = native._Udp._sendSegmented(...)
+  until statuses
+  if type(statuses) == 'string' then
+    error(statuses, 2)
+  end
+  for i = 1, #statuses do
+    if statuses[i] ~= true then
+      error(statuses[i], 2)
+    end
+  end
+end
+
+
+
+-- Histogram records values, e.g. the info.delay of received datagrams, in
+-- log-linear buckets: each power of two is split into 16 buckets, so
+-- percentiles are accurate to about 6%.
+--
+--   local h = uv.Histogram.new()
+--   h:record(info.delay)
+--   print(h:percentile(99), h:max())
+
+local HISTOGRAM_SUB_BUCKETS = 16
+
+local Histogram = {}
+Histogram.__index = Histogram
+
+uv.Histogram = {}
+
+uv.Histogram.new = function()
+  local h = setmetatable({}, Histogram)
+  h:reset()
+  return h
+end
+
+local function histogramBucket(value)
+  if value < 1 then
+    return 0
+  end
+  local m, e = math.frexp(value)
+  -- m is in [0.5, 1).
+  return e * HISTOGRAM_SUB_BUCKETS
+      + math.floor((m * 2 - 1) * HISTOGRAM_SUB_BUCKETS)
+end
+
+-- returns the upper bound of the values in the bucket.
+local function histogramBucketValue(bucket)
+  if bucket == 0 then
+    return 1
+  end
+  local e = math.floor(bucket / HISTOGRAM_SUB_BUCKETS)
+  local sub = bucket % HISTOGRAM_SUB_BUCKETS
+  return math.ldexp(1 + (sub + 1) / HISTOGRAM_SUB_BUCKETS, e - 1)
+end
+
+function Histogram:reset()
+  self.buckets = {}
+  self.n = 0
+  self.sum = 0
+  self.minValue = nil
+  self.maxValue = nil
+end
+
+-- nil values, e.g. info.delay without timestamps, are ignored.
+function Histogram:record(value)
+  if value == nil then
+    return
+  end
+  if value < 0 then
+    value = 0
+  end
+  local bucket = histogramBucket(value)
+  self.buckets[bucket] = (self.buckets[bucket] or 0) + 1
+  self.n = self.n + 1
+  self.sum = self.sum + value
+  if not self.minValue or value < self.minValue then
+    self.minValue = value
+  end
+  if not self.maxValue or value > self.maxValue then
+    self.maxValue = value
+  end
+end
+
+function Histogram:count()
+  return self.n
+end
+
+function Histogram:min()
+  return self.minValue
+end
+
+function Histogram:max()
+  return self.maxValue
+end
+
+function Histogram:mean()
+  if self.n == 0 then
+    return nil
+  end
+  return self.sum / self.n
+end
+
+-- percentile returns the value below which p percent of the values are.
+function Histogram:percentile(p)
+  if self.n == 0 then
+    return nil
+  end
+  local keys = {}
+  for bucket in pairs(self.buckets) do
+    keys[#keys + 1] = bucket
+  end
+  table.sort(keys)
+  local rank = math.max(1, math.ceil(self.n * p / 100))
+  local seen = 0
+  for _, bucket in ipairs(keys) do
+    seen = seen + self.buckets[bucket]
+    if seen >= rank then
+      return math.min(histogramBucketValue(bucket), self.maxValue)
+    end
+  end
+  return self.maxValue
+end
+
+
 -- for debug
 uv.pt = function(t)
   if type(t) ~= 'table' then
@@ -57,10 +57,44 @@ int couvL_is_mainthread(lua_State *L);
 const char *couvL_uv_errname(int uv_errcode);
 #define couvL_uv_lasterrname(loop) couvL_uv_errname(uv_last_error(loop).code)
 
+const char *couvL_sys_errname(int sys_errno);
+#define couvL_sock_lasterrname() couvL_sys_errname(couv_sock_errno())
+
+int couv_setsockopt_int(uv_os_sock_t sock, int level, int optname, int value);
+int couv_getsockopt_int(uv_os_sock_t sock, int level, int optname, int *value);
+
+/*
+ * int socket options kept while the handle has no socket, and applied with
+ * couv_apply_sockopts once it is created.
+ */
+#define COUV_MAX_SOCKOPTS 3
+
+typedef struct couv_sockopts_s {
+  struct {
+    int level;
+    int optname;
+    int value;
+  } opts[COUV_MAX_SOCKOPTS];
+  int cnt;
+} couv_sockopts_t;
+
+int couvL_set_int_sockopt(lua_State *L, uv_os_sock_t sock,
+    couv_sockopts_t *deferred, int level, int optname);
+int couvL_get_int_sockopt(lua_State *L, uv_os_sock_t sock,
+    couv_sockopts_t *deferred, int level, int optname);
+int couv_apply_sockopts(uv_os_sock_t sock, couv_sockopts_t *deferred);
+
 void *couvL_checkudataclass(lua_State *L, int arg, const char *tname);
 void *couvL_testudataclass(lua_State *L, int arg, const char *tname);
 int couv_newmetatable(lua_State *L, const char *tname, const char *super_tname);
 
+/*
+ * sets the number field k of the table at index, or def if it is nil, to
+ * value. returns 0 if the field is not a number.
+ */
+int couvL_opt_number_field(lua_State *L, int index, const char *k,
+    double def, double *value);
+
 #define ARRAY_SIZE(a) (sizeof(a) / sizeof(a[0]))
 #define container_of(ptr, type, member) \
   ((type *) ((char *) (ptr) - offsetof(type, member)))
@@ -73,8 +107,12 @@ typedef void *(*couv_alloc_t)(lua_State *L, size_t nbytes);
 typedef void (*couv_free_t)(lua_State *L, void *ptr);
 
 typedef struct couv_buf_mem_s couv_buf_mem_t;
+typedef void (*couv_buf_mem_free_cb)(lua_State *L, couv_buf_mem_t *mem);
 struct couv_buf_mem_s {
   int ref_cnt;
+  /* called instead of couv_free when the last reference is released. */
+  couv_buf_mem_free_cb free_cb;
+  void *data;
   char mem[1];
 };
 
@@ -89,6 +127,8 @@ typedef struct couv_buf_s {
   uv_buf_t buf;
 } couv_buf_t;
 
+typedef struct couv_udp_input_block_s couv_udp_input_block_t;
+
 typedef struct couv_udp_input_s {
   ngx_queue_t *prev;
   ngx_queue_t *next;
@@ -99,13 +139,39 @@ typedef struct couv_udp_input_s {
     struct sockaddr_in v4;
     struct sockaddr_in6 v6;
   } addr;
+  /* the GRO segment size of a coalesced datagram, or 0. */
+  int segment_size;
+  /* the error name of a failed receive, or NULL. */
+  const char *err_name;
+  /* the kernel receive time, or 0 if not enabled. */
+  long timestamp_sec;
+  long timestamp_nsec;
+  /* the local destination address and interface, if pktinfo is enabled. */
+  union {
+    struct sockaddr sa;
+    struct sockaddr_in v4;
+    struct sockaddr_in6 v6;
+  } dst;
+  unsigned ifindex;
+  /* set if the datagram was longer than the buffer. */
+  int truncated;
+  /* the SO_RXQ_OVFL drop count, or -1 if not enabled. */
+  long drops;
+  /* the block of a batch receive, or NULL if allocated alone. */
+  couv_udp_input_block_t *block;
 } couv_udp_input_t;
 
+struct couv_udp_input_block_s {
+  int ref_cnt;
+  couv_udp_input_t inputs[1];
+};
+
 typedef struct couv_stream_input_s {
   ngx_queue_t *prev;
   ngx_queue_t *next;
   ssize_t nread;
   couv_buf_t w_buf;
+  uv_err_code err_code;
 } couv_stream_input_t;
 
 typedef struct couv_pipe_input_s {
@@ -119,11 +185,39 @@ typedef struct couv_pipe_input_s {
 /*
  * handle data.
  */
-#define COUV_UDP_HANDLE_DATA_FIELDS \
-  ngx_queue_t input_queue;          \
+typedef struct couv_udp_recv_batch_s couv_udp_recv_batch_t;
+typedef struct couv_udp_ring_s couv_udp_ring_t;
+typedef struct couv_pacer_s couv_pacer_t;
+
+#define COUV_UDP_HANDLE_DATA_FIELDS  \
+  ngx_queue_t input_queue;           \
+  lua_State *recv_waiter;            \
+  int send_pending;                  \
+  couv_udp_recv_batch_t *recv_batch; \
+  unsigned recv_flags;               \
+  couv_udp_ring_t *ring;             \
+  int addr_cache_max;                \
+  int addr_cache_size;               \
+  int connected;                     \
+  struct sockaddr_storage peer;      \
+  double try_sent;                   \
+  double try_queued;                 \
+  double try_failed;                 \
+  couv_pacer_t *pacer;               \
+  double recv_truncated;             \
+  long recv_drops;                   \
+  couv_sockopts_t sockopts;          \
+
+typedef struct couv_admission_s couv_admission_t;
+typedef struct couv_proxy_s couv_proxy_t;
 
 #define COUV_STREAM_HANDLE_DATA_FIELDS \
   ngx_queue_t input_queue;             \
+  lua_State *read_waiter;              \
+  couv_admission_t *admission;         \
+  couv_admission_t *admitted_by;       \
+  int admitted_slot;                   \
+  couv_proxy_t *proxy;                 \
 
 typedef struct couv_udp_handle_data_s {
   COUV_UDP_HANDLE_DATA_FIELDS 
@@ -159,9 +253,29 @@ typedef struct couv_pipe_s {
   couv_stream_handle_data_t hdata;
 } couv_pipe_t;
 
+#define COUV_TCP_FASTOPEN_CONNECT 0x01
+#define COUV_TCP_KEEPALIVE 0x02
+
+typedef struct couv_tcp_accept_batch_s {
+  lua_State *L;
+  uv_check_t check;
+  int size;
+  int count;
+} couv_tcp_accept_batch_t;
+
+typedef struct couv_tcp_zerocopy_s couv_tcp_zerocopy_t;
+
 typedef struct couv_tcp_s {
   uv_tcp_t handle;
   couv_stream_handle_data_t hdata;
+  unsigned flags;
+  unsigned keepalive_delay;
+  int keepalive_interval;
+  int keepalive_count;
+  couv_sockopts_t sockopts;
+  couv_tcp_accept_batch_t *accept_batch;
+  couv_tcp_zerocopy_t *zerocopy;
+  couv_pacer_t *pacer;
 } couv_tcp_t;
 
 typedef struct couv_tty_s {
@@ -169,7 +283,79 @@ typedef struct couv_tty_s {
   couv_stream_handle_data_t hdata;
 } couv_tty_t;
 
+void couv_set_handle_thread(lua_State *L, uv_handle_t *handle);
+void couv_set_req_thread(lua_State *L, uv_req_t *req);
+lua_State *couv_take_req_thread(uv_req_t *req);
+void couv_set_input_waiter(lua_State *L, uv_handle_t *handle,
+    lua_State **waiter);
+lua_State *couv_take_input_waiter(uv_handle_t *handle, lua_State **waiter);
+void couv_close_nowait(uv_handle_t *handle);
+
 couv_stream_handle_data_t *couv_get_stream_handle_data(uv_stream_t *handle);
+void couv_init_stream_handle_data(couv_stream_handle_data_t *hdata);
+
+/*
+ * writes bufs of the table at index, which is freed when done, and yields
+ * until written.
+ */
+int couv_stream_write_bufs(lua_State *L, uv_stream_t *handle, int index,
+    uv_buf_t *bufs, size_t bufcnt);
+
+/*
+ * admission control of listening streams.
+ * couv_admission_check must be called at the top of connection callbacks,
+ * and the connection is already closed if it returns 0. Otherwise
+ * couv_admission_bind or couv_admission_release must follow.
+ */
+int couv_admission_check(uv_stream_t *server);
+void couv_admission_bind(uv_stream_t *server, uv_stream_t *client);
+void couv_admission_release(uv_stream_t *server);
+void couv_clean_stream_admission(uv_stream_t *handle);
+
+/* finishes the proxy of a stream whose handle is cleaned after closing. */
+void couv_clean_stream_proxy(uv_stream_t *handle);
+void couv_cancel_stream_reader(uv_stream_t *handle);
+
+/*
+ * send pacing of Tcp and Udp handles. A send whose bytes are not released
+ * yet is queued as an item, and its cb is called with status 0 when they
+ * are, or with -1 when the handle is closed. The item must be the first
+ * member of the struct allocated for it, which couv_pacer_finish frees.
+ */
+typedef struct couv_pacer_item_s couv_pacer_item_t;
+typedef void (*couv_pacer_cb)(couv_pacer_item_t *item, int status);
+struct couv_pacer_item_s {
+  ngx_queue_t *prev;
+  ngx_queue_t *next;
+  couv_pacer_t *pacer;
+  /* the coroutine to resume when done, or NULL. */
+  lua_State *co;
+  size_t len;
+  couv_pacer_cb cb;
+};
+
+/* returns 1 and charges len bytes if they may be sent now. */
+int couv_pacer_admit(couv_pacer_t *pacer, size_t len);
+/*
+ * for sends which are retried once their bytes are released, like the
+ * batches of Udp. Returns 1 if they may be sent now. Otherwise queues a
+ * wait, and the caller yields. The coroutine is resumed with no values to
+ * retry, and the next call returns 1 then, or with ECANCELED.
+ */
+int couv_pacer_admit_or_wait(lua_State *L, couv_pacer_t *pacer,
+    size_t len);
+/* queues the item. The caller yields after it if resume is set. */
+void couv_pacer_enqueue(lua_State *L, couv_pacer_t *pacer,
+    couv_pacer_item_t *item, size_t len, couv_pacer_cb cb, int resume);
+/* resumes the coroutine of the item with err_name if not NULL. */
+void couv_pacer_finish(couv_pacer_item_t *item, const char *err_name);
+/*
+ * writes bufs of the table at index, which is freed when done, when
+ * released and yields.
+ */
+int couv_pacer_write(lua_State *L, couv_pacer_t *pacer, uv_stream_t *handle,
+    int index, uv_buf_t *bufs, size_t bufcnt);
+void couv_clean_pacer(lua_State *L, uv_handle_t *handle);
 
 /*
  * handle registry keys.
@@ -179,9 +365,14 @@ couv_stream_handle_data_t *couv_get_stream_handle_data(uv_stream_t *handle);
 #define COUV_LISTEN_CB_REG_KEY(h) (((char *)h) + 2)
 #define COUV_TIMER_CB_REG_KEY(h)  (((char *)h) + 2)
 #define COUV_EXIT_CB_REG_KEY(h)   (((char *)h) + 2)
+#define COUV_ACCEPT_BATCH_REG_KEY(h) (((char *)h) + 3)
+#define COUV_RECV_INFO_REG_KEY(h) (((char *)h) + 3)
+#define COUV_ADDR_CACHE_REG_KEY(h) (((char *)h) + 4)
+#define COUV_INPUT_WAITER_REG_KEY(h) (((char *)h) + 5)
 
 void couv_clean_process_handle(lua_State *L, uv_process_t *handle);
 void couv_clean_tcp_handle(lua_State *L, uv_tcp_t *handle);
+void couv_clean_tcp_zerocopy(lua_State *L, uv_tcp_t *handle);
 void couv_clean_timer_handle(lua_State *L, uv_timer_t *handle);
 void couv_clean_tty_handle(lua_State *L, uv_tty_t *handle);
 void couv_clean_udp_handle(lua_State *L, uv_udp_t *handle);
@@ -190,6 +381,7 @@ void couv_clean_pipe_handle(lua_State *L, uv_pipe_t *handle);
 /*
  * buffer
  */
+int luaopen_couv_admission(lua_State *L);
 int luaopen_couv_buffer(lua_State *L);
 
 #define COUV_BUFFER_MTBL_NAME "couv.Buffer"
@@ -201,6 +393,16 @@ uv_buf_t couv_checkbuforstr(lua_State *L, int index);
 /* NOTE: you must free the result buffers array with couv_free. */
 uv_buf_t *couv_checkbuforstrtable(lua_State *L, int index, size_t *buffers_cnt);
 
+/*
+ * Requests which point into Buffers while their coroutine is yielded must
+ * retain the memory, so that it is neither freed nor moved into a message
+ * before they are done. The mems arrays are NULL terminated.
+ */
+size_t couv_retain_buf_mem(lua_State *L, int index, void **mems,
+    size_t memcnt);
+void **couv_retain_buf_mems(lua_State *L, int index);
+void couv_release_buf_mems(lua_State *L, void **mems);
+
 void couv_dbg_print_bufs(const char *header, uv_buf_t *bufs, size_t bufcnt);
 
 #define couv_argcheckindex(L, arg_index, index, min, max) \
@@ -216,6 +418,40 @@ uv_loop_t *couv_loop(lua_State *L);
 
 #define COUV_LOOP_REGISTRY_KEY "couv.loop"
 
+/*
+ * marshal
+ */
+typedef struct couv_msg_s {
+  char *data;
+  size_t len;
+  size_t cap;
+} couv_msg_t;
+
+void couv_msg_init(couv_msg_t *msg);
+/* NOTE: Buffers which have no other users are moved into the message. */
+void couv_msg_pack(lua_State *L, couv_msg_t *msg, int index, int n);
+/* pushes the values and returns the count. the message is emptied. */
+int couv_msg_unpack(lua_State *L, couv_msg_t *msg);
+void couv_msg_free(lua_State *L, couv_msg_t *msg);
+
+/*
+ * channel
+ */
+#define COUV_CHANNEL_MTBL_NAME "couv.Channel"
+
+typedef struct couv_channel_s couv_channel_t;
+
+void couv_channel_retain(couv_channel_t *ch);
+void couv_channel_release(lua_State *L, couv_channel_t *ch);
+/* pushes a Channel which takes over a reference. */
+void couv_channel_push(lua_State *L, couv_channel_t *ch);
+couv_channel_t *couv_tochannel(lua_State *L, int index);
+
+/*
+ * thread
+ */
+#define COUV_THREAD_MTBL_NAME "couv.Thread"
+
 /*
  * sockaddr
  */
@@ -227,15 +463,21 @@ int luaopen_couv_sockaddr(lua_State *L);
 int couvL_tosockfamily(lua_State *L, int index);
 int couvL_pushsockaddr(lua_State *L, struct sockaddr *addr);
 
+int luaopen_couv_channel(lua_State *L);
 int luaopen_couv_fs(lua_State *L);
 int luaopen_couv_handle(lua_State *L);
+int luaopen_couv_pacing(lua_State *L);
 int luaopen_couv_pipe(lua_State *L);
 int luaopen_couv_process(lua_State *L);
+int luaopen_couv_proxy(lua_State *L);
 int luaopen_couv_stream(lua_State *L);
 int luaopen_couv_tcp(lua_State *L);
+int luaopen_couv_thread(lua_State *L);
 int luaopen_couv_timer(lua_State *L);
 int luaopen_couv_tty(lua_State *L);
 int luaopen_couv_udp(lua_State *L);
+int luaopen_couv_work(lua_State *L);
+int luaopen_couv_zerocopy(lua_State *L);
 
 
 #ifdef __cplusplus
@@ -4,7 +4,16 @@
 extern "C" {
 #endif
 
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
 #include <sys/socket.h>
+#include <netinet/in.h>
+
+#define couv_handle_fd(handle) ((handle)->io_watcher.fd)
+#define couv_sock_errno() errno
+
+int couv_socket_nonblock(int family, int type);
 
 #ifdef __cplusplus
 }
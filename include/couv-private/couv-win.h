@@ -6,6 +6,9 @@ extern "C" {
 
 #include <fcntl.h>
 
+#define couv_handle_fd(handle) ((handle)->socket)
+#define couv_sock_errno() WSAGetLastError()
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,379 @@
+#include "couv-private.h"
+
+/*
+ * Admission control for listening streams. A pending connection is checked
+ * against an accepts-per-second token bucket, the number of live
+ * connections and the number of live connections per source IP before the
+ * listen callback runs. Rejected connections are closed at once. While
+ * the per-IP table is full of addresses with live connections, connections
+ * from other addresses are rejected as per IP.
+ */
+
+#define COUV_ADMISSION_DEFAULT_IP_TABLE_SIZE 4096
+#define COUV_ADMISSION_MAX_IP_TABLE_SIZE (1 << 20)
+
+typedef struct couv_admission_ip_s {
+  unsigned char addr[16];
+  unsigned char family;
+  unsigned char used;
+  int count;
+} couv_admission_ip_t;
+
+struct couv_admission_s {
+  lua_State *L;
+  int ref_cnt;
+
+  double rate;
+  double burst;
+  double tokens;
+  int64_t last_refill;
+
+  int max_connections;
+  int max_per_ip;
+  int reset;
+  int live;
+
+  couv_admission_ip_t *ips;
+  unsigned ip_mask;
+
+  /* whether the pending connection holds a reservation, and its slot. */
+  int pending;
+  int pending_slot;
+
+  double admitted;
+  double rejected_rate;
+  double rejected_connections;
+  double rejected_per_ip;
+};
+
+static void couv_admission_unref(couv_admission_t *adm) {
+  if (--adm->ref_cnt > 0)
+    return;
+  couv_free(adm->L, adm->ips);
+  couv_free(adm->L, adm);
+}
+
+/* gives back the live count and ip slot of a pending connection. */
+static void couv_admission_unreserve(couv_admission_t *adm) {
+  if (!adm->pending)
+    return;
+  --adm->live;
+  if (adm->pending_slot != -1)
+    --adm->ips[adm->pending_slot].count;
+  adm->pending = 0;
+  adm->pending_slot = -1;
+}
+
+#ifndef _WIN32
+
+static unsigned couv_admission_hash(const unsigned char *addr, size_t len) {
+  unsigned h;
+  size_t i;
+
+  /* FNV-1a */
+  h = 2166136261U;
+  for (i = 0; i < len; ++i) {
+    h ^= addr[i];
+    h *= 16777619U;
+  }
+  return h;
+}
+
+/*
+ * Looks up the slot for the address, or a free slot to put it in.
+ * Slots whose count dropped to zero are reused, but the probe continues
+ * past them since the address may be further along. Returns -1 if the
+ * table is full.
+ */
+static int couv_admission_lookup_ip(couv_admission_t *adm,
+    const unsigned char *addr, size_t len, int family) {
+  unsigned i;
+  unsigned n;
+  int free_slot;
+  couv_admission_ip_t *ip;
+
+  free_slot = -1;
+  i = couv_admission_hash(addr, len) & adm->ip_mask;
+  for (n = 0; n <= adm->ip_mask; ++n, i = (i + 1) & adm->ip_mask) {
+    ip = &adm->ips[i];
+    if (!ip->used)
+      return free_slot != -1 ? free_slot : (int)i;
+    if (ip->family == family && memcmp(ip->addr, addr, len) == 0)
+      return (int)i;
+    if (ip->count == 0 && free_slot == -1)
+      free_slot = (int)i;
+  }
+  return free_slot;
+}
+
+static int couv_admission_reserve_ip(couv_admission_t *adm, int fd) {
+  struct sockaddr_storage ss;
+  socklen_t sslen;
+  const unsigned char *addr;
+  size_t len;
+  couv_admission_ip_t *ip;
+  int slot;
+
+  adm->pending_slot = -1;
+  if (adm->max_per_ip <= 0)
+    return 1;
+
+  sslen = sizeof(ss);
+  if (getpeername(fd, (struct sockaddr *)&ss, &sslen) < 0)
+    return 1;
+  if (ss.ss_family == AF_INET) {
+    addr = (const unsigned char *)&((struct sockaddr_in *)&ss)->sin_addr;
+    len = sizeof(struct in_addr);
+  } else if (ss.ss_family == AF_INET6) {
+    addr = (const unsigned char *)&((struct sockaddr_in6 *)&ss)->sin6_addr;
+    len = sizeof(struct in6_addr);
+  } else
+    return 1;
+
+  /* fail closed, or per-IP limiting would stop working. */
+  slot = couv_admission_lookup_ip(adm, addr, len, ss.ss_family);
+  if (slot == -1)
+    return 0;
+  ip = &adm->ips[slot];
+  if (ip->used && ip->count > 0 && ip->family == ss.ss_family
+      && memcmp(ip->addr, addr, len) == 0) {
+    if (ip->count >= adm->max_per_ip)
+      return 0;
+  } else {
+    memcpy(ip->addr, addr, len);
+    ip->family = (unsigned char)ss.ss_family;
+    ip->used = 1;
+    ip->count = 0;
+  }
+  ++ip->count;
+  adm->pending_slot = slot;
+  return 1;
+}
+
+static int couv_admission_take_token(couv_admission_t *adm, uv_loop_t *loop) {
+  int64_t now;
+
+  if (adm->rate <= 0)
+    return 1;
+  now = uv_now(loop);
+  adm->tokens += (double)(now - adm->last_refill) * adm->rate / 1000;
+  if (adm->tokens > adm->burst)
+    adm->tokens = adm->burst;
+  adm->last_refill = now;
+  if (adm->tokens < 1)
+    return 0;
+  adm->tokens -= 1;
+  return 1;
+}
+
+static void couv_admission_reject(couv_admission_t *adm, uv_stream_t *server) {
+  struct linger l;
+
+  if (adm->reset) {
+    l.l_onoff = 1;
+    l.l_linger = 0;
+    setsockopt(server->accepted_fd, SOL_SOCKET, SO_LINGER, &l, sizeof(l));
+  }
+  close(server->accepted_fd);
+  server->accepted_fd = -1;
+}
+
+int couv_admission_check(uv_stream_t *server) {
+  couv_admission_t *adm;
+
+  adm = couv_get_stream_handle_data(server)->admission;
+  if (!adm || server->accepted_fd == -1)
+    return 1;
+
+  if (adm->max_connections > 0 && adm->live >= adm->max_connections) {
+    ++adm->rejected_connections;
+    couv_admission_reject(adm, server);
+    return 0;
+  }
+  if (!couv_admission_reserve_ip(adm, server->accepted_fd)) {
+    ++adm->rejected_per_ip;
+    couv_admission_reject(adm, server);
+    return 0;
+  }
+  if (!couv_admission_take_token(adm, server->loop)) {
+    if (adm->pending_slot != -1)
+      --adm->ips[adm->pending_slot].count;
+    ++adm->rejected_rate;
+    couv_admission_reject(adm, server);
+    return 0;
+  }
+
+  ++adm->admitted;
+  ++adm->live;
+  adm->pending = 1;
+  return 1;
+}
+
+/*
+ * The connection may be accepted after the connection callback returns,
+ * so the reservation is kept while libuv holds the connection and given
+ * back only if it is gone without being accepted.
+ */
+void couv_admission_release(uv_stream_t *server) {
+  couv_admission_t *adm;
+
+  adm = couv_get_stream_handle_data(server)->admission;
+  if (adm && server->accepted_fd == -1)
+    couv_admission_unreserve(adm);
+}
+
+#else
+
+int couv_admission_check(uv_stream_t *server) {
+  return 1;
+}
+
+void couv_admission_release(uv_stream_t *server) {
+}
+
+#endif
+
+void couv_admission_bind(uv_stream_t *server, uv_stream_t *client) {
+  couv_admission_t *adm;
+  couv_stream_handle_data_t *client_hdata;
+
+  adm = couv_get_stream_handle_data(server)->admission;
+  if (!adm || !adm->pending)
+    return;
+  client_hdata = couv_get_stream_handle_data(client);
+  client_hdata->admitted_by = adm;
+  client_hdata->admitted_slot = adm->pending_slot;
+  adm->pending = 0;
+  adm->pending_slot = -1;
+  ++adm->ref_cnt;
+}
+
+
+void couv_clean_stream_admission(uv_stream_t *handle) {
+  couv_stream_handle_data_t *hdata;
+  couv_admission_t *adm;
+
+  hdata = couv_get_stream_handle_data(handle);
+
+  adm = hdata->admitted_by;
+  if (adm) {
+    --adm->live;
+    if (hdata->admitted_slot != -1)
+      --adm->ips[hdata->admitted_slot].count;
+    hdata->admitted_by = NULL;
+    couv_admission_unref(adm);
+  }
+
+  adm = hdata->admission;
+  if (adm) {
+    /* the pending connection is closed with the server. */
+    couv_admission_unreserve(adm);
+    hdata->admission = NULL;
+    couv_admission_unref(adm);
+  }
+}
+
+static int stream_set_admission(lua_State *L) {
+  uv_stream_t *handle;
+  couv_stream_handle_data_t *hdata;
+  couv_admission_t *adm;
+  double rate;
+  double burst;
+  double max_connections;
+  double max_per_ip;
+  double ip_table_size;
+  unsigned size;
+
+  handle = couvL_checkudataclass(L, 1, COUV_STREAM_MTBL_NAME);
+  hdata = couv_get_stream_handle_data(handle);
+
+  if (lua_isnoneornil(L, 2)) {
+    if (hdata->admission) {
+      couv_admission_unreserve(hdata->admission);
+      couv_admission_unref(hdata->admission);
+      hdata->admission = NULL;
+    }
+    return 0;
+  }
+
+#ifdef _WIN32
+  return luaL_error(L, "ENOTSUP");
+#else
+  luaL_checktype(L, 2, LUA_TTABLE);
+  luaL_argcheck(L, couvL_opt_number_field(L, 2, "rate", 0, &rate)
+      && couvL_opt_number_field(L, 2, "burst", rate, &burst)
+      && couvL_opt_number_field(L, 2, "maxConnections", 0, &max_connections)
+      && couvL_opt_number_field(L, 2, "maxPerIp", 0, &max_per_ip)
+      && couvL_opt_number_field(L, 2, "ipTableSize",
+          COUV_ADMISSION_DEFAULT_IP_TABLE_SIZE, &ip_table_size),
+      2, "values must be numbers");
+  luaL_argcheck(L, rate >= 0 && burst >= 0 && max_connections >= 0
+      && max_per_ip >= 0 && ip_table_size >= 1, 2,
+      "values must not be negative");
+  luaL_argcheck(L, ip_table_size <= COUV_ADMISSION_MAX_IP_TABLE_SIZE, 2,
+      "ipTableSize must be at most 1048576");
+  if (rate > 0 && burst < 1)
+    burst = 1;
+
+  adm = hdata->admission;
+  if (!adm) {
+    for (size = 1; size < ip_table_size; size <<= 1)
+      ;
+    adm = couv_alloc(L, sizeof(couv_admission_t));
+    memset(adm, 0, sizeof(couv_admission_t));
+    adm->L = L;
+    adm->ref_cnt = 1;
+    adm->ips = couv_alloc(L, size * sizeof(couv_admission_ip_t));
+    memset(adm->ips, 0, size * sizeof(couv_admission_ip_t));
+    adm->ip_mask = size - 1;
+    adm->pending_slot = -1;
+    adm->tokens = burst;
+    adm->last_refill = uv_now(couv_loop(L));
+    hdata->admission = adm;
+  }
+  adm->rate = rate;
+  adm->burst = burst;
+  if (adm->tokens > burst)
+    adm->tokens = burst;
+  adm->max_connections = (int)max_connections;
+  adm->max_per_ip = (int)max_per_ip;
+  lua_getfield(L, 2, "reset");
+  adm->reset = lua_toboolean(L, -1);
+  lua_pop(L, 1);
+  return 0;
+#endif
+}
+
+static int stream_get_admission_stats(lua_State *L) {
+  uv_stream_t *handle;
+  couv_admission_t *adm;
+
+  handle = couvL_checkudataclass(L, 1, COUV_STREAM_MTBL_NAME);
+  adm = couv_get_stream_handle_data(handle)->admission;
+  if (!adm) {
+    lua_pushnil(L);
+    return 1;
+  }
+
+  lua_createtable(L, 0, 6);
+  couvL_SET_FIELD(L, admitted, number, adm->admitted);
+  couvL_SET_FIELD(L, live, number, adm->live);
+  couvL_SET_FIELD(L, rejectedRate, number, adm->rejected_rate);
+  couvL_SET_FIELD(L, rejectedConnections, number, adm->rejected_connections);
+  couvL_SET_FIELD(L, rejectedPerIp, number, adm->rejected_per_ip);
+  couvL_SET_FIELD(L, tokens, number, adm->tokens);
+  return 1;
+}
+
+static const struct luaL_Reg admission_methods[] = {
+  { "getAdmissionStats", stream_get_admission_stats },
+  { "setAdmission", stream_set_admission },
+  { NULL, NULL }
+};
+
+int luaopen_couv_admission(lua_State *L) {
+  luaL_getmetatable(L, COUV_STREAM_MTBL_NAME);
+  couvL_setfuncs(L, admission_methods, 0);
+  lua_pop(L, 1);
+  return 0;
+}
@@ -49,6 +49,161 @@ const char *couvL_uv_errname(int uv_errcode) {
   }
 }
 
+#define COUV_SYS_ERRNAME_GEN(name) case name: return #name;
+
+const char *couvL_sys_errname(int sys_errno) {
+  switch (sys_errno) {
+#ifndef _WIN32
+  COUV_SYS_ERRNAME_GEN(EACCES)
+  COUV_SYS_ERRNAME_GEN(EADDRINUSE)
+  COUV_SYS_ERRNAME_GEN(EADDRNOTAVAIL)
+  COUV_SYS_ERRNAME_GEN(EAFNOSUPPORT)
+  COUV_SYS_ERRNAME_GEN(EAGAIN)
+  COUV_SYS_ERRNAME_GEN(EALREADY)
+  COUV_SYS_ERRNAME_GEN(EBADF)
+  COUV_SYS_ERRNAME_GEN(ECONNABORTED)
+  COUV_SYS_ERRNAME_GEN(ECONNREFUSED)
+  COUV_SYS_ERRNAME_GEN(ECONNRESET)
+  COUV_SYS_ERRNAME_GEN(EDESTADDRREQ)
+  COUV_SYS_ERRNAME_GEN(EFAULT)
+  COUV_SYS_ERRNAME_GEN(EHOSTUNREACH)
+  COUV_SYS_ERRNAME_GEN(EINTR)
+  COUV_SYS_ERRNAME_GEN(EINVAL)
+  COUV_SYS_ERRNAME_GEN(EISCONN)
+  COUV_SYS_ERRNAME_GEN(EMFILE)
+  COUV_SYS_ERRNAME_GEN(EMSGSIZE)
+  COUV_SYS_ERRNAME_GEN(ENETDOWN)
+  COUV_SYS_ERRNAME_GEN(ENETUNREACH)
+  COUV_SYS_ERRNAME_GEN(ENFILE)
+  COUV_SYS_ERRNAME_GEN(ENOBUFS)
+  COUV_SYS_ERRNAME_GEN(ENOMEM)
+  COUV_SYS_ERRNAME_GEN(ENOPROTOOPT)
+  COUV_SYS_ERRNAME_GEN(ENOTCONN)
+  COUV_SYS_ERRNAME_GEN(ENOTSOCK)
+  COUV_SYS_ERRNAME_GEN(ENOTSUP)
+  COUV_SYS_ERRNAME_GEN(EPERM)
+  COUV_SYS_ERRNAME_GEN(EPIPE)
+  COUV_SYS_ERRNAME_GEN(EPROTO)
+  COUV_SYS_ERRNAME_GEN(ETIMEDOUT)
+#endif
+  default: return "UNKNOWN";
+  }
+}
+
+int couv_setsockopt_int(uv_os_sock_t sock, int level, int optname,
+    int value) {
+  return setsockopt(sock, level, optname, (const char *)&value,
+      sizeof(value));
+}
+
+int couv_getsockopt_int(uv_os_sock_t sock, int level, int optname,
+    int *value) {
+  socklen_t len;
+
+  len = sizeof(*value);
+  return getsockopt(sock, level, optname, (char *)value, &len);
+}
+
+static int couv_find_sockopt(couv_sockopts_t *deferred, int level,
+    int optname) {
+  int i;
+
+  for (i = 0; i < deferred->cnt; ++i) {
+    if (deferred->opts[i].level == level
+        && deferred->opts[i].optname == optname)
+      return i;
+  }
+  return -1;
+}
+
+/*
+ * Sets the option to the int at index 2. If sock is -1 and deferred is not
+ * NULL, the option is kept in deferred instead.
+ */
+int couvL_set_int_sockopt(lua_State *L, uv_os_sock_t sock,
+    couv_sockopts_t *deferred, int level, int optname) {
+  int value;
+  int i;
+
+  value = luaL_checkint(L, 2);
+  if (sock != -1 || !deferred) {
+    if (couv_setsockopt_int(sock, level, optname, value) < 0)
+      return luaL_error(L, couvL_sock_lasterrname());
+    return 0;
+  }
+
+  i = couv_find_sockopt(deferred, level, optname);
+  if (i == -1) {
+    if (deferred->cnt == COUV_MAX_SOCKOPTS)
+      return luaL_error(L, "ENOBUFS");
+    i = deferred->cnt++;
+    deferred->opts[i].level = level;
+    deferred->opts[i].optname = optname;
+  }
+  deferred->opts[i].value = value;
+  return 0;
+}
+
+/* Pushes the option, or the value kept in deferred while sock is -1. */
+int couvL_get_int_sockopt(lua_State *L, uv_os_sock_t sock,
+    couv_sockopts_t *deferred, int level, int optname) {
+  int value;
+  int i;
+
+  i = deferred && sock == -1 ? couv_find_sockopt(deferred, level, optname)
+      : -1;
+  if (i != -1)
+    value = deferred->opts[i].value;
+  else if (couv_getsockopt_int(sock, level, optname, &value) < 0)
+    return luaL_error(L, couvL_sock_lasterrname());
+  lua_pushnumber(L, value);
+  return 1;
+}
+
+/* Sets the kept options to the new socket. Returns -1 if one fails. */
+int couv_apply_sockopts(uv_os_sock_t sock, couv_sockopts_t *deferred) {
+  int r;
+  int i;
+
+  r = 0;
+  for (i = 0; i < deferred->cnt; ++i) {
+    if (couv_setsockopt_int(sock, deferred->opts[i].level,
+        deferred->opts[i].optname, deferred->opts[i].value) < 0)
+      r = -1;
+  }
+  deferred->cnt = 0;
+  return r;
+}
+
+#ifndef _WIN32
+/*
+ * Creates a non-blocking, close-on-exec socket. uv_tcp_open and uv_udp_open
+ * take the socket as it is, and libuv reads and writes it assuming
+ * O_NONBLOCK. Returns -1 with errno set on error.
+ */
+int couv_socket_nonblock(int family, int type) {
+  int sock;
+  int saved_errno;
+
+#if defined(SOCK_NONBLOCK) && defined(SOCK_CLOEXEC)
+  sock = socket(family, type | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (sock != -1 || errno != EINVAL)
+    return sock;
+#endif
+  sock = socket(family, type, 0);
+  if (sock == -1)
+    return -1;
+  if (fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) | O_NONBLOCK) < 0
+      || fcntl(sock, F_SETFD, FD_CLOEXEC) < 0) {
+    saved_errno = errno;
+    close(sock);
+    errno = saved_errno;
+    return -1;
+  }
+  return sock;
+}
+#endif
+
 
 int couv_newmetatable(lua_State *L, const char *tname,
     const char *super_tname) {
@@ -103,6 +258,21 @@ void *couvL_checkudataclass(lua_State *L, int arg, const char *tname) {
   return p;
 }
 
+int couvL_opt_number_field(lua_State *L, int index, const char *k,
+    double def, double *value) {
+  lua_getfield(L, index, k);
+  if (lua_isnil(L, -1))
+    *value = def;
+  else if (lua_isnumber(L, -1))
+    *value = lua_tonumber(L, -1);
+  else {
+    lua_pop(L, 1);
+    return 0;
+  }
+  lua_pop(L, 1);
+  return 1;
+}
+
 #if LUA_VERSION_NUM == 501
 
 int couv_absindex(lua_State *L, int idx) {
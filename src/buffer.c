@@ -11,6 +11,8 @@ void *couv_buf_mem_alloc(lua_State *L, size_t nbytes) {
     return NULL;
 
   mem->ref_cnt = 1;
+  mem->free_cb = NULL;
+  mem->data = NULL;
   return mem->mem;
 }
 
@@ -26,7 +28,10 @@ void couv_buf_mem_release(lua_State *L, void *ptr) {
 
   mem = container_of(ptr, couv_buf_mem_t, mem);
   if (!--mem->ref_cnt) {
-    couv_free(L, mem);
+    if (mem->free_cb)
+      mem->free_cb(L, mem);
+    else
+      couv_free(L, mem);
   }
 }
 
@@ -83,6 +88,51 @@ uv_buf_t *couv_checkbuforstrtable(lua_State *L, int index, size_t *bufcnt) {
   return buffers;
 }
 
+/*
+ * Retains the memory of the Buffer at index, if it is one, and stores it
+ * at mems[memcnt]. Returns the new count.
+ */
+size_t couv_retain_buf_mem(lua_State *L, int index, void **mems,
+    size_t memcnt) {
+  couv_buf_t *w_buf;
+
+  w_buf = couvL_testudataclass(L, index, COUV_BUFFER_MTBL_NAME);
+  if (w_buf && w_buf->orig) {
+    couv_buf_mem_retain(L, w_buf->orig);
+    mems[memcnt++] = w_buf->orig;
+  }
+  return memcnt;
+}
+
+/* retains the Buffers of the array at index. */
+void **couv_retain_buf_mems(lua_State *L, int index) {
+  void **mems;
+  size_t memcnt;
+  int n;
+  int i;
+
+  n = couv_rawlen(L, index);
+  mems = couv_alloc(L, (n + 1) * sizeof(void *));
+  memcnt = 0;
+  for (i = 1; i <= n; ++i) {
+    lua_rawgeti(L, index, i);
+    memcnt = couv_retain_buf_mem(L, -1, mems, memcnt);
+    lua_pop(L, 1);
+  }
+  mems[memcnt] = NULL;
+  return mems;
+}
+
+void couv_release_buf_mems(lua_State *L, void **mems) {
+  void **p;
+
+  if (!mems)
+    return;
+  for (p = mems; *p; ++p)
+    couv_buf_mem_release(L, *p);
+  couv_free(L, mems);
+}
+
 void couv_dbg_print_bufs(const char *header, uv_buf_t *bufs, size_t bufcnt) {
   size_t i;
 
@@ -127,6 +177,20 @@ static int buffer_gc(lua_State *L) {
   return 0;
 }
 
+/*
+ * Releases the memory before the Buffer is collected, so that a receive
+ * slot goes back to its ring at once. The Buffer is empty after this.
+ */
+static int buffer_release(lua_State *L) {
+  couv_buf_t *buf = couv_checkbuf(L, 1);
+  if (buf->orig) {
+    couv_buf_mem_release(L, buf->orig);
+    buf->orig = NULL;
+  }
+  buf->buf = uv_buf_init(NULL, 0);
+  return 0;
+}
+
 static int buffer_read_uint8(lua_State *L) {
   couv_buf_t *buf = couv_checkbuf(L, 1);
   int position = luaL_checkint(L, 2);
@@ -586,6 +650,7 @@ static const struct luaL_Reg buffer_methods[] = {
   { "readUInt16LE", buffer_read_uint16le },
   { "readUInt32BE", buffer_read_uint32be },
   { "readUInt32LE", buffer_read_uint32le },
+  { "release", buffer_release },
   { "slice", buffer_slice },
   { "toString", buffer_to_string },
   { "write", buffer_write },
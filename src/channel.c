@@ -0,0 +1,277 @@
+#include "couv-private.h"
+
+/*
+ * Channels carry marshalled messages from any thread to the loop which
+ * created the channel. Only that loop, running in the thread which created
+ * the channel, may recv and close it. Senders append to a mutex guarded
+ * queue and wake the owner loop with uv_async. The async callback takes all
+ * the queued messages at once, so that a burst of sends is drained in one
+ * wakeup, and resumes the coroutine waiting in recv.
+ */
+
+typedef struct couv_channel_msg_s {
+  ngx_queue_t *prev;
+  ngx_queue_t *next;
+  couv_msg_t msg;
+} couv_channel_msg_t;
+
+struct couv_channel_s {
+  uv_mutex_t mutex;
+  int ref_cnt;
+  int closed;
+  ngx_queue_t queue;
+
+  /* used only by the thread of the owner loop. */
+  lua_State *L;
+  uv_loop_t *loop;
+  unsigned long tid;
+  uv_async_t async;
+  ngx_queue_t local_queue;
+  lua_State *waiter;
+  int owner_refs;
+};
+
+typedef struct couv_channel_ud_s {
+  couv_channel_t *ch;
+  int owner;
+} couv_channel_ud_t;
+
+static void couv_channel_free_queue(lua_State *L, ngx_queue_t *queue) {
+  couv_channel_msg_t *m;
+
+  while (!ngx_queue_empty(queue)) {
+    m = (couv_channel_msg_t *)ngx_queue_head(queue);
+    ngx_queue_remove(m);
+    couv_msg_free(L, &m->msg);
+    couv_free(L, m);
+  }
+}
+
+void couv_channel_retain(couv_channel_t *ch) {
+  uv_mutex_lock(&ch->mutex);
+  ++ch->ref_cnt;
+  uv_mutex_unlock(&ch->mutex);
+}
+
+void couv_channel_release(lua_State *L, couv_channel_t *ch) {
+  int ref_cnt;
+
+  uv_mutex_lock(&ch->mutex);
+  ref_cnt = --ch->ref_cnt;
+  uv_mutex_unlock(&ch->mutex);
+  if (ref_cnt > 0)
+    return;
+
+  couv_channel_free_queue(L, &ch->queue);
+  couv_channel_free_queue(L, &ch->local_queue);
+  uv_mutex_destroy(&ch->mutex);
+  couv_free(L, ch);
+}
+
+void couv_channel_push(lua_State *L, couv_channel_t *ch) {
+  couv_channel_ud_t *ud;
+
+  ud = lua_newuserdata(L, sizeof(couv_channel_ud_t));
+  ud->ch = ch;
+  /* a loop pointer alone could be shared by states of other threads. */
+  ud->owner = couv_loop(L) == ch->loop && uv_thread_self() == ch->tid;
+  if (ud->owner)
+    ++ch->owner_refs;
+  luaL_getmetatable(L, COUV_CHANNEL_MTBL_NAME);
+  lua_setmetatable(L, -2);
+}
+
+couv_channel_t *couv_tochannel(lua_State *L, int index) {
+  couv_channel_ud_t *ud;
+
+  ud = couvL_testudataclass(L, index, COUV_CHANNEL_MTBL_NAME);
+  return ud ? ud->ch : NULL;
+}
+
+static couv_channel_ud_t *couv_checkchannel(lua_State *L, int index) {
+  return luaL_checkudata(L, index, COUV_CHANNEL_MTBL_NAME);
+}
+
+static void couv_channel_close_cb(uv_handle_t *handle) {
+  couv_channel_t *ch;
+
+  ch = container_of(handle, couv_channel_t, async);
+  couv_channel_release(ch->L, ch);
+}
+
+/* moves the messages sent from all threads to the local queue. */
+static void couv_channel_take(couv_channel_t *ch) {
+  uv_mutex_lock(&ch->mutex);
+  if (!ngx_queue_empty(&ch->queue)) {
+    ngx_queue_add(&ch->local_queue, &ch->queue);
+    ngx_queue_init(&ch->queue);
+  }
+  uv_mutex_unlock(&ch->mutex);
+}
+
+/* pushes the values of the next message, or nothing if there is none. */
+static int couv_channel_pop(lua_State *L, couv_channel_t *ch) {
+  couv_channel_msg_t *m;
+  int n;
+
+  if (ngx_queue_empty(&ch->local_queue))
+    return 0;
+  m = (couv_channel_msg_t *)ngx_queue_head(&ch->local_queue);
+  ngx_queue_remove(m);
+  n = couv_msg_unpack(L, &m->msg);
+  couv_free(L, m);
+  return n;
+}
+
+static void couv_channel_wake_waiter(couv_channel_t *ch) {
+  lua_State *co;
+  int nargs;
+
+  co = ch->waiter;
+  ch->waiter = NULL;
+  uv_unref((uv_handle_t *)&ch->async);
+  lua_pushnil(co);
+  couv_rawsetp(co, LUA_REGISTRYINDEX, COUV_THREAD_REG_KEY(ch));
+  nargs = couv_channel_pop(co, ch);
+  couv_resume(co, co, nargs);
+}
+
+static void couv_channel_async_cb(uv_async_t *async, int status) {
+  couv_channel_t *ch;
+
+  ch = container_of(async, couv_channel_t, async);
+  if (!ch->waiter)
+    return;
+  couv_channel_take(ch);
+  if (!ngx_queue_empty(&ch->local_queue))
+    couv_channel_wake_waiter(ch);
+}
+
+static void couv_channel_close(couv_channel_t *ch) {
+  uv_mutex_lock(&ch->mutex);
+  ch->closed = 1;
+  uv_mutex_unlock(&ch->mutex);
+  uv_close((uv_handle_t *)&ch->async, couv_channel_close_cb);
+}
+
+static int channel_new(lua_State *L) {
+  couv_channel_t *ch;
+
+  ch = couv_alloc(L, sizeof(couv_channel_t));
+  memset(ch, 0, sizeof(couv_channel_t));
+  if (uv_mutex_init(&ch->mutex) != 0) {
+    couv_free(L, ch);
+    return luaL_error(L, "ENOMEM");
+  }
+  /* the async handle holds a reference until it is closed. */
+  ch->ref_cnt = 2;
+  ngx_queue_init(&ch->queue);
+  ngx_queue_init(&ch->local_queue);
+  ch->L = L;
+  ch->loop = couv_loop(L);
+  ch->tid = uv_thread_self();
+  uv_async_init(ch->loop, &ch->async, couv_channel_async_cb);
+  /* the loop is kept alive only while a coroutine waits in recv. */
+  uv_unref((uv_handle_t *)&ch->async);
+
+  couv_channel_push(L, ch);
+  return 1;
+}
+
+static int channel_send(lua_State *L) {
+  couv_channel_t *ch;
+  couv_channel_msg_t *m;
+
+  ch = couv_checkchannel(L, 1)->ch;
+  luaL_checkany(L, 2);
+  m = couv_alloc(L, sizeof(couv_channel_msg_t));
+  couv_msg_init(&m->msg);
+  couv_msg_pack(L, &m->msg, 2, lua_gettop(L) - 1);
+
+  uv_mutex_lock(&ch->mutex);
+  if (ch->closed) {
+    uv_mutex_unlock(&ch->mutex);
+    couv_msg_free(L, &m->msg);
+    couv_free(L, m);
+    return luaL_error(L, "EPIPE");
+  }
+  ngx_queue_insert_tail(&ch->queue, (ngx_queue_t *)m);
+  /* sent with the lock held so that the owner cannot close async first. */
+  uv_async_send(&ch->async);
+  uv_mutex_unlock(&ch->mutex);
+  return 0;
+}
+
+static int channel_recv(lua_State *L) {
+  couv_channel_ud_t *ud;
+  couv_channel_t *ch;
+
+  ud = couv_checkchannel(L, 1);
+  ch = ud->ch;
+  if (!ud->owner)
+    return luaL_error(L, "EPERM");
+  if (ngx_queue_empty(&ch->local_queue))
+    couv_channel_take(ch);
+  if (!ngx_queue_empty(&ch->local_queue) || ch->closed)
+    return couv_channel_pop(L, ch);
+  if (ch->waiter)
+    return luaL_error(L, "EBUSY");
+  if (couvL_is_mainthread(L))
+    return luaL_error(L, "recv must be called in coroutine.");
+  couv_rawsetp(L, LUA_REGISTRYINDEX, COUV_THREAD_REG_KEY(ch));
+  ch->waiter = L;
+  uv_ref((uv_handle_t *)&ch->async);
+  return lua_yield(L, 0);
+}
+
+static int channel_close(lua_State *L) {
+  couv_channel_ud_t *ud;
+
+  ud = couv_checkchannel(L, 1);
+  if (!ud->owner)
+    return luaL_error(L, "EPERM");
+  if (!ud->ch->closed) {
+    couv_channel_close(ud->ch);
+    couv_channel_take(ud->ch);
+    /* the waiter gets the rest of the messages, then nothing. */
+    if (ud->ch->waiter)
+      couv_channel_wake_waiter(ud->ch);
+  }
+  return 0;
+}
+
+static int channel_gc(lua_State *L) {
+  couv_channel_ud_t *ud;
+  couv_channel_t *ch;
+
+  ud = couv_checkchannel(L, 1);
+  ch = ud->ch;
+  if (ud->owner && --ch->owner_refs == 0 && !ch->closed)
+    couv_channel_close(ch);
+  couv_channel_release(L, ch);
+  return 0;
+}
+
+static const struct luaL_Reg channel_functions[] = {
+  { "new", channel_new },
+  { NULL, NULL }
+};
+
+static const struct luaL_Reg channel_methods[] = {
+  { "__gc", channel_gc },
+  { "close", channel_close },
+  { "recv", channel_recv },
+  { "send", channel_send },
+  { NULL, NULL }
+};
+
+int luaopen_couv_channel(lua_State *L) {
+  couv_newmetatable(L, COUV_CHANNEL_MTBL_NAME, NULL);
+  couvL_setfuncs(L, channel_methods, 0);
+  lua_pop(L, 1);
+
+  lua_createtable(L, 0, ARRAY_SIZE(channel_functions) - 1);
+  couvL_setfuncs(L, channel_functions, 0);
+  lua_setfield(L, -2, "Channel");
+  return 0;
+}
@@ -356,8 +356,11 @@ int luaopen_couv_native(lua_State *L) {
   luaopen_couv_loop(L);
 
   luaopen_couv_buffer(L);
+  luaopen_couv_channel(L);
   luaopen_couv_fs(L);
   luaopen_couv_sockaddr(L);
+  luaopen_couv_thread(L);
+  luaopen_couv_work(L);
 
   /* order superclass to subclasses. */
   luaopen_couv_handle(L);
@@ -367,11 +370,17 @@ int luaopen_couv_native(lua_State *L) {
   luaopen_couv_timer(L);
   luaopen_couv_udp(L);
   luaopen_couv_stream(L);
+  luaopen_couv_admission(L);
+  luaopen_couv_proxy(L);
 
   /* subclasses of streams. */
   luaopen_couv_pipe(L);
   luaopen_couv_tcp(L);
+  luaopen_couv_zerocopy(L);
   luaopen_couv_tty(L);
 
+  /* methods of both tcp and udp. */
+  luaopen_couv_pacing(L);
+
   return 1;
 }
@@ -1,11 +1,64 @@
 #include "couv-private.h"
 
+/*
+ * Make callbacks of the handle use the coroutine L, so that a handle can be
+ * used by a coroutine other than the one which created it (e.g. a handle
+ * checked out of a connection pool). Requests and reads keep the coroutine
+ * to resume on their own, see couv_set_req_thread and couv_set_input_waiter.
+ */
+void couv_set_handle_thread(lua_State *L, uv_handle_t *handle) {
+  if (handle->data == L)
+    return;
+  handle->data = L;
+  if (!couvL_is_mainthread(L))
+    couv_rawsetp(L, LUA_REGISTRYINDEX, COUV_THREAD_REG_KEY(handle));
+}
 
-static void close_cb(uv_handle_t *handle) {
+/*
+ * Make the callback of the request resume the coroutine L, which is kept
+ * alive by the registry until couv_take_req_thread is called.
+ */
+void couv_set_req_thread(lua_State *L, uv_req_t *req) {
+  req->data = L;
+  lua_pushthread(L);
+  couv_rawsetp(L, LUA_REGISTRYINDEX, COUV_THREAD_REG_KEY(req));
+}
+
+lua_State *couv_take_req_thread(uv_req_t *req) {
   lua_State *L;
 
-  L = handle->data;
+  L = req->data;
+  lua_pushnil(L);
+  couv_rawsetp(L, LUA_REGISTRYINDEX, COUV_THREAD_REG_KEY(req));
+  return L;
+}
+
+/*
+ * Saves the coroutine L waiting for input of the handle to *waiter, so that
+ * the input callback resumes it even if other coroutines write to or close
+ * the handle meanwhile.
+ */
+void couv_set_input_waiter(lua_State *L, uv_handle_t *handle,
+    lua_State **waiter) {
+  *waiter = L;
+  lua_pushthread(L);
+  couv_rawsetp(L, LUA_REGISTRYINDEX, COUV_INPUT_WAITER_REG_KEY(handle));
+}
 
+/* Returns the coroutine waiting for input and clears it, or NULL. */
+lua_State *couv_take_input_waiter(uv_handle_t *handle, lua_State **waiter) {
+  lua_State *L;
+
+  L = *waiter;
+  if (!L)
+    return NULL;
+  *waiter = NULL;
+  lua_pushnil(L);
+  couv_rawsetp(L, LUA_REGISTRYINDEX, COUV_INPUT_WAITER_REG_KEY(handle));
+  return L;
+}
+
+static void couv_clean_handle(lua_State *L, uv_handle_t *handle) {
   switch (handle->type) {
   case UV_PROCESS:
     couv_clean_process_handle(L, (uv_process_t *)handle);
@@ -22,10 +75,20 @@ static void close_cb(uv_handle_t *handle) {
   case UV_TTY:
     couv_clean_tty_handle(L, (uv_tty_t *)handle);
     break;
+  case UV_NAMED_PIPE:
+    couv_clean_pipe_handle(L, (uv_pipe_t *)handle);
+    break;
   default:
     /* do nothing */
     break;
   }
+}
+
+static void close_cb(uv_handle_t *handle) {
+  lua_State *L;
+
+  L = handle->data;
+  couv_clean_handle(L, handle);
 
   /* If we close handle from another thread, the thread for handle is not
    * yielded, so no need to resume.
@@ -38,6 +101,7 @@ static int couv_close(lua_State *L) {
   uv_handle_t *handle;
 
   handle = couvL_checkudataclass(L, 1, COUV_HANDLE_MTBL_NAME);
+  couv_set_handle_thread(L, handle);
   uv_close(handle, close_cb);
   if (couvL_is_mainthread(L))
     return 0;
@@ -47,6 +111,24 @@ static int couv_close(lua_State *L) {
   }
 }
 
+static void close_nowait_cb(uv_handle_t *handle) {
+  couv_clean_handle(handle->data, handle);
+}
+
+/* closes the handle without waiting for the close callback. */
+void couv_close_nowait(uv_handle_t *handle) {
+  if (!uv_is_closing(handle))
+    uv_close(handle, close_nowait_cb);
+}
+
+static int couv_close_no_wait(lua_State *L) {
+  uv_handle_t *handle;
+
+  handle = couvL_checkudataclass(L, 1, COUV_HANDLE_MTBL_NAME);
+  couv_close_nowait(handle);
+  return 0;
+}
+
 static int couv_is_active(lua_State *L) {
   uv_handle_t *handle;
 
@@ -91,6 +173,7 @@ static int couv_handle_guess(lua_State *L) {
 
 static const struct luaL_Reg handle_methods[] = {
   { "_close", couv_close },
+  { "closeNoWait", couv_close_no_wait },
   { "isActive", couv_is_active },
   { "isClosing", couv_is_closing },
   { "ref", couv_ref },
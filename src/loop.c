@@ -72,7 +72,12 @@ static const struct luaL_Reg loop_functions[] = {
 };
 
 int luaopen_couv_loop(lua_State *L) {
-  couv_default_loop(L);
+  /* keep the loop which is set before loading, such as in a Thread. */
+  couv_get_loop(L);
+  if (lua_isnil(L, -1)) {
+    lua_pop(L, 1);
+    couv_default_loop(L);
+  }
   couv_set_loop(L);
 
   couvL_setfuncs(L, loop_functions, 0);
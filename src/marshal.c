@@ -0,0 +1,298 @@
+#include "couv-private.h"
+
+/*
+ * Marshalling of values into a message which is unpacked in another
+ * lua_State, possibly of another thread. nil, booleans, numbers, strings,
+ * Buffers, Channels and tables of them are supported. The memory of a
+ * Buffer which has no other user is moved into the message and the Buffer
+ * becomes empty. Otherwise the data is copied, as it is for a pending write
+ * which retains the memory, or for the second occurrence of a Buffer in the
+ * message. Channels are passed by reference.
+ */
+
+#define COUV_MSG_MAX_DEPTH 32
+
+#define COUV_MSG_NIL 0
+#define COUV_MSG_FALSE 1
+#define COUV_MSG_TRUE 2
+#define COUV_MSG_NUMBER 3
+#define COUV_MSG_STRING 4
+#define COUV_MSG_BUFFER 5
+#define COUV_MSG_TABLE 6
+#define COUV_MSG_TABLE_END 7
+#define COUV_MSG_CHANNEL 8
+
+typedef struct couv_msg_buffer_s {
+  void *orig;
+  size_t offset;
+  size_t len;
+} couv_msg_buffer_t;
+
+void couv_msg_init(couv_msg_t *msg) {
+  msg->data = NULL;
+  msg->len = 0;
+  msg->cap = 0;
+}
+
+static void couv_msg_write(lua_State *L, couv_msg_t *msg, const void *p,
+    size_t len) {
+  char *data;
+  size_t cap;
+
+  if (msg->len + len > msg->cap) {
+    cap = msg->cap ? msg->cap * 2 : 64;
+    while (cap < msg->len + len)
+      cap *= 2;
+    data = couv_alloc(L, cap);
+    if (msg->len)
+      memcpy(data, msg->data, msg->len);
+    couv_free(L, msg->data);
+    msg->data = data;
+    msg->cap = cap;
+  }
+  memcpy(msg->data + msg->len, p, len);
+  msg->len += len;
+}
+
+static void couv_msg_write_tag(lua_State *L, couv_msg_t *msg, int tag) {
+  unsigned char c;
+
+  c = (unsigned char)tag;
+  couv_msg_write(L, msg, &c, 1);
+}
+
+static void couv_msg_read(couv_msg_t *msg, size_t *pos, void *p,
+    size_t len) {
+  memcpy(p, msg->data + *pos, len);
+  *pos += len;
+}
+
+/* raises an error if the value at index cannot be marshalled. */
+static void couv_msg_check(lua_State *L, int index, int depth) {
+  switch (lua_type(L, index)) {
+  case LUA_TNIL:
+  case LUA_TBOOLEAN:
+  case LUA_TNUMBER:
+  case LUA_TSTRING:
+    return;
+  case LUA_TUSERDATA:
+    if (couvL_testudataclass(L, index, COUV_BUFFER_MTBL_NAME)
+        || couv_tochannel(L, index))
+      return;
+    break;
+  case LUA_TTABLE:
+    if (depth >= COUV_MSG_MAX_DEPTH)
+      luaL_error(L, "table nested too deep to marshal");
+    luaL_checkstack(L, 2, NULL);
+    index = couv_absindex(L, index);
+    lua_pushnil(L);
+    while (lua_next(L, index)) {
+      couv_msg_check(L, -2, depth + 1);
+      couv_msg_check(L, -1, depth + 1);
+      lua_pop(L, 1);
+    }
+    return;
+  }
+  luaL_error(L, "cannot marshal %s", luaL_typename(L, index));
+}
+
+/*
+ * The Buffers moved into the message are set to the table at moved, and
+ * emptied only after the whole message is packed, so that a Buffer which
+ * occurs twice is moved once and copied for the other.
+ */
+static void couv_msg_pack_buffer(lua_State *L, couv_msg_t *msg, int index,
+    int moved) {
+  couv_buf_t *w_buf;
+  couv_buf_mem_t *mem;
+  couv_msg_buffer_t b;
+  int seen;
+
+  w_buf = lua_touserdata(L, index);
+  lua_pushvalue(L, index);
+  lua_rawget(L, moved);
+  seen = !lua_isnil(L, -1);
+  lua_pop(L, 1);
+  mem = w_buf->orig ? container_of(w_buf->orig, couv_buf_mem_t, mem) : NULL;
+  if (mem && mem->ref_cnt == 1 && !mem->free_cb && !seen) {
+    b.orig = w_buf->orig;
+    b.offset = w_buf->buf.base - (char *)w_buf->orig;
+    b.len = w_buf->buf.len;
+    lua_pushvalue(L, index);
+    lua_pushboolean(L, 1);
+    lua_rawset(L, moved);
+  } else {
+    b.orig = couv_buf_mem_alloc(L, w_buf->buf.len);
+    memcpy(b.orig, w_buf->buf.base, w_buf->buf.len);
+    b.offset = 0;
+    b.len = w_buf->buf.len;
+  }
+  couv_msg_write_tag(L, msg, COUV_MSG_BUFFER);
+  couv_msg_write(L, msg, &b, sizeof(b));
+}
+
+static void couv_msg_pack_value(lua_State *L, couv_msg_t *msg, int index,
+    int moved) {
+  lua_Number num;
+  const char *str;
+  size_t len;
+  couv_channel_t *ch;
+
+  switch (lua_type(L, index)) {
+  case LUA_TNIL:
+    couv_msg_write_tag(L, msg, COUV_MSG_NIL);
+    break;
+  case LUA_TBOOLEAN:
+    couv_msg_write_tag(L, msg,
+        lua_toboolean(L, index) ? COUV_MSG_TRUE : COUV_MSG_FALSE);
+    break;
+  case LUA_TNUMBER:
+    num = lua_tonumber(L, index);
+    couv_msg_write_tag(L, msg, COUV_MSG_NUMBER);
+    couv_msg_write(L, msg, &num, sizeof(num));
+    break;
+  case LUA_TSTRING:
+    str = lua_tolstring(L, index, &len);
+    couv_msg_write_tag(L, msg, COUV_MSG_STRING);
+    couv_msg_write(L, msg, &len, sizeof(len));
+    couv_msg_write(L, msg, str, len);
+    break;
+  case LUA_TUSERDATA:
+    ch = couv_tochannel(L, index);
+    if (ch) {
+      couv_channel_retain(ch);
+      couv_msg_write_tag(L, msg, COUV_MSG_CHANNEL);
+      couv_msg_write(L, msg, &ch, sizeof(ch));
+    } else
+      couv_msg_pack_buffer(L, msg, index, moved);
+    break;
+  case LUA_TTABLE:
+    couv_msg_write_tag(L, msg, COUV_MSG_TABLE);
+    luaL_checkstack(L, 4, NULL);
+    index = couv_absindex(L, index);
+    lua_pushnil(L);
+    while (lua_next(L, index)) {
+      couv_msg_pack_value(L, msg, -2, moved);
+      couv_msg_pack_value(L, msg, -1, moved);
+      lua_pop(L, 1);
+    }
+    couv_msg_write_tag(L, msg, COUV_MSG_TABLE_END);
+    break;
+  }
+}
+
+void couv_msg_pack(lua_State *L, couv_msg_t *msg, int index, int n) {
+  couv_buf_t *w_buf;
+  int moved;
+  int i;
+
+  index = couv_absindex(L, index);
+  /* check all values first not to move Buffers of a rejected message. */
+  for (i = 0; i < n; ++i)
+    couv_msg_check(L, index + i, 0);
+  lua_newtable(L);
+  moved = lua_gettop(L);
+  for (i = 0; i < n; ++i)
+    couv_msg_pack_value(L, msg, index + i, moved);
+
+  lua_pushnil(L);
+  while (lua_next(L, moved)) {
+    lua_pop(L, 1);
+    w_buf = lua_touserdata(L, -1);
+    w_buf->orig = NULL;
+    w_buf->buf = uv_buf_init(NULL, 0);
+  }
+  lua_pop(L, 1);
+}
+
+/*
+ * Pushes the value at pos, or only releases its Buffers and Channels if
+ * push is 0. Returns the tag of the value.
+ */
+static int couv_msg_unpack_value(lua_State *L, couv_msg_t *msg, size_t *pos,
+    int push) {
+  unsigned char tag;
+  lua_Number num;
+  size_t len;
+  couv_msg_buffer_t b;
+  couv_buf_t *w_buf;
+  couv_channel_t *ch;
+
+  couv_msg_read(msg, pos, &tag, 1);
+  switch (tag) {
+  case COUV_MSG_NIL:
+    if (push)
+      lua_pushnil(L);
+    break;
+  case COUV_MSG_FALSE:
+  case COUV_MSG_TRUE:
+    if (push)
+      lua_pushboolean(L, tag == COUV_MSG_TRUE);
+    break;
+  case COUV_MSG_NUMBER:
+    couv_msg_read(msg, pos, &num, sizeof(num));
+    if (push)
+      lua_pushnumber(L, num);
+    break;
+  case COUV_MSG_STRING:
+    couv_msg_read(msg, pos, &len, sizeof(len));
+    if (push)
+      lua_pushlstring(L, msg->data + *pos, len);
+    *pos += len;
+    break;
+  case COUV_MSG_BUFFER:
+    couv_msg_read(msg, pos, &b, sizeof(b));
+    if (push) {
+      w_buf = lua_newuserdata(L, sizeof(couv_buf_t));
+      w_buf->orig = b.orig;
+      w_buf->buf = uv_buf_init((char *)b.orig + b.offset, b.len);
+      luaL_getmetatable(L, COUV_BUFFER_MTBL_NAME);
+      lua_setmetatable(L, -2);
+    } else
+      couv_buf_mem_release(L, b.orig);
+    break;
+  case COUV_MSG_CHANNEL:
+    couv_msg_read(msg, pos, &ch, sizeof(ch));
+    if (push)
+      couv_channel_push(L, ch);
+    else
+      couv_channel_release(L, ch);
+    break;
+  case COUV_MSG_TABLE:
+    if (push) {
+      luaL_checkstack(L, 3, NULL);
+      lua_newtable(L);
+    }
+    while (couv_msg_unpack_value(L, msg, pos, push) != COUV_MSG_TABLE_END) {
+      couv_msg_unpack_value(L, msg, pos, push);
+      if (push)
+        lua_rawset(L, -3);
+    }
+    break;
+  }
+  return tag;
+}
+
+int couv_msg_unpack(lua_State *L, couv_msg_t *msg) {
+  size_t pos;
+  int n;
+
+  pos = 0;
+  for (n = 0; pos < msg->len; ++n) {
+    luaL_checkstack(L, 1, NULL);
+    couv_msg_unpack_value(L, msg, &pos, 1);
+  }
+  couv_free(L, msg->data);
+  couv_msg_init(msg);
+  return n;
+}
+
+void couv_msg_free(lua_State *L, couv_msg_t *msg) {
+  size_t pos;
+
+  pos = 0;
+  while (pos < msg->len)
+    couv_msg_unpack_value(L, msg, &pos, 0);
+  couv_free(L, msg->data);
+  couv_msg_init(msg);
+}
@@ -0,0 +1,422 @@
+#include "couv-private.h"
+
+/*
+ * Send pacing for Tcp and Udp handles. A rate in bytes per second is set
+ * with SO_MAX_PACING_RATE when the kernel supports it. Otherwise, or for a
+ * fixed quantum per tick, sends are released by a token bucket refilled
+ * by a timer, and queued sends resume their coroutines only when their
+ * bytes are released and written.
+ */
+
+#if defined(__linux__) && defined(SO_MAX_PACING_RATE)
+#define COUV_HAVE_KERNEL_PACING 1
+#endif
+
+#define COUV_PACING_DEFAULT_INTERVAL 1
+
+#define COUV_PACING_OFF 0
+#define COUV_PACING_KERNEL 1
+#define COUV_PACING_USERLAND 2
+
+struct couv_pacer_s {
+  lua_State *L;
+  uv_handle_t *handle;
+  uv_timer_t timer;
+  int mode;
+  double rate;
+  double burst;
+  double tokens;
+  int64_t interval;
+  int64_t last_refill;
+  ngx_queue_t queue;
+  int queued;
+  double queued_bytes;
+  double released;
+  double delayed;
+  /* set while a waiting send is resumed to retry with its bytes released. */
+  int granted;
+};
+
+typedef struct couv_pacer_write_s {
+  couv_pacer_item_t item;
+  uv_write_t req;
+  uv_stream_t *handle;
+  uv_buf_t *bufs;
+  size_t bufcnt;
+  void **mems;
+} couv_pacer_write_t;
+
+static const char *couv_pacing_mode_names[] = { "off", "kernel", "userland" };
+
+static couv_pacer_t **couv_get_pacer_slot(uv_handle_t *handle) {
+  if (handle->type == UV_TCP)
+    return &container_of(handle, couv_tcp_t, handle)->pacer;
+  return &((couv_udp_t *)handle)->hdata.pacer;
+}
+
+static void couv_pacer_refill(couv_pacer_t *pacer) {
+  int64_t now;
+
+  now = uv_now(pacer->handle->loop);
+  pacer->tokens += (double)(now - pacer->last_refill) * pacer->rate / 1000;
+  if (pacer->tokens > pacer->burst)
+    pacer->tokens = pacer->burst;
+  pacer->last_refill = now;
+}
+
+static void couv_pacer_release(couv_pacer_t *pacer) {
+  couv_pacer_item_t *item;
+
+  item = (couv_pacer_item_t *)ngx_queue_head(&pacer->queue);
+  ngx_queue_remove(item);
+  --pacer->queued;
+  pacer->queued_bytes -= item->len;
+  pacer->released += item->len;
+  item->cb(item, 0);
+}
+
+/*
+ * Releases queued sends while there are tokens. A send may take more
+ * tokens than there are, and the next one waits until they are paid back,
+ * so sends larger than the burst are not stuck.
+ */
+static void couv_pacer_timer_cb(uv_timer_t *timer, int status) {
+  couv_pacer_t *pacer;
+
+  pacer = container_of(timer, couv_pacer_t, timer);
+  couv_pacer_refill(pacer);
+  while (!ngx_queue_empty(&pacer->queue) && pacer->tokens > 0) {
+    pacer->tokens -= ((couv_pacer_item_t *)ngx_queue_head(&pacer->queue))->len;
+    couv_pacer_release(pacer);
+  }
+  if (ngx_queue_empty(&pacer->queue))
+    uv_timer_stop(&pacer->timer);
+}
+
+static void couv_pacer_release_all(couv_pacer_t *pacer) {
+  uv_timer_stop(&pacer->timer);
+  while (!ngx_queue_empty(&pacer->queue))
+    couv_pacer_release(pacer);
+}
+
+int couv_pacer_admit(couv_pacer_t *pacer, size_t len) {
+  if (pacer->mode != COUV_PACING_USERLAND)
+    return 1;
+  couv_pacer_refill(pacer);
+  if (!ngx_queue_empty(&pacer->queue) || pacer->tokens <= 0)
+    return 0;
+  pacer->tokens -= len;
+  pacer->released += len;
+  return 1;
+}
+
+void couv_pacer_enqueue(lua_State *L, couv_pacer_t *pacer,
+    couv_pacer_item_t *item, size_t len, couv_pacer_cb cb, int resume) {
+  item->pacer = pacer;
+  item->len = len;
+  item->cb = cb;
+  item->co = NULL;
+  if (resume) {
+    item->co = L;
+    lua_pushthread(L);
+    couv_rawsetp(L, LUA_REGISTRYINDEX, item);
+  }
+  ngx_queue_insert_tail(&pacer->queue, (ngx_queue_t *)item);
+  ++pacer->queued;
+  pacer->queued_bytes += len;
+  ++pacer->delayed;
+  if (!uv_is_active((uv_handle_t *)&pacer->timer)) {
+    uv_timer_start(&pacer->timer, couv_pacer_timer_cb, pacer->interval,
+        pacer->interval);
+  }
+}
+
+void couv_pacer_finish(couv_pacer_item_t *item, const char *err_name) {
+  lua_State *co;
+  int nargs;
+
+  co = item->co;
+  if (!co) {
+    couv_free(item->pacer->L, item);
+    return;
+  }
+
+  if (err_name) {
+    lua_pushstring(co, err_name);
+    nargs = 1;
+  } else
+    nargs = 0;
+  couv_resume(co, co, nargs);
+
+  /* the coroutine is kept alive by the registry until it has run. */
+  lua_pushnil(co);
+  couv_rawsetp(co, LUA_REGISTRYINDEX, item);
+  couv_free(co, item);
+}
+
+static void couv_pacer_write_cb(uv_write_t *req, int status) {
+  couv_pacer_write_t *w;
+
+  w = container_of(req, couv_pacer_write_t, req);
+  couv_release_buf_mems(w->item.co, w->mems);
+  couv_free(w->item.co, w->bufs);
+  couv_pacer_finish(&w->item,
+      status < 0 ? couvL_uv_lasterrname(req->handle->loop) : NULL);
+}
+
+static void couv_pacer_release_write(couv_pacer_item_t *item, int status) {
+  couv_pacer_write_t *w;
+
+  w = (couv_pacer_write_t *)item;
+  if (status < 0) {
+    couv_release_buf_mems(item->co, w->mems);
+    couv_free(item->co, w->bufs);
+    couv_pacer_finish(item, "ECANCELED");
+    return;
+  }
+  if (uv_write(&w->req, w->handle, w->bufs, (int)w->bufcnt,
+      couv_pacer_write_cb) < 0) {
+    couv_release_buf_mems(item->co, w->mems);
+    couv_free(item->co, w->bufs);
+    couv_pacer_finish(item, couvL_uv_lasterrname(w->handle->loop));
+  }
+}
+
+int couv_pacer_write(lua_State *L, couv_pacer_t *pacer, uv_stream_t *handle,
+    int index, uv_buf_t *bufs, size_t bufcnt) {
+  couv_pacer_write_t *w;
+  size_t len;
+  size_t i;
+
+  len = 0;
+  for (i = 0; i < bufcnt; ++i)
+    len += bufs[i].len;
+  if (couv_pacer_admit(pacer, len))
+    return couv_stream_write_bufs(L, handle, index, bufs, bufcnt);
+
+  /* the bufs point into the arguments, which the yielded coroutine keeps. */
+  w = couv_alloc(L, sizeof(couv_pacer_write_t));
+  w->handle = handle;
+  w->bufs = bufs;
+  w->bufcnt = bufcnt;
+  w->mems = couv_retain_buf_mems(L, index);
+  couv_pacer_enqueue(L, pacer, &w->item, len, couv_pacer_release_write, 1);
+  return lua_yield(L, 0);
+}
+
+static void couv_pacer_release_wait(couv_pacer_item_t *item, int status) {
+  couv_pacer_t *pacer;
+
+  if (status < 0) {
+    couv_pacer_finish(item, "ECANCELED");
+    return;
+  }
+  pacer = item->pacer;
+  pacer->granted = 1;
+  couv_pacer_finish(item, NULL);
+  pacer->granted = 0;
+}
+
+int couv_pacer_admit_or_wait(lua_State *L, couv_pacer_t *pacer,
+    size_t len) {
+  couv_pacer_item_t *item;
+
+  if (pacer->granted) {
+    pacer->granted = 0;
+    return 1;
+  }
+  if (couv_pacer_admit(pacer, len))
+    return 1;
+  item = couv_alloc(L, sizeof(couv_pacer_item_t));
+  couv_pacer_enqueue(L, pacer, item, len, couv_pacer_release_wait, 1);
+  return 0;
+}
+
+static void couv_pacer_timer_close_cb(uv_handle_t *handle) {
+  couv_pacer_t *pacer;
+
+  pacer = container_of(handle, couv_pacer_t, timer);
+  couv_free(pacer->L, pacer);
+}
+
+void couv_clean_pacer(lua_State *L, uv_handle_t *handle) {
+  couv_pacer_t **slot;
+  couv_pacer_t *pacer;
+  couv_pacer_item_t *item;
+
+  slot = couv_get_pacer_slot(handle);
+  pacer = *slot;
+  if (!pacer)
+    return;
+
+  *slot = NULL;
+  while (!ngx_queue_empty(&pacer->queue)) {
+    item = (couv_pacer_item_t *)ngx_queue_head(&pacer->queue);
+    ngx_queue_remove(item);
+    --pacer->queued;
+    item->cb(item, -1);
+  }
+  uv_close((uv_handle_t *)&pacer->timer, couv_pacer_timer_close_cb);
+}
+
+#ifdef COUV_HAVE_KERNEL_PACING
+static int couv_pacer_set_kernel_rate(uv_handle_t *handle, double rate) {
+  unsigned value;
+
+  value = rate >= (double)~0U ? ~0U : (unsigned)rate;
+  if (handle->type == UV_TCP) {
+    return setsockopt(couv_handle_fd((uv_tcp_t *)handle), SOL_SOCKET,
+        SO_MAX_PACING_RATE, &value, sizeof(value));
+  }
+  return setsockopt(couv_handle_fd((uv_udp_t *)handle), SOL_SOCKET,
+      SO_MAX_PACING_RATE, &value, sizeof(value));
+}
+#endif
+
+static uv_handle_t *couv_check_paced_handle(lua_State *L, int index) {
+  uv_handle_t *handle;
+
+  handle = couvL_testudataclass(L, index, COUV_TCP_MTBL_NAME);
+  if (handle)
+    return handle;
+  return couvL_checkudataclass(L, index, COUV_UDP_MTBL_NAME);
+}
+
+/*
+ * setPacing{rate=bytesPerSec, burst=bytes, interval=msecs, kernel=bool}
+ * caps the send rate, with SO_MAX_PACING_RATE unless kernel is false or
+ * the kernel does not support it. burst must be positive, since a send
+ * waits for tokens. Udp handles use SO_MAX_PACING_RATE only if kernel is
+ * true, as it paces datagrams only under the fq qdisc.
+ * setPacing{quantum=bytes, interval=msecs} releases quantum bytes every
+ * interval msecs. setPacing(nil) turns pacing off and releases the queued
+ * sends. Returns the mode, "kernel" or "userland".
+ */
+static int pacing_set(lua_State *L) {
+  uv_handle_t *handle;
+  couv_pacer_t **slot;
+  couv_pacer_t *pacer;
+  double rate;
+  double burst;
+  double quantum;
+  double interval;
+  int kernel;
+  int mode;
+
+  handle = couv_check_paced_handle(L, 1);
+  slot = couv_get_pacer_slot(handle);
+  pacer = *slot;
+
+  if (!lua_toboolean(L, 2)) {
+    if (!pacer)
+      return 0;
+#ifdef COUV_HAVE_KERNEL_PACING
+    if (pacer->mode == COUV_PACING_KERNEL)
+      couv_pacer_set_kernel_rate(handle, (double)~0U);
+#endif
+    pacer->mode = COUV_PACING_OFF;
+    couv_pacer_release_all(pacer);
+    return 0;
+  }
+
+  luaL_checktype(L, 2, LUA_TTABLE);
+  luaL_argcheck(L, couvL_opt_number_field(L, 2, "rate", 0, &rate)
+      && couvL_opt_number_field(L, 2, "quantum", 0, &quantum)
+      && couvL_opt_number_field(L, 2, "interval",
+          COUV_PACING_DEFAULT_INTERVAL, &interval),
+      2, "values must be numbers");
+  luaL_argcheck(L, (rate > 0) != (quantum > 0), 2,
+      "either rate or quantum must be positive");
+  luaL_argcheck(L, interval >= 1, 2, "interval must be at least 1");
+  if (quantum > 0) {
+    rate = quantum * 1000 / interval;
+    burst = quantum;
+    kernel = 0;
+  } else {
+    luaL_argcheck(L, couvL_opt_number_field(L, 2, "burst",
+        rate * interval / 1000, &burst) && burst > 0, 2,
+        "burst must be a positive number");
+    /* SO_MAX_PACING_RATE paces Udp only under the fq qdisc. */
+    lua_getfield(L, 2, "kernel");
+    if (lua_isnil(L, -1))
+      kernel = handle->type == UV_TCP;
+    else
+      kernel = lua_toboolean(L, -1);
+    lua_pop(L, 1);
+  }
+
+  if (!pacer) {
+    pacer = couv_alloc(L, sizeof(couv_pacer_t));
+    memset(pacer, 0, sizeof(couv_pacer_t));
+    pacer->L = L;
+    pacer->handle = handle;
+    ngx_queue_init(&pacer->queue);
+    uv_timer_init(couv_loop(L), &pacer->timer);
+    pacer->tokens = burst;
+    pacer->last_refill = uv_now(couv_loop(L));
+    *slot = pacer;
+  }
+
+  mode = COUV_PACING_USERLAND;
+#ifdef COUV_HAVE_KERNEL_PACING
+  if (kernel && couv_pacer_set_kernel_rate(handle, rate) == 0)
+    mode = COUV_PACING_KERNEL;
+  else if (pacer->mode == COUV_PACING_KERNEL)
+    couv_pacer_set_kernel_rate(handle, (double)~0U);
+#endif
+
+  couv_pacer_refill(pacer);
+  pacer->mode = mode;
+  pacer->rate = rate;
+  pacer->burst = burst;
+  pacer->interval = (int64_t)interval;
+  if (pacer->tokens > burst)
+    pacer->tokens = burst;
+  if (mode == COUV_PACING_KERNEL)
+    couv_pacer_release_all(pacer);
+  else if (uv_is_active((uv_handle_t *)&pacer->timer)) {
+    uv_timer_start(&pacer->timer, couv_pacer_timer_cb, pacer->interval,
+        pacer->interval);
+  }
+
+  lua_pushstring(L, couv_pacing_mode_names[mode]);
+  return 1;
+}
+
+static int pacing_get_stats(lua_State *L) {
+  uv_handle_t *handle;
+  couv_pacer_t *pacer;
+
+  handle = couv_check_paced_handle(L, 1);
+  pacer = *couv_get_pacer_slot(handle);
+  if (!pacer) {
+    lua_pushnil(L);
+    return 1;
+  }
+
+  lua_createtable(L, 0, 6);
+  couvL_SET_FIELD(L, mode, string, couv_pacing_mode_names[pacer->mode]);
+  couvL_SET_FIELD(L, rate, number, pacer->rate);
+  couvL_SET_FIELD(L, queued, number, pacer->queued);
+  couvL_SET_FIELD(L, queuedBytes, number, pacer->queued_bytes);
+  couvL_SET_FIELD(L, released, number, pacer->released);
+  couvL_SET_FIELD(L, delayed, number, pacer->delayed);
+  return 1;
+}
+
+static const struct luaL_Reg pacing_methods[] = {
+  { "getPacingStats", pacing_get_stats },
+  { "setPacing", pacing_set },
+  { NULL, NULL }
+};
+
+int luaopen_couv_pacing(lua_State *L) {
+  luaL_getmetatable(L, COUV_TCP_MTBL_NAME);
+  couvL_setfuncs(L, pacing_methods, 0);
+  lua_pop(L, 1);
+
+  luaL_getmetatable(L, COUV_UDP_MTBL_NAME);
+  couvL_setfuncs(L, pacing_methods, 0);
+  lua_pop(L, 1);
+  return 0;
+}
@@ -22,6 +22,9 @@ static uv_pipe_t *couv_new_pipe_handle(lua_State *L) {
 }
 
 void couv_clean_pipe_handle(lua_State *L, uv_pipe_t *handle) {
+  couv_clean_stream_admission((uv_stream_t *)handle);
+  couv_clean_stream_proxy((uv_stream_t *)handle);
+
   lua_pushnil(L);
   couv_rawsetp(L, LUA_REGISTRYINDEX, COUV_USERDATA_REG_KEY(handle));
 
@@ -30,6 +33,8 @@ void couv_clean_pipe_handle(lua_State *L, uv_pipe_t *handle) {
 
   lua_pushnil(L);
   couv_rawsetp(L, LUA_REGISTRYINDEX, COUV_LISTEN_CB_REG_KEY(handle));
+
+  couv_cancel_stream_reader((uv_stream_t *)handle);
 }
 
 static int pipe_new(lua_State *L) {
@@ -52,7 +57,7 @@ static int pipe_new(lua_State *L) {
 
   handle->data = L;
   hdata = couv_get_stream_handle_data((uv_stream_t *)handle);
-  ngx_queue_init(&hdata->input_queue);
+  couv_init_stream_handle_data(hdata);
 
   lua_pushvalue(L, -1);
   couv_rawsetp(L, LUA_REGISTRYINDEX, COUV_USERDATA_REG_KEY(handle));
@@ -63,9 +68,9 @@ static void connect_cb(uv_connect_t *req, int status) {
   lua_State *L;
   int nresults = 0;
 
-  L = req->handle->data;
+  L = couv_take_req_thread((uv_req_t *)req);
   if (status < 0) {
-    lua_pushstring(L, couvL_uv_lasterrname(couv_loop(L)));
+    lua_pushstring(L, couvL_uv_lasterrname(req->handle->loop));
     nresults = 1;
   }
 
@@ -84,6 +89,7 @@ static int pipe_connect(lua_State *L) {
   req = couv_alloc(L, sizeof(uv_connect_t));
   if (!req)
     return 0;
+  couv_set_req_thread(L, (uv_req_t *)req);
   uv_pipe_connect(req, handle, name, connect_cb);
   return lua_yield(L, 0);
 }
@@ -135,7 +141,8 @@ static void read2_cb(uv_pipe_t *pipe, ssize_t nread, uv_buf_t buf,
   hdata = couv_get_stream_handle_data((uv_stream_t *)pipe);
   ngx_queue_insert_tail(&hdata->input_queue, (ngx_queue_t *)input);
 
-  if (lua_status(L) == LUA_YIELD)
+  L = couv_take_input_waiter((uv_handle_t *)pipe, &hdata->read_waiter);
+  if (L)
     couv_resume(L, L, 0);
 }
 
@@ -160,8 +167,12 @@ static int couv_prim_read2(lua_State *L) {
   handle = couvL_checkudataclass(L, 1, COUV_PIPE_MTBL_NAME);
   hdata = couv_get_stream_handle_data(handle);
 
-  if (ngx_queue_empty(&hdata->input_queue))
+  if (ngx_queue_empty(&hdata->input_queue)) {
+    if (hdata->read_waiter)
+      return luaL_error(L, "EBUSY");
+    couv_set_input_waiter(L, (uv_handle_t *)handle, &hdata->read_waiter);
     return lua_yield(L, 0);
+  }
   input = (couv_pipe_input_t *)ngx_queue_head(&hdata->input_queue);
   ngx_queue_remove(input);
 
@@ -173,6 +184,7 @@ static int couv_prim_read2(lua_State *L) {
   *w_buf = input->w_buf;
 
   lua_pushnumber(L, input->pending);
+  couv_free(L, input);
 
   return 3;
 }
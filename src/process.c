@@ -19,6 +19,9 @@ void couv_clean_process_handle(lua_State *L, uv_process_t *handle) {
 
   lua_pushnil(L);
   couv_rawsetp(L, LUA_REGISTRYINDEX, COUV_EXIT_CB_REG_KEY(handle));
+
+  lua_pushnil(L);
+  couv_rawsetp(L, LUA_REGISTRYINDEX, COUV_THREAD_REG_KEY(handle));
 }
 
 static const char **couv_tonullterminatedstrarray(lua_State *L, int index,
@@ -0,0 +1,334 @@
+#include "couv-private.h"
+
+/*
+ * Bidirectional proxy between two connected streams. Data read from one
+ * stream is written to the other in C. Reading is paused while the write
+ * queue of the other stream is above the high water mark, and EOF is
+ * propagated with shutdown. The calling coroutine is resumed once with
+ * the stats when both directions are done, on error or on idle timeout.
+ */
+
+#define COUV_PROXY_DEFAULT_HIGH_WATER_MARK (1024 * 1024)
+
+struct couv_proxy_s {
+  lua_State *L;
+  uv_stream_t *streams[2];
+  int paused[2];
+  int eof[2];
+  int shut[2];
+  double bytes[2];
+  size_t high_water_mark;
+  uv_timer_t timer;
+  int64_t idle_timeout;
+  int64_t last_activity;
+  int64_t start_time;
+  int pending;
+  int timer_active;
+  int finished;
+  int yielded;
+};
+
+typedef struct couv_proxy_write_s {
+  uv_write_t req;
+  couv_proxy_t *proxy;
+  int dir;
+  void *mem;
+} couv_proxy_write_t;
+
+typedef struct couv_proxy_shutdown_s {
+  uv_shutdown_t req;
+  couv_proxy_t *proxy;
+  int dir;
+} couv_proxy_shutdown_t;
+
+static void proxy_maybe_free(couv_proxy_t *proxy) {
+  if (!proxy->finished || proxy->pending || proxy->timer_active)
+    return;
+  lua_pushnil(proxy->L);
+  couv_rawsetp(proxy->L, LUA_REGISTRYINDEX, COUV_THREAD_REG_KEY(proxy));
+  couv_free(proxy->L, proxy);
+}
+
+static void proxy_timer_close_cb(uv_handle_t *handle) {
+  couv_proxy_t *proxy;
+
+  proxy = container_of(handle, couv_proxy_t, timer);
+  proxy->timer_active = 0;
+  proxy_maybe_free(proxy);
+}
+
+static void proxy_finish(couv_proxy_t *proxy, const char *reason) {
+  lua_State *L;
+  uv_stream_t *stream;
+  int i;
+
+  if (proxy->finished)
+    return;
+  proxy->finished = 1;
+
+  for (i = 0; i < 2; ++i) {
+    stream = proxy->streams[i];
+    if (!stream)
+      continue;
+    couv_get_stream_handle_data(stream)->proxy = NULL;
+    if (!uv_is_closing((uv_handle_t *)stream))
+      uv_read_stop(stream);
+  }
+  uv_close((uv_handle_t *)&proxy->timer, proxy_timer_close_cb);
+
+  L = proxy->L;
+  lua_createtable(L, 0, 4);
+  couvL_SET_FIELD(L, aToB, number, proxy->bytes[0]);
+  couvL_SET_FIELD(L, bToA, number, proxy->bytes[1]);
+  couvL_SET_FIELD(L, duration, number,
+      (lua_Number)(uv_now(couv_loop(L)) - proxy->start_time));
+  couvL_SET_FIELD(L, reason, string, reason);
+
+  /* if finished before yielding, couv_proxy returns the stats. */
+  if (proxy->yielded)
+    couv_resume(L, L, 1);
+}
+
+/*
+ * No read or write callback comes for a closed stream anymore, so the proxy
+ * would wait forever if its writes were not pending. The stream is detached
+ * first, as its handle may be freed before the proxy.
+ */
+void couv_clean_stream_proxy(uv_stream_t *handle) {
+  couv_stream_handle_data_t *hdata;
+  couv_proxy_t *proxy;
+  int i;
+
+  hdata = couv_get_stream_handle_data(handle);
+  proxy = hdata->proxy;
+  if (!proxy)
+    return;
+  hdata->proxy = NULL;
+  for (i = 0; i < 2; ++i) {
+    if (proxy->streams[i] == handle)
+      proxy->streams[i] = NULL;
+  }
+  proxy_finish(proxy, "ECANCELED");
+}
+
+static void proxy_check_done(couv_proxy_t *proxy) {
+  if (proxy->eof[0] && proxy->eof[1] && proxy->shut[0] && proxy->shut[1])
+    proxy_finish(proxy, "EOF");
+}
+
+static void proxy_read_cb(uv_stream_t *stream, ssize_t nread, uv_buf_t buf);
+
+static void proxy_write_cb(uv_write_t *req, int status) {
+  couv_proxy_write_t *w;
+  couv_proxy_t *proxy;
+  uv_stream_t *src;
+
+  w = container_of(req, couv_proxy_write_t, req);
+  proxy = w->proxy;
+  couv_buf_mem_release(proxy->L, w->mem);
+  --proxy->pending;
+
+  if (status < 0)
+    proxy_finish(proxy, couvL_uv_lasterrname(req->handle->loop));
+  else if (!proxy->finished && proxy->paused[w->dir]
+      && req->handle->write_queue_size <= proxy->high_water_mark / 2) {
+    src = proxy->streams[w->dir];
+    proxy->paused[w->dir] = 0;
+    if (uv_read_start(src, couv_buf_alloc_cb, proxy_read_cb) < 0)
+      proxy_finish(proxy, couvL_uv_lasterrname(src->loop));
+  }
+  couv_free(proxy->L, w);
+  proxy_maybe_free(proxy);
+}
+
+static void proxy_shutdown_cb(uv_shutdown_t *req, int status) {
+  couv_proxy_shutdown_t *s;
+  couv_proxy_t *proxy;
+
+  s = container_of(req, couv_proxy_shutdown_t, req);
+  proxy = s->proxy;
+  --proxy->pending;
+  proxy->shut[s->dir] = 1;
+  if (status < 0)
+    proxy_finish(proxy, couvL_uv_lasterrname(req->handle->loop));
+  else if (!proxy->finished)
+    proxy_check_done(proxy);
+  couv_free(proxy->L, s);
+  proxy_maybe_free(proxy);
+}
+
+/* forwards data read in direction dir to the other stream. */
+static void proxy_forward(couv_proxy_t *proxy, int dir, ssize_t nread,
+    uv_buf_t buf, uv_err_code err_code) {
+  lua_State *L;
+  uv_stream_t *src;
+  uv_stream_t *dst;
+  couv_proxy_write_t *w;
+  couv_proxy_shutdown_t *s;
+
+  L = proxy->L;
+  src = proxy->streams[dir];
+  dst = proxy->streams[1 - dir];
+
+  if (nread <= 0) {
+    if (buf.base)
+      couv_buf_mem_release(L, buf.base);
+    if (nread == 0)
+      return;
+
+    uv_read_stop(src);
+    proxy->eof[dir] = 1;
+    if (err_code != UV_EOF) {
+      proxy_finish(proxy, couvL_uv_errname(err_code));
+      return;
+    }
+    s = couv_alloc(L, sizeof(couv_proxy_shutdown_t));
+    s->proxy = proxy;
+    s->dir = dir;
+    if (uv_shutdown(&s->req, dst, proxy_shutdown_cb) < 0) {
+      couv_free(L, s);
+      proxy_finish(proxy, couvL_uv_lasterrname(dst->loop));
+      return;
+    }
+    ++proxy->pending;
+    return;
+  }
+
+  proxy->bytes[dir] += nread;
+  proxy->last_activity = uv_now(src->loop);
+
+  w = couv_alloc(L, sizeof(couv_proxy_write_t));
+  w->proxy = proxy;
+  w->dir = dir;
+  w->mem = buf.base;
+  buf.len = nread;
+  if (uv_write(&w->req, dst, &buf, 1, proxy_write_cb) < 0) {
+    couv_buf_mem_release(L, w->mem);
+    couv_free(L, w);
+    proxy_finish(proxy, couvL_uv_lasterrname(dst->loop));
+    return;
+  }
+  ++proxy->pending;
+
+  if (dst->write_queue_size > proxy->high_water_mark) {
+    uv_read_stop(src);
+    proxy->paused[dir] = 1;
+  }
+}
+
+static void proxy_read_cb(uv_stream_t *stream, ssize_t nread, uv_buf_t buf) {
+  couv_proxy_t *proxy;
+
+  proxy = couv_get_stream_handle_data(stream)->proxy;
+  if (!proxy) {
+    if (buf.base)
+      couv_buf_mem_release(stream->data, buf.base);
+    return;
+  }
+  proxy_forward(proxy, stream == proxy->streams[0] ? 0 : 1, nread, buf,
+      nread < 0 ? uv_last_error(stream->loop).code : UV_OK);
+}
+
+static void proxy_timer_cb(uv_timer_t *timer, int status) {
+  couv_proxy_t *proxy;
+  int64_t idle;
+
+  proxy = container_of(timer, couv_proxy_t, timer);
+  idle = uv_now(timer->loop) - proxy->last_activity;
+  if (idle >= proxy->idle_timeout)
+    proxy_finish(proxy, "ETIMEDOUT");
+  else
+    uv_timer_start(timer, proxy_timer_cb, proxy->idle_timeout - idle, 0);
+}
+
+/* forwards the data read by Stream:startRead before the proxy started. */
+static void proxy_forward_input_queue(couv_proxy_t *proxy, int dir) {
+  couv_stream_handle_data_t *hdata;
+  couv_stream_input_t *input;
+
+  hdata = couv_get_stream_handle_data(proxy->streams[dir]);
+  while (!ngx_queue_empty(&hdata->input_queue) && !proxy->finished
+      && !proxy->eof[dir]) {
+    input = (couv_stream_input_t *)ngx_queue_head(&hdata->input_queue);
+    ngx_queue_remove(input);
+    proxy_forward(proxy, dir, input->nread, input->w_buf.buf, input->err_code);
+    couv_free(proxy->L, input);
+  }
+}
+
+static int couv_proxy(lua_State *L) {
+  uv_stream_t *a;
+  uv_stream_t *b;
+  couv_proxy_t *proxy;
+  uv_loop_t *loop;
+  lua_Number idle_timeout;
+  lua_Number high_water_mark;
+  int i;
+
+  a = couvL_checkudataclass(L, 1, COUV_STREAM_MTBL_NAME);
+  b = couvL_checkudataclass(L, 2, COUV_STREAM_MTBL_NAME);
+  luaL_argcheck(L, a != b, 2, "must be different from the first stream");
+  idle_timeout = 0;
+  high_water_mark = COUV_PROXY_DEFAULT_HIGH_WATER_MARK;
+  if (lua_istable(L, 3)) {
+    lua_getfield(L, 3, "idleTimeout");
+    if (!lua_isnil(L, -1))
+      idle_timeout = luaL_checknumber(L, -1);
+    lua_getfield(L, 3, "highWaterMark");
+    if (!lua_isnil(L, -1))
+      high_water_mark = luaL_checknumber(L, -1);
+    lua_pop(L, 2);
+  } else
+    luaL_argcheck(L, lua_isnoneornil(L, 3), 3, "must be table or nil");
+  luaL_argcheck(L, idle_timeout >= 0 && high_water_mark > 0, 3,
+      "idleTimeout must not be negative and highWaterMark must be positive");
+  if (couv_get_stream_handle_data(a)->proxy
+      || couv_get_stream_handle_data(b)->proxy)
+    return luaL_error(L, "EBUSY");
+  if (couvL_is_mainthread(L))
+    return luaL_error(L, "proxy must be called in coroutine.");
+  lua_pop(L, 1);
+
+  loop = couv_loop(L);
+  proxy = couv_alloc(L, sizeof(couv_proxy_t));
+  memset(proxy, 0, sizeof(couv_proxy_t));
+  proxy->L = L;
+  proxy->streams[0] = a;
+  proxy->streams[1] = b;
+  proxy->high_water_mark = (size_t)high_water_mark;
+  proxy->idle_timeout = (int64_t)idle_timeout;
+  proxy->start_time = proxy->last_activity = uv_now(loop);
+  lua_pushthread(L);
+  couv_rawsetp(L, LUA_REGISTRYINDEX, COUV_THREAD_REG_KEY(proxy));
+
+  uv_timer_init(loop, &proxy->timer);
+  proxy->timer_active = 1;
+  if (proxy->idle_timeout > 0)
+    uv_timer_start(&proxy->timer, proxy_timer_cb, proxy->idle_timeout, 0);
+
+  for (i = 0; i < 2; ++i) {
+    couv_set_handle_thread(L, (uv_handle_t *)proxy->streams[i]);
+    couv_get_stream_handle_data(proxy->streams[i])->proxy = proxy;
+  }
+  for (i = 0; i < 2 && !proxy->finished; ++i) {
+    proxy_forward_input_queue(proxy, i);
+    if (!proxy->finished && !proxy->eof[i] && !proxy->paused[i]
+        && uv_read_start(proxy->streams[i], couv_buf_alloc_cb,
+        proxy_read_cb) < 0)
+      proxy_finish(proxy, couvL_uv_lasterrname(loop));
+  }
+  if (proxy->finished)
+    return 1;
+  proxy->yielded = 1;
+  return lua_yield(L, 0);
+}
+
+static const struct luaL_Reg proxy_functions[] = {
+  { "proxy", couv_proxy },
+  { NULL, NULL }
+};
+
+int luaopen_couv_proxy(lua_State *L) {
+  couvL_setfuncs(L, proxy_functions, 0);
+  return 0;
+}
@@ -13,9 +13,21 @@ couv_stream_handle_data_t *couv_get_stream_handle_data(uv_stream_t *handle) {
   }
 }
 
+void couv_init_stream_handle_data(couv_stream_handle_data_t *hdata) {
+  ngx_queue_init(&hdata->input_queue);
+  hdata->read_waiter = NULL;
+  hdata->admission = NULL;
+  hdata->admitted_by = NULL;
+  hdata->admitted_slot = -1;
+  hdata->proxy = NULL;
+}
+
 static void connection_cb(uv_stream_t *handle, int status) {
   lua_State *L;
 
+  if (status == 0 && !couv_admission_check(handle))
+    return;
+
   L = handle->data;
   couv_rawgetp(L, LUA_REGISTRYINDEX, COUV_LISTEN_CB_REG_KEY(handle));
   couv_rawgetp(L, LUA_REGISTRYINDEX, COUV_USERDATA_REG_KEY(handle));
@@ -24,6 +36,7 @@ static void connection_cb(uv_stream_t *handle, int status) {
     lua_call(L, 2, 0);
   } else {
     lua_call(L, 1, 0);
+    couv_admission_release(handle);
   }
 }
 
@@ -56,8 +69,10 @@ static int couv_accept(lua_State *L) {
   client = couvL_checkudataclass(L, 2, COUV_STREAM_MTBL_NAME);
   r = uv_accept(server, client);
   if (r < 0) {
+    couv_admission_release(server);
     luaL_error(L, couvL_uv_lasterrname(couv_loop(L)));
   }
+  couv_admission_bind(server, client);
   return 0;
 }
 
@@ -99,13 +114,34 @@ static void read_cb(uv_stream_t *handle, ssize_t nread, uv_buf_t buf) {
   input->nread = nread;
   input->w_buf.orig = buf.base;
   input->w_buf.buf = buf;
+  input->err_code = nread < 0 ? uv_last_error(handle->loop).code : UV_OK;
   hdata = couv_get_stream_handle_data(handle);
   ngx_queue_insert_tail(&hdata->input_queue, (ngx_queue_t *)input);
 
-  if (lua_status(L) == LUA_YIELD)
+  L = couv_take_input_waiter((uv_handle_t *)handle, &hdata->read_waiter);
+  if (L)
     couv_resume(L, L, 0);
 }
 
+/*
+ * Resumes the coroutine waiting in _read of the closed handle with nread -1
+ * and ECANCELED, since no more input comes. Called last in the clean
+ * functions, since the coroutine may run on and use the handle.
+ */
+void couv_cancel_stream_reader(uv_stream_t *handle) {
+  couv_stream_handle_data_t *hdata;
+  lua_State *L;
+
+  hdata = couv_get_stream_handle_data(handle);
+  L = couv_take_input_waiter((uv_handle_t *)handle, &hdata->read_waiter);
+  if (!L)
+    return;
+  lua_pushnumber(L, -1);
+  lua_pushnil(L);
+  lua_pushstring(L, "ECANCELED");
+  couv_resume(L, L, 3);
+}
+
 static int couv_read_start(lua_State *L) {
   uv_stream_t *handle;
   int r;
@@ -127,8 +163,12 @@ static int couv_prim_read(lua_State *L) {
   handle = couvL_checkudataclass(L, 1, COUV_STREAM_MTBL_NAME);
 
   hdata = couv_get_stream_handle_data(handle);
-  if (ngx_queue_empty(&hdata->input_queue))
+  if (ngx_queue_empty(&hdata->input_queue)) {
+    if (hdata->read_waiter)
+      return luaL_error(L, "EBUSY");
+    couv_set_input_waiter(L, (uv_handle_t *)handle, &hdata->read_waiter);
     return lua_yield(L, 0);
+  }
   input = (couv_stream_input_t *)ngx_queue_head(&hdata->input_queue);
   ngx_queue_remove(input);
 
@@ -139,6 +179,12 @@ static int couv_prim_read(lua_State *L) {
   lua_setmetatable(L, -2);
   *w_buf = input->w_buf;
 
+  if (input->nread < 0) {
+    lua_pushstring(L, couvL_uv_errname(input->err_code));
+    couv_free(L, input);
+    return 3;
+  }
+  couv_free(L, input);
   return 2;
 }
 
@@ -161,12 +207,12 @@ static void shutdown_cb(uv_shutdown_t *req, int status) {
   int nargs;
 
   handle = req->handle;
-  L = handle->data;
+  L = couv_take_req_thread((uv_req_t *)req);
 
   couv_free(L, req);
 
   if (status < 0) {
-    lua_pushstring(L, couvL_uv_lasterrname(couv_loop(L)));
+    lua_pushstring(L, couvL_uv_lasterrname(handle->loop));
     nargs = 1;
   } else
     nargs = 0;
@@ -183,24 +229,35 @@ static int couv_shutdown(lua_State *L) {
   req = couv_alloc(L, sizeof(uv_shutdown_t));
   r = uv_shutdown(req, handle, shutdown_cb);
   if (r < 0) {
+    couv_free(L, req);
     luaL_error(L, couvL_uv_lasterrname(couv_loop(L)));
   }
+  couv_set_req_thread(L, (uv_req_t *)req);
   return lua_yield(L, 0);
 }
 
+typedef struct couv_write_s {
+  uv_write_t req;
+  uv_buf_t *bufs;
+  void **mems;
+} couv_write_t;
+
 static void write_cb(uv_write_t *req, int status) {
   lua_State *L;
   uv_stream_t *handle;
+  couv_write_t *w;
   int nargs;
 
   handle = req->handle;
-  L = handle->data;
+  L = couv_take_req_thread((uv_req_t *)req);
 
-  couv_free(L, req->data);
-  couv_free(L, req);
+  w = container_of(req, couv_write_t, req);
+  couv_release_buf_mems(L, w->mems);
+  couv_free(L, w->bufs);
+  couv_free(L, w);
 
   if (status < 0) {
-    lua_pushstring(L, couvL_uv_lasterrname(couv_loop(L)));
+    lua_pushstring(L, couvL_uv_lasterrname(handle->loop));
     nargs = 1;
   } else
     nargs = 0;
@@ -208,28 +265,38 @@ static void write_cb(uv_write_t *req, int status) {
   couv_resume(L, L, nargs);
 }
 
-static int couv_write(lua_State *L) {
-  uv_write_t *req;
-  uv_stream_t *handle;
-  uv_buf_t *bufs;
-  size_t bufcnt;
+int couv_stream_write_bufs(lua_State *L, uv_stream_t *handle, int index,
+    uv_buf_t *bufs, size_t bufcnt) {
+  couv_write_t *w;
   int r;
 
-  handle = couvL_checkudataclass(L, 1, COUV_STREAM_MTBL_NAME);
-  bufs = couv_checkbuforstrtable(L, 2, &bufcnt);
-
-  req = couv_alloc(L, sizeof(uv_write_t));
-  req->data = bufs;
+  w = couv_alloc(L, sizeof(couv_write_t));
+  w->bufs = bufs;
+  w->mems = couv_retain_buf_mems(L, index);
 
-  r = uv_write(req, handle, bufs, (int)bufcnt, write_cb);
+  r = uv_write(&w->req, handle, bufs, (int)bufcnt, write_cb);
   if (r < 0) {
+    couv_release_buf_mems(L, w->mems);
+    couv_free(L, bufs);
+    couv_free(L, w);
     luaL_error(L, couvL_uv_lasterrname(couv_loop(L)));
   }
+  couv_set_req_thread(L, (uv_req_t *)&w->req);
   return lua_yield(L, 0);
 }
 
+static int couv_write(lua_State *L) {
+  uv_stream_t *handle;
+  uv_buf_t *bufs;
+  size_t bufcnt;
+
+  handle = couvL_checkudataclass(L, 1, COUV_STREAM_MTBL_NAME);
+  bufs = couv_checkbuforstrtable(L, 2, &bufcnt);
+  return couv_stream_write_bufs(L, handle, 2, bufs, bufcnt);
+}
+
 static int couv_write2(lua_State *L) {
-  uv_write_t *req;
+  couv_write_t *w;
   uv_stream_t *handle;
   uv_buf_t *bufs;
   size_t bufcnt;
@@ -240,13 +307,18 @@ static int couv_write2(lua_State *L) {
   bufs = couv_checkbuforstrtable(L, 2, &bufcnt);
   send_handle = couvL_checkudataclass(L, 3, COUV_STREAM_MTBL_NAME);
 
-  req = couv_alloc(L, sizeof(uv_write_t));
-  req->data = bufs;
+  w = couv_alloc(L, sizeof(couv_write_t));
+  w->bufs = bufs;
+  w->mems = couv_retain_buf_mems(L, 2);
 
-  r = uv_write2(req, handle, bufs, (int)bufcnt, send_handle, write_cb);
+  r = uv_write2(&w->req, handle, bufs, (int)bufcnt, send_handle, write_cb);
   if (r < 0) {
+    couv_release_buf_mems(L, w->mems);
+    couv_free(L, bufs);
+    couv_free(L, w);
     luaL_error(L, couvL_uv_lasterrname(couv_loop(L)));
   }
+  couv_set_req_thread(L, (uv_req_t *)&w->req);
   return lua_yield(L, 0);
 }
 
@@ -1,5 +1,83 @@
 #include "couv-private.h"
 
+#ifndef _WIN32
+#include <netinet/tcp.h>
+#endif
+
+#ifdef __linux__
+/*
+ * The kernel's struct tcp_info. The glibc copy in <netinet/tcp.h> stops at
+ * tcpi_total_retrans, and <linux/tcp.h> conflicts with it. The kernel only
+ * appends fields, so getsockopt tells us how much of it was filled.
+ */
+typedef struct couv_tcp_info_s {
+  uint8_t state;
+  uint8_t ca_state;
+  uint8_t retransmits;
+  uint8_t probes;
+  uint8_t backoff;
+  uint8_t options;
+  uint8_t wscale;
+  uint8_t flags;
+
+  uint32_t rto;
+  uint32_t ato;
+  uint32_t snd_mss;
+  uint32_t rcv_mss;
+
+  uint32_t unacked;
+  uint32_t sacked;
+  uint32_t lost;
+  uint32_t retrans;
+  uint32_t fackets;
+
+  uint32_t last_data_sent;
+  uint32_t last_ack_sent;
+  uint32_t last_data_recv;
+  uint32_t last_ack_recv;
+
+  uint32_t pmtu;
+  uint32_t rcv_ssthresh;
+  uint32_t rtt;
+  uint32_t rttvar;
+  uint32_t snd_ssthresh;
+  uint32_t snd_cwnd;
+  uint32_t advmss;
+  uint32_t reordering;
+
+  uint32_t rcv_rtt;
+  uint32_t rcv_space;
+
+  uint32_t total_retrans;
+
+  uint64_t pacing_rate;
+  uint64_t max_pacing_rate;
+  uint64_t bytes_acked;
+  uint64_t bytes_received;
+  uint32_t segs_out;
+  uint32_t segs_in;
+
+  uint32_t notsent_bytes;
+  uint32_t min_rtt;
+  uint32_t data_segs_in;
+  uint32_t data_segs_out;
+
+  uint64_t delivery_rate;
+} couv_tcp_info_t;
+
+#define COUV_TCP_INFO_HAS(len, field) \
+  ((len) >= offsetof(couv_tcp_info_t, field) + \
+      sizeof(((couv_tcp_info_t *)0)->field))
+
+/* set the field to nil if the running kernel does not report it. */
+#define COUV_TCP_INFO_SET_FIELD(L, info, len, name, field) \
+  if (COUV_TCP_INFO_HAS(len, field))                      \
+    lua_pushnumber(L, (lua_Number)(info)->field);         \
+  else                                                    \
+    lua_pushnil(L);                                       \
+  lua_setfield(L, -2, #name)
+#endif
+
 static uv_tcp_t *couv_new_tcp_handle(lua_State *L) {
   couv_tcp_t *w_handle;
   uv_tcp_t *handle;
@@ -12,6 +90,14 @@ static uv_tcp_t *couv_new_tcp_handle(lua_State *L) {
   lua_setmetatable(L, -2);
 
   handle = &w_handle->handle;
+  w_handle->flags = 0;
+  w_handle->keepalive_delay = 0;
+  w_handle->keepalive_interval = 0;
+  w_handle->keepalive_count = 0;
+  w_handle->sockopts.cnt = 0;
+  w_handle->accept_batch = NULL;
+  w_handle->zerocopy = NULL;
+  w_handle->pacer = NULL;
 
   if (couvL_is_mainthread(L)) {
     luaL_error(L, "tcp handle must be created in coroutine, not in main thread.");
@@ -21,7 +107,50 @@ static uv_tcp_t *couv_new_tcp_handle(lua_State *L) {
   return handle;
 }
 
+static void tcp_batch_client_close_cb(uv_handle_t *handle) {
+  couv_clean_tcp_handle(handle->data, (uv_tcp_t *)handle);
+}
+
+static void tcp_accept_batch_close_cb(uv_handle_t *handle) {
+  couv_tcp_accept_batch_t *batch;
+
+  batch = container_of(handle, couv_tcp_accept_batch_t, check);
+  couv_free(batch->L, batch);
+}
+
+/* closes the clients accepted but not yet passed to the listen callback. */
+static void couv_clean_accept_batch(lua_State *L, uv_tcp_t *handle) {
+  couv_tcp_t *w_handle;
+  couv_tcp_accept_batch_t *batch;
+  uv_handle_t *client;
+  int i;
+
+  w_handle = container_of(handle, couv_tcp_t, handle);
+  batch = w_handle->accept_batch;
+  couv_rawgetp(L, LUA_REGISTRYINDEX, COUV_ACCEPT_BATCH_REG_KEY(handle));
+  for (i = 1; i <= batch->count; ++i) {
+    lua_rawgeti(L, -1, i);
+    client = lua_touserdata(L, -1);
+    lua_pop(L, 1);
+    uv_close(client, tcp_batch_client_close_cb);
+  }
+  lua_pop(L, 1);
+
+  lua_pushnil(L);
+  couv_rawsetp(L, LUA_REGISTRYINDEX, COUV_ACCEPT_BATCH_REG_KEY(handle));
+
+  uv_close((uv_handle_t *)&batch->check, tcp_accept_batch_close_cb);
+  w_handle->accept_batch = NULL;
+}
+
 void couv_clean_tcp_handle(lua_State *L, uv_tcp_t *handle) {
+  if (container_of(handle, couv_tcp_t, handle)->accept_batch)
+    couv_clean_accept_batch(L, handle);
+  couv_clean_stream_admission((uv_stream_t *)handle);
+  couv_clean_stream_proxy((uv_stream_t *)handle);
+  couv_clean_tcp_zerocopy(L, handle);
+  couv_clean_pacer(L, (uv_handle_t *)handle);
+
   lua_pushnil(L);
   couv_rawsetp(L, LUA_REGISTRYINDEX, COUV_USERDATA_REG_KEY(handle));
 
@@ -30,30 +159,46 @@ void couv_clean_tcp_handle(lua_State *L, uv_tcp_t *handle) {
 
   lua_pushnil(L);
   couv_rawsetp(L, LUA_REGISTRYINDEX, COUV_LISTEN_CB_REG_KEY(handle));
+
+  couv_cancel_stream_reader((uv_stream_t *)handle);
 }
 
-static int tcp_new(lua_State *L) {
-  uv_loop_t *loop;
+/*
+ * Pushes a new initialized tcp handle onto the stack of L. Returns NULL if
+ * uv_tcp_init fails, and the error can be got with uv_last_error. The
+ * userdata is pushed in both cases.
+ */
+static uv_tcp_t *couv_push_new_tcp(lua_State *L) {
   uv_tcp_t *handle;
   couv_stream_handle_data_t *hdata;
   int r;
 
   handle = couv_new_tcp_handle(L);
   if (!handle)
-    return 0;
+    return NULL;
 
-  loop = couv_loop(L);
-  r = uv_tcp_init(loop, handle);
+  r = uv_tcp_init(couv_loop(L), handle);
   if (r < 0) {
-    return luaL_error(L, couvL_uv_lasterrname(loop));
+    lua_pushnil(L);
+    couv_rawsetp(L, LUA_REGISTRYINDEX, COUV_THREAD_REG_KEY(handle));
+    return NULL;
   }
 
   handle->data = L;
   hdata = couv_get_stream_handle_data((uv_stream_t *)handle);
-  ngx_queue_init(&hdata->input_queue);
+  couv_init_stream_handle_data(hdata);
 
   lua_pushvalue(L, -1);
   couv_rawsetp(L, LUA_REGISTRYINDEX, COUV_USERDATA_REG_KEY(handle));
+  return handle;
+}
+
+static int tcp_new(lua_State *L) {
+  uv_tcp_t *handle;
+
+  handle = couv_push_new_tcp(L);
+  if (!handle)
+    return luaL_error(L, couvL_uv_lasterrname(couv_loop(L)));
   return 1;
 }
 
@@ -73,6 +218,67 @@ static int tcp_open(lua_State *L) {
   return 0;
 }
 
+/* probe interval and count are left to the system default when 0. */
+static int couv_tcp_apply_keepalive(couv_tcp_t *w_handle) {
+  uv_os_sock_t sock;
+
+  if (uv_tcp_keepalive(&w_handle->handle, 1, w_handle->keepalive_delay) < 0)
+    return -1;
+  sock = couv_handle_fd(&w_handle->handle);
+#if defined(TCP_KEEPINTVL) && defined(TCP_KEEPCNT)
+  if (w_handle->keepalive_interval > 0 && couv_setsockopt_int(sock,
+      IPPROTO_TCP, TCP_KEEPINTVL, w_handle->keepalive_interval) < 0) {
+    return -1;
+  }
+  if (w_handle->keepalive_count > 0 && couv_setsockopt_int(sock,
+      IPPROTO_TCP, TCP_KEEPCNT, w_handle->keepalive_count) < 0) {
+    return -1;
+  }
+#endif
+  return 0;
+}
+
+/*
+ * TCP_FASTOPEN_CONNECT, the keepalive probes and the buffer sizes need a
+ * socket, but libuv creates the socket inside uv_tcp_bind and
+ * uv_tcp_connect, and does not keep the options set before. So we create
+ * the socket ourselves here and apply the options kept in the handle.
+ * On Windows the options stay kept, as libuv owns the socket there.
+ */
+static int couv_tcp_open_socket(uv_tcp_t *handle, int family) {
+#ifdef _WIN32
+  return 0;
+#else
+  couv_tcp_t *w_handle;
+  uv_os_sock_t sock;
+
+  w_handle = container_of(handle, couv_tcp_t, handle);
+  if (couv_handle_fd(handle) != -1
+      || (!w_handle->flags && !w_handle->sockopts.cnt)) {
+    return 0;
+  }
+  sock = couv_socket_nonblock(family, SOCK_STREAM);
+  if (sock == -1)
+    return -1;
+  if (uv_tcp_open(handle, sock) < 0) {
+    close(sock);
+    errno = EINVAL;
+    return -1;
+  }
+  if (couv_apply_sockopts(sock, &w_handle->sockopts) < 0)
+    return -1;
+#ifdef TCP_FASTOPEN_CONNECT
+  if ((w_handle->flags & COUV_TCP_FASTOPEN_CONNECT) && couv_setsockopt_int(
+      sock, IPPROTO_TCP, TCP_FASTOPEN_CONNECT, 1) < 0) {
+    return -1;
+  }
+#endif
+  if (w_handle->flags & COUV_TCP_KEEPALIVE)
+    return couv_tcp_apply_keepalive(w_handle);
+  return 0;
+#endif
+}
+
 static int tcp_bind(lua_State *L) {
   uv_tcp_t *handle;
   struct sockaddr *addr;
@@ -80,6 +286,8 @@ static int tcp_bind(lua_State *L) {
 
   handle = couvL_checkudataclass(L, 1, COUV_TCP_MTBL_NAME);
   addr = couvL_checkudataclass(L, 2, COUV_SOCK_ADDR_MTBL_NAME);
+  if (couv_tcp_open_socket(handle, addr->sa_family) < 0)
+    return luaL_error(L, couvL_sock_lasterrname());
   if (addr->sa_family == AF_INET)
     r = uv_tcp_bind(handle, *(struct sockaddr_in *)addr);
   else
@@ -94,9 +302,9 @@ static void connect_cb(uv_connect_t *req, int status) {
   lua_State *L;
   int nresults = 0;
 
-  L = req->handle->data;
+  L = couv_take_req_thread((uv_req_t *)req);
   if (status < 0) {
-    lua_pushstring(L, couvL_uv_lasterrname(couv_loop(L)));
+    lua_pushstring(L, couvL_uv_lasterrname(req->handle->loop));
     nresults = 1;
   }
 
@@ -112,17 +320,473 @@ static int tcp_connect(lua_State *L) {
 
   handle = couvL_checkudataclass(L, 1, COUV_TCP_MTBL_NAME);
   addr = couvL_checkudataclass(L, 2, COUV_SOCK_ADDR_MTBL_NAME);
+  if (couv_tcp_open_socket(handle, addr->sa_family) < 0)
+    return luaL_error(L, couvL_sock_lasterrname());
   req = couv_alloc(L, sizeof(uv_connect_t));
   if (addr->sa_family == AF_INET)
     r = uv_tcp_connect(req, handle, *(struct sockaddr_in *)addr, connect_cb);
   else
     r = uv_tcp_connect6(req, handle, *(struct sockaddr_in6 *)addr, connect_cb);
   if (r < 0) {
+    couv_free(L, req);
     return luaL_error(L, couvL_uv_lasterrname(couv_loop(L)));
   }
+  couv_set_req_thread(L, (uv_req_t *)req);
+  return lua_yield(L, 0);
+}
+
+/*
+ * Happy Eyeballs connect (RFC 8305). The resolved addresses are tried in
+ * interleaved family order, starting IPv6 first. A new attempt is started
+ * every delay milliseconds or as soon as the previous one fails. The first
+ * connected handle wins and the other attempts are closed.
+ */
+typedef struct couv_tcp_he_s {
+  lua_State *L;
+  uv_getaddrinfo_t getaddrinfo_req;
+  uv_timer_t timer;
+  struct sockaddr_storage *addrs;
+  uv_tcp_t **attempts;
+  int addr_cnt;
+  int next_addr;
+  int port;
+  int64_t delay;
+  int pending;
+  int closing;
+  int timer_active;
+  int done;
+  uv_tcp_t *winner;
+  uv_err_code last_err;
+} couv_tcp_he_t;
+
+#define COUV_TCP_HE_DEFAULT_DELAY 250
+
+static void tcp_he_maybe_free(couv_tcp_he_t *he) {
+  lua_State *L;
+
+  if (!he->done || he->pending || he->closing || he->timer_active)
+    return;
+  L = he->L;
+  lua_pushnil(L);
+  couv_rawsetp(L, LUA_REGISTRYINDEX, COUV_THREAD_REG_KEY(he));
+  couv_free(L, he->addrs);
+  couv_free(L, he->attempts);
+  couv_free(L, he);
+}
+
+static void tcp_he_timer_close_cb(uv_handle_t *handle) {
+  couv_tcp_he_t *he;
+
+  he = container_of(handle, couv_tcp_he_t, timer);
+  he->timer_active = 0;
+  tcp_he_maybe_free(he);
+}
+
+/* losers are closed without resuming the waiting coroutine. */
+static void tcp_he_attempt_close_cb(uv_handle_t *handle) {
+  couv_tcp_he_t *he;
+
+  he = handle->data;
+  couv_clean_tcp_handle(he->L, (uv_tcp_t *)handle);
+  --he->closing;
+  tcp_he_maybe_free(he);
+}
+
+static void tcp_he_close_attempt(couv_tcp_he_t *he, int i) {
+  uv_tcp_t *handle;
+
+  handle = he->attempts[i];
+  he->attempts[i] = NULL;
+  handle->data = he;
+  ++he->closing;
+  uv_close((uv_handle_t *)handle, tcp_he_attempt_close_cb);
+}
+
+static void tcp_he_finish(couv_tcp_he_t *he) {
+  lua_State *L;
+  int i;
+  int nargs;
+
+  he->done = 1;
+  if (he->timer_active)
+    uv_close((uv_handle_t *)&he->timer, tcp_he_timer_close_cb);
+  for (i = 0; i < he->next_addr; ++i) {
+    if (he->attempts[i] && he->attempts[i] != he->winner)
+      tcp_he_close_attempt(he, i);
+  }
+
+  L = he->L;
+  if (he->winner) {
+    couv_rawgetp(L, LUA_REGISTRYINDEX, COUV_USERDATA_REG_KEY(he->winner));
+    nargs = 1;
+  } else {
+    lua_pushnil(L);
+    lua_pushstring(L, couvL_uv_errname(he->last_err));
+    nargs = 2;
+  }
+  couv_resume(L, L, nargs);
+}
+
+static void tcp_he_connect_cb(uv_connect_t *req, int status);
+static void tcp_he_timer_cb(uv_timer_t *timer, int status);
+
+/*
+ * Starts the connect attempt to the next address. An attempt failing
+ * synchronously is skipped to the following address. Returns 0 when no
+ * address is left.
+ */
+static int tcp_he_start_next(couv_tcp_he_t *he) {
+  lua_State *L;
+  uv_loop_t *loop;
+  uv_tcp_t *handle;
+  uv_connect_t *req;
+  struct sockaddr *addr;
+  int i;
+  int r;
+
+  L = he->L;
+  loop = couv_loop(L);
+  while (he->next_addr < he->addr_cnt) {
+    i = he->next_addr++;
+    addr = (struct sockaddr *)&he->addrs[i];
+
+    handle = couv_push_new_tcp(L);
+    if (!handle) {
+      he->last_err = uv_last_error(loop).code;
+      lua_pop(L, 1);
+      continue;
+    }
+    lua_pop(L, 1);
+    he->attempts[i] = handle;
+
+    req = couv_alloc(L, sizeof(uv_connect_t));
+    req->data = he;
+    if (addr->sa_family == AF_INET)
+      r = uv_tcp_connect(req, handle, *(struct sockaddr_in *)addr,
+          tcp_he_connect_cb);
+    else
+      r = uv_tcp_connect6(req, handle, *(struct sockaddr_in6 *)addr,
+          tcp_he_connect_cb);
+    if (r < 0) {
+      he->last_err = uv_last_error(loop).code;
+      couv_free(L, req);
+      tcp_he_close_attempt(he, i);
+      continue;
+    }
+    ++he->pending;
+
+    if (he->next_addr < he->addr_cnt)
+      uv_timer_start(&he->timer, tcp_he_timer_cb, he->delay, 0);
+    return 1;
+  }
+  return 0;
+}
+
+static void tcp_he_timer_cb(uv_timer_t *timer, int status) {
+  couv_tcp_he_t *he;
+
+  he = container_of(timer, couv_tcp_he_t, timer);
+  if (!he->done)
+    tcp_he_start_next(he);
+}
+
+static void tcp_he_connect_cb(uv_connect_t *req, int status) {
+  couv_tcp_he_t *he;
+  uv_tcp_t *handle;
+  int i;
+
+  he = req->data;
+  handle = (uv_tcp_t *)req->handle;
+  couv_free(he->L, req);
+  --he->pending;
+
+  /* closed losers are canceled here, their slots are already cleared. */
+  for (i = 0; i < he->next_addr && he->attempts[i] != handle; ++i)
+    ;
+  if (i == he->next_addr) {
+    tcp_he_maybe_free(he);
+    return;
+  }
+
+  if (status == 0 && !he->done) {
+    he->winner = handle;
+    tcp_he_finish(he);
+  } else {
+    if (status < 0)
+      he->last_err = uv_last_error(couv_loop(he->L)).code;
+    tcp_he_close_attempt(he, i);
+    if (!he->done) {
+      uv_timer_stop(&he->timer);
+      if (!tcp_he_start_next(he) && he->pending == 0)
+        tcp_he_finish(he);
+    }
+  }
+  tcp_he_maybe_free(he);
+}
+
+static void tcp_he_getaddrinfo_cb(uv_getaddrinfo_t *req, int status,
+    struct addrinfo *res) {
+  couv_tcp_he_t *he;
+  lua_State *L;
+  struct addrinfo *p;
+  struct addrinfo *v4;
+  struct addrinfo *v6;
+  int want_v6;
+  int n;
+
+  he = container_of(req, couv_tcp_he_t, getaddrinfo_req);
+  L = he->L;
+  if (status < 0) {
+    he->last_err = uv_last_error(req->loop).code;
+    tcp_he_finish(he);
+    tcp_he_maybe_free(he);
+    return;
+  }
+
+  for (n = 0, p = res; p; p = p->ai_next) {
+    if (p->ai_family == AF_INET || p->ai_family == AF_INET6)
+      ++n;
+  }
+  he->addrs = couv_alloc(L, n * sizeof(struct sockaddr_storage));
+  he->attempts = couv_alloc(L, n * sizeof(uv_tcp_t *));
+
+  /* interleave address families, IPv6 first. */
+  v4 = v6 = res;
+  want_v6 = 1;
+  while (he->addr_cnt < n) {
+    while (v6 && v6->ai_family != AF_INET6)
+      v6 = v6->ai_next;
+    while (v4 && v4->ai_family != AF_INET)
+      v4 = v4->ai_next;
+    if ((want_v6 && v6) || !v4) {
+      p = v6;
+      v6 = v6->ai_next;
+    } else {
+      p = v4;
+      v4 = v4->ai_next;
+    }
+    want_v6 = !want_v6;
+
+    memcpy(&he->addrs[he->addr_cnt], p->ai_addr, p->ai_addrlen);
+    if (p->ai_family == AF_INET)
+      ((struct sockaddr_in *)&he->addrs[he->addr_cnt])->sin_port =
+          htons((unsigned short)he->port);
+    else
+      ((struct sockaddr_in6 *)&he->addrs[he->addr_cnt])->sin6_port =
+          htons((unsigned short)he->port);
+    he->attempts[he->addr_cnt] = NULL;
+    ++he->addr_cnt;
+  }
+  uv_freeaddrinfo(res);
+
+  uv_timer_init(req->loop, &he->timer);
+  he->timer_active = 1;
+  if (!tcp_he_start_next(he))
+    tcp_he_finish(he);
+  tcp_he_maybe_free(he);
+}
+
+static int tcp_connect_host(lua_State *L) {
+  const char *host;
+  int port;
+  int64_t delay;
+  struct addrinfo hints;
+  couv_tcp_he_t *he;
+  uv_loop_t *loop;
+  int r;
+
+  host = luaL_checkstring(L, 1);
+  port = luaL_checkint(L, 2);
+  luaL_argcheck(L, 0 <= port && port <= 65535, 2,
+      "must be 0 <= port <= 65535");
+  delay = COUV_TCP_HE_DEFAULT_DELAY;
+  if (lua_istable(L, 3)) {
+    lua_getfield(L, 3, "delay");
+    if (!lua_isnil(L, -1))
+      delay = luaL_checkint(L, -1);
+    lua_pop(L, 1);
+  } else
+    luaL_argcheck(L, lua_isnoneornil(L, 3), 3, "must be table or nil");
+  if (couvL_is_mainthread(L))
+    return luaL_error(L, "connectHost must be called in coroutine.");
+
+  he = couv_alloc(L, sizeof(couv_tcp_he_t));
+  memset(he, 0, sizeof(couv_tcp_he_t));
+  he->L = L;
+  he->port = port;
+  he->delay = delay;
+  he->last_err = UV_ENOENT;
+  couv_rawsetp(L, LUA_REGISTRYINDEX, COUV_THREAD_REG_KEY(he));
+
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  loop = couv_loop(L);
+  r = uv_getaddrinfo(loop, &he->getaddrinfo_req, tcp_he_getaddrinfo_cb, host,
+      NULL, &hints);
+  if (r < 0) {
+    lua_pushnil(L);
+    couv_rawsetp(L, LUA_REGISTRYINDEX, COUV_THREAD_REG_KEY(he));
+    couv_free(L, he);
+    return luaL_error(L, couvL_uv_lasterrname(loop));
+  }
   return lua_yield(L, 0);
 }
 
+/*
+ * Passes the clients accepted so far to the listen callback in one array.
+ * A fresh array is used for the next batch, so the callback may keep it.
+ */
+static void tcp_flush_accept_batch(uv_tcp_t *handle) {
+  lua_State *L;
+  couv_tcp_accept_batch_t *batch;
+
+  batch = container_of(handle, couv_tcp_t, handle)->accept_batch;
+  uv_check_stop(&batch->check);
+  if (batch->count == 0)
+    return;
+  batch->count = 0;
+
+  L = handle->data;
+  couv_rawgetp(L, LUA_REGISTRYINDEX, COUV_LISTEN_CB_REG_KEY(handle));
+  couv_rawgetp(L, LUA_REGISTRYINDEX, COUV_USERDATA_REG_KEY(handle));
+  couv_rawgetp(L, LUA_REGISTRYINDEX, COUV_ACCEPT_BATCH_REG_KEY(handle));
+  lua_newtable(L);
+  couv_rawsetp(L, LUA_REGISTRYINDEX, COUV_ACCEPT_BATCH_REG_KEY(handle));
+  lua_call(L, 2, 0);
+}
+
+/* runs after all the connections of this loop iteration are accepted. */
+static void tcp_accept_batch_check_cb(uv_check_t *check, int status) {
+  tcp_flush_accept_batch(check->data);
+}
+
+static void tcp_accept_batch_error(uv_tcp_t *handle) {
+  lua_State *L;
+
+  tcp_flush_accept_batch(handle);
+  L = handle->data;
+  couv_rawgetp(L, LUA_REGISTRYINDEX, COUV_LISTEN_CB_REG_KEY(handle));
+  couv_rawgetp(L, LUA_REGISTRYINDEX, COUV_USERDATA_REG_KEY(handle));
+  lua_pushnil(L);
+  lua_pushstring(L, couvL_uv_lasterrname(handle->loop));
+  lua_call(L, 3, 0);
+}
+
+static void tcp_accept_batch_cb(uv_stream_t *server, int status) {
+  lua_State *L;
+  uv_tcp_t *handle;
+  uv_tcp_t *client;
+  couv_tcp_accept_batch_t *batch;
+
+  handle = (uv_tcp_t *)server;
+  if (status < 0) {
+    tcp_accept_batch_error(handle);
+    return;
+  }
+  if (!couv_admission_check(server))
+    return;
+
+  L = handle->data;
+  client = couv_push_new_tcp(L);
+  if (!client) {
+    lua_pop(L, 1);
+    tcp_accept_batch_error(handle);
+    return;
+  }
+  if (uv_accept(server, (uv_stream_t *)client) < 0) {
+    lua_pop(L, 1);
+    uv_close((uv_handle_t *)client, tcp_batch_client_close_cb);
+    couv_admission_release(server);
+    tcp_accept_batch_error(handle);
+    return;
+  }
+  couv_admission_bind(server, (uv_stream_t *)client);
+
+  batch = container_of(handle, couv_tcp_t, handle)->accept_batch;
+  couv_rawgetp(L, LUA_REGISTRYINDEX, COUV_ACCEPT_BATCH_REG_KEY(handle));
+  lua_insert(L, -2);
+  lua_rawseti(L, -2, ++batch->count);
+  lua_pop(L, 1);
+
+  if (batch->count >= batch->size)
+    tcp_flush_accept_batch(handle);
+  else
+    uv_check_start(&batch->check, tcp_accept_batch_check_cb);
+}
+
+#define COUV_TCP_ACCEPT_BATCH_DEFAULT_SIZE 64
+
+static int tcp_listen_batch(lua_State *L) {
+  couv_tcp_t *w_handle;
+  uv_tcp_t *handle;
+  couv_tcp_accept_batch_t *batch;
+  int backlog;
+  int size;
+  int r;
+
+  handle = couvL_checkudataclass(L, 1, COUV_TCP_MTBL_NAME);
+  backlog = luaL_checkint(L, 2);
+  luaL_checktype(L, 3, LUA_TFUNCTION);
+  size = luaL_optint(L, 4, COUV_TCP_ACCEPT_BATCH_DEFAULT_SIZE);
+  luaL_argcheck(L, size > 0, 4, "must be positive");
+  if (couvL_is_mainthread(L))
+    return luaL_error(L, "listenBatch must be called in coroutine.");
+  lua_pop(L, 1);
+
+  w_handle = container_of(handle, couv_tcp_t, handle);
+  batch = w_handle->accept_batch;
+  if (!batch) {
+    batch = couv_alloc(L, sizeof(couv_tcp_accept_batch_t));
+    batch->L = L;
+    batch->count = 0;
+    uv_check_init(couv_loop(L), &batch->check);
+    uv_unref((uv_handle_t *)&batch->check);
+    batch->check.data = handle;
+    w_handle->accept_batch = batch;
+
+    lua_newtable(L);
+    couv_rawsetp(L, LUA_REGISTRYINDEX, COUV_ACCEPT_BATCH_REG_KEY(handle));
+  }
+  batch->size = size;
+
+  /* accepted clients are created in this thread. */
+  couv_set_handle_thread(L, (uv_handle_t *)handle);
+
+  lua_pushvalue(L, 3);
+  couv_rawsetp(L, LUA_REGISTRYINDEX, COUV_LISTEN_CB_REG_KEY(handle));
+
+  r = uv_listen((uv_stream_t *)handle, backlog, tcp_accept_batch_cb);
+  if (r < 0) {
+    return luaL_error(L, couvL_uv_lasterrname(couv_loop(L)));
+  }
+  lua_pushvalue(L, 1);
+  couv_rawsetp(L, LUA_REGISTRYINDEX, COUV_USERDATA_REG_KEY(handle));
+  return 0;
+}
+
+/*
+ * Closes the connection with RST instead of FIN by setting SO_LINGER to 0,
+ * which also avoids TIME_WAIT. Does not wait for the close callback.
+ */
+static int tcp_reset(lua_State *L) {
+  uv_tcp_t *handle;
+  uv_os_sock_t sock;
+  struct linger l;
+
+  handle = couvL_checkudataclass(L, 1, COUV_TCP_MTBL_NAME);
+  if (uv_is_closing((uv_handle_t *)handle))
+    return 0;
+  sock = couv_handle_fd(handle);
+  if (sock != -1) {
+    l.l_onoff = 1;
+    l.l_linger = 0;
+    setsockopt(sock, SOL_SOCKET, SO_LINGER, (const char *)&l, sizeof(l));
+  }
+  couv_close_nowait((uv_handle_t *)handle);
+  return 0;
+}
+
 static int tcp_nodelay(lua_State *L) {
   uv_tcp_t *handle;
   int enable;
@@ -138,18 +802,40 @@ static int tcp_nodelay(lua_State *L) {
 }
 
 static int tcp_keepalive(lua_State *L) {
+  couv_tcp_t *w_handle;
   uv_tcp_t *handle;
   int enable;
   unsigned int delay;
+  int interval;
+  int count;
   int r;
 
-  handle = couvL_checkudataclass(L, 1, COUV_TCP_MTBL_NAME);
+  w_handle = couvL_checkudataclass(L, 1, COUV_TCP_MTBL_NAME);
+  handle = &w_handle->handle;
   enable = lua_toboolean(L, 2);
   delay = luaL_optinteger(L, 3, 0);
-  r = uv_tcp_keepalive(handle, enable, delay);
-  if (r < 0) {
-    return luaL_error(L, couvL_uv_lasterrname(couv_loop(L)));
+  interval = luaL_optint(L, 4, 0);
+  count = luaL_optint(L, 5, 0);
+  if (!enable) {
+    w_handle->flags &= ~COUV_TCP_KEEPALIVE;
+    r = uv_tcp_keepalive(handle, 0, 0);
+    if (r < 0) {
+      return luaL_error(L, couvL_uv_lasterrname(couv_loop(L)));
+    }
+    return 0;
   }
+#if !defined(TCP_KEEPINTVL) || !defined(TCP_KEEPCNT)
+  if (interval > 0 || count > 0)
+    return luaL_error(L, "ENOTSUP");
+#endif
+
+  w_handle->flags |= COUV_TCP_KEEPALIVE;
+  w_handle->keepalive_delay = delay;
+  w_handle->keepalive_interval = interval;
+  w_handle->keepalive_count = count;
+  /* The options are applied in _bind or _connect if there is no socket. */
+  if (couv_handle_fd(handle) != -1 && couv_tcp_apply_keepalive(w_handle) < 0)
+    return luaL_error(L, couvL_sock_lasterrname());
   return 0;
 }
 
@@ -167,6 +853,261 @@ static int tcp_simultaneous_accepts(lua_State *L) {
   return 0;
 }
 
+static int tcp_set_int_sockopt(lua_State *L, int level, int optname) {
+  uv_tcp_t *handle;
+
+  handle = couvL_checkudataclass(L, 1, COUV_TCP_MTBL_NAME);
+  return couvL_set_int_sockopt(L, couv_handle_fd(handle), NULL, level,
+      optname);
+}
+
+/*
+ * Sets an option which must take effect before bind(2) or connect(2), like
+ * the buffer sizes which decide the window scale. Without a socket, the
+ * option is kept and applied in _bind or _connect.
+ */
+static int tcp_set_deferred_int_sockopt(lua_State *L, int level,
+    int optname) {
+  couv_tcp_t *w_handle;
+
+  w_handle = couvL_checkudataclass(L, 1, COUV_TCP_MTBL_NAME);
+  return couvL_set_int_sockopt(L, couv_handle_fd(&w_handle->handle),
+      &w_handle->sockopts, level, optname);
+}
+
+static int tcp_get_int_sockopt(lua_State *L, int level, int optname) {
+  couv_tcp_t *w_handle;
+
+  w_handle = couvL_checkudataclass(L, 1, COUV_TCP_MTBL_NAME);
+  return couvL_get_int_sockopt(L, couv_handle_fd(&w_handle->handle),
+      &w_handle->sockopts, level, optname);
+}
+
+static int tcp_set_send_buffer_size(lua_State *L) {
+  return tcp_set_deferred_int_sockopt(L, SOL_SOCKET, SO_SNDBUF);
+}
+
+static int tcp_get_send_buffer_size(lua_State *L) {
+  return tcp_get_int_sockopt(L, SOL_SOCKET, SO_SNDBUF);
+}
+
+static int tcp_set_recv_buffer_size(lua_State *L) {
+  return tcp_set_deferred_int_sockopt(L, SOL_SOCKET, SO_RCVBUF);
+}
+
+static int tcp_get_recv_buffer_size(lua_State *L) {
+  return tcp_get_int_sockopt(L, SOL_SOCKET, SO_RCVBUF);
+}
+
+static int tcp_set_not_sent_lowat(lua_State *L) {
+#ifdef TCP_NOTSENT_LOWAT
+  return tcp_set_deferred_int_sockopt(L, IPPROTO_TCP, TCP_NOTSENT_LOWAT);
+#else
+  return luaL_error(L, "ENOTSUP");
+#endif
+}
+
+static int tcp_get_not_sent_lowat(lua_State *L) {
+#ifdef TCP_NOTSENT_LOWAT
+  return tcp_get_int_sockopt(L, IPPROTO_TCP, TCP_NOTSENT_LOWAT);
+#else
+  return luaL_error(L, "ENOTSUP");
+#endif
+}
+
+static int tcp_set_defer_accept(lua_State *L) {
+#ifdef TCP_DEFER_ACCEPT
+  return tcp_set_int_sockopt(L, IPPROTO_TCP, TCP_DEFER_ACCEPT);
+#else
+  return luaL_error(L, "ENOTSUP");
+#endif
+}
+
+static int tcp_get_defer_accept(lua_State *L) {
+#ifdef TCP_DEFER_ACCEPT
+  return tcp_get_int_sockopt(L, IPPROTO_TCP, TCP_DEFER_ACCEPT);
+#else
+  return luaL_error(L, "ENOTSUP");
+#endif
+}
+
+static int tcp_set_fast_open(lua_State *L) {
+#ifdef TCP_FASTOPEN
+  return tcp_set_int_sockopt(L, IPPROTO_TCP, TCP_FASTOPEN);
+#else
+  return luaL_error(L, "ENOTSUP");
+#endif
+}
+
+static int tcp_get_fast_open(lua_State *L) {
+#ifdef TCP_FASTOPEN
+  return tcp_get_int_sockopt(L, IPPROTO_TCP, TCP_FASTOPEN);
+#else
+  return luaL_error(L, "ENOTSUP");
+#endif
+}
+
+static int tcp_get_keepalive_interval(lua_State *L) {
+#ifdef TCP_KEEPINTVL
+  return tcp_get_int_sockopt(L, IPPROTO_TCP, TCP_KEEPINTVL);
+#else
+  return luaL_error(L, "ENOTSUP");
+#endif
+}
+
+static int tcp_get_keepalive_count(lua_State *L) {
+#ifdef TCP_KEEPCNT
+  return tcp_get_int_sockopt(L, IPPROTO_TCP, TCP_KEEPCNT);
+#else
+  return luaL_error(L, "ENOTSUP");
+#endif
+}
+
+/*
+ * Milliseconds transmitted data may remain unacknowledged before the kernel
+ * fails the connection with ETIMEDOUT.
+ */
+static int tcp_set_user_timeout(lua_State *L) {
+#ifdef TCP_USER_TIMEOUT
+  return tcp_set_int_sockopt(L, IPPROTO_TCP, TCP_USER_TIMEOUT);
+#else
+  return luaL_error(L, "ENOTSUP");
+#endif
+}
+
+static int tcp_get_user_timeout(lua_State *L) {
+#ifdef TCP_USER_TIMEOUT
+  return tcp_get_int_sockopt(L, IPPROTO_TCP, TCP_USER_TIMEOUT);
+#else
+  return luaL_error(L, "ENOTSUP");
+#endif
+}
+
+static int tcp_set_fast_open_connect(lua_State *L) {
+  couv_tcp_t *w_handle;
+  int enable;
+
+  w_handle = couvL_checkudataclass(L, 1, COUV_TCP_MTBL_NAME);
+  enable = lua_toboolean(L, 2);
+#ifdef TCP_FASTOPEN_CONNECT
+  if (enable)
+    w_handle->flags |= COUV_TCP_FASTOPEN_CONNECT;
+  else
+    w_handle->flags &= ~COUV_TCP_FASTOPEN_CONNECT;
+
+  /* The option is applied in _bind or _connect if there is no socket. */
+  if (couv_handle_fd(&w_handle->handle) != -1 &&
+      couv_setsockopt_int(couv_handle_fd(&w_handle->handle), IPPROTO_TCP,
+          TCP_FASTOPEN_CONNECT, enable) < 0) {
+    return luaL_error(L, couvL_sock_lasterrname());
+  }
+  return 0;
+#else
+  return luaL_error(L, "ENOTSUP");
+#endif
+}
+
+static int tcp_get_fast_open_connect(lua_State *L) {
+  couv_tcp_t *w_handle;
+  int value;
+  int r;
+
+  w_handle = couvL_checkudataclass(L, 1, COUV_TCP_MTBL_NAME);
+#ifdef TCP_FASTOPEN_CONNECT
+  if (couv_handle_fd(&w_handle->handle) == -1) {
+    lua_pushboolean(L, w_handle->flags & COUV_TCP_FASTOPEN_CONNECT);
+    return 1;
+  }
+  r = couv_getsockopt_int(couv_handle_fd(&w_handle->handle), IPPROTO_TCP,
+      TCP_FASTOPEN_CONNECT, &value);
+  if (r < 0) {
+    return luaL_error(L, couvL_sock_lasterrname());
+  }
+  lua_pushboolean(L, value);
+  return 1;
+#else
+  return luaL_error(L, "ENOTSUP");
+#endif
+}
+
+/*
+ * Returns kernel statistics of the connection. If a table is passed, it is
+ * filled and returned instead of a new one, so that callers polling the
+ * statistics do not create garbage.
+ */
+static int tcp_get_info(lua_State *L) {
+#if defined(__linux__) && defined(TCP_INFO)
+  uv_tcp_t *handle;
+  couv_tcp_info_t info;
+  socklen_t len;
+  int r;
+
+  handle = couvL_checkudataclass(L, 1, COUV_TCP_MTBL_NAME);
+  memset(&info, 0, sizeof(info));
+  len = sizeof(info);
+  r = getsockopt(couv_handle_fd(handle), IPPROTO_TCP, TCP_INFO, &info, &len);
+  if (r < 0) {
+    return luaL_error(L, couvL_sock_lasterrname());
+  }
+
+  if (lua_istable(L, 2))
+    lua_settop(L, 2);
+  else
+    lua_createtable(L, 0, 16);
+
+  COUV_TCP_INFO_SET_FIELD(L, &info, len, state, state);
+  COUV_TCP_INFO_SET_FIELD(L, &info, len, caState, ca_state);
+  COUV_TCP_INFO_SET_FIELD(L, &info, len, retransmits, retransmits);
+  COUV_TCP_INFO_SET_FIELD(L, &info, len, rto, rto);
+  COUV_TCP_INFO_SET_FIELD(L, &info, len, sndMss, snd_mss);
+  COUV_TCP_INFO_SET_FIELD(L, &info, len, rcvMss, rcv_mss);
+  COUV_TCP_INFO_SET_FIELD(L, &info, len, unacked, unacked);
+  COUV_TCP_INFO_SET_FIELD(L, &info, len, lost, lost);
+  COUV_TCP_INFO_SET_FIELD(L, &info, len, rtt, rtt);
+  COUV_TCP_INFO_SET_FIELD(L, &info, len, rttvar, rttvar);
+  COUV_TCP_INFO_SET_FIELD(L, &info, len, sndSsthresh, snd_ssthresh);
+  COUV_TCP_INFO_SET_FIELD(L, &info, len, sndCwnd, snd_cwnd);
+  COUV_TCP_INFO_SET_FIELD(L, &info, len, totalRetrans, total_retrans);
+  COUV_TCP_INFO_SET_FIELD(L, &info, len, pacingRate, pacing_rate);
+  COUV_TCP_INFO_SET_FIELD(L, &info, len, bytesAcked, bytes_acked);
+  COUV_TCP_INFO_SET_FIELD(L, &info, len, bytesReceived, bytes_received);
+  COUV_TCP_INFO_SET_FIELD(L, &info, len, notsentBytes, notsent_bytes);
+  COUV_TCP_INFO_SET_FIELD(L, &info, len, minRtt, min_rtt);
+  COUV_TCP_INFO_SET_FIELD(L, &info, len, deliveryRate, delivery_rate);
+  return 1;
+#else
+  return luaL_error(L, "ENOTSUP");
+#endif
+}
+
+/*
+ * Checks without blocking that an idle connection was neither closed nor
+ * reset by the peer, and has no unread data.
+ */
+static int tcp_is_alive(lua_State *L) {
+  uv_tcp_t *handle;
+  couv_stream_handle_data_t *hdata;
+  char c;
+  int n;
+
+  handle = couvL_checkudataclass(L, 1, COUV_TCP_MTBL_NAME);
+  hdata = couv_get_stream_handle_data((uv_stream_t *)handle);
+  if (uv_is_closing((uv_handle_t *)handle) || couv_handle_fd(handle) == -1 ||
+      !ngx_queue_empty(&hdata->input_queue)) {
+    lua_pushboolean(L, 0);
+    return 1;
+  }
+
+#ifdef MSG_DONTWAIT
+  n = recv(couv_handle_fd(handle), &c, 1, MSG_PEEK | MSG_DONTWAIT);
+#else
+  n = recv(couv_handle_fd(handle), &c, 1, MSG_PEEK);
+#endif
+  lua_pushboolean(L, n < 0 && (couv_sock_errno() == EAGAIN ||
+      couv_sock_errno() == EWOULDBLOCK));
+  return 1;
+}
+
 static int tcp_getsockname(lua_State *L) {
   uv_tcp_t *handle;
   struct sockaddr_storage name;
@@ -201,15 +1142,36 @@ static const struct luaL_Reg tcp_methods[] = {
   { "bind", tcp_bind },
   { "_connect", tcp_connect },
   { "open", tcp_open },
+  { "reset", tcp_reset },
   { "keepalive", tcp_keepalive },
+  { "listenBatch", tcp_listen_batch },
   { "nodelay", tcp_nodelay },
+  { "getDeferAccept", tcp_get_defer_accept },
+  { "getFastOpen", tcp_get_fast_open },
+  { "getFastOpenConnect", tcp_get_fast_open_connect },
+  { "getInfo", tcp_get_info },
+  { "getKeepaliveCount", tcp_get_keepalive_count },
+  { "getKeepaliveInterval", tcp_get_keepalive_interval },
+  { "getNotSentLowat", tcp_get_not_sent_lowat },
   { "getpeername", tcp_getpeername },
+  { "getRecvBufferSize", tcp_get_recv_buffer_size },
+  { "getSendBufferSize", tcp_get_send_buffer_size },
+  { "getUserTimeout", tcp_get_user_timeout },
+  { "setDeferAccept", tcp_set_defer_accept },
+  { "setFastOpen", tcp_set_fast_open },
+  { "setFastOpenConnect", tcp_set_fast_open_connect },
+  { "setNotSentLowat", tcp_set_not_sent_lowat },
+  { "setRecvBufferSize", tcp_set_recv_buffer_size },
+  { "setSendBufferSize", tcp_set_send_buffer_size },
+  { "setUserTimeout", tcp_set_user_timeout },
   { "simultaneousAccepts", tcp_simultaneous_accepts },
   { "getsockname", tcp_getsockname },
+  { "isAlive", tcp_is_alive },
   { NULL, NULL }
 };
 
 static const struct luaL_Reg tcp_functions[] = {
+  { "_connectHost", tcp_connect_host },
   { "new", tcp_new },
   { NULL, NULL }
 };
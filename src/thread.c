@@ -0,0 +1,310 @@
+#include "couv-private.h"
+#include <lualib.h>
+
+/*
+ * OS threads running couv with their own lua_State and loop. The source,
+ * a Lua chunk or bytecode, runs in a coroutine of a new lua_State which
+ * has couv loaded with a new loop, and the loop runs until no handle is
+ * active. The arguments and results are marshalled, and the spawning loop
+ * is woken up with uv_async when the thread is done.
+ */
+
+typedef struct couv_thread_s {
+  lua_State *L;
+  lua_State *waiter;
+  uv_thread_t tid;
+  uv_async_t async;
+  char *source;
+  size_t source_len;
+  char *path;
+  char *cpath;
+  couv_msg_t args;
+  couv_msg_t results;
+  char *err;
+  int done;
+  int joined;
+  int collected;
+  int closed;
+} couv_thread_t;
+
+static char *couv_thread_strdup(lua_State *L, const char *str, size_t len) {
+  char *dup;
+
+  dup = couv_alloc(L, len + 1);
+  memcpy(dup, str, len);
+  dup[len] = '\0';
+  return dup;
+}
+
+static char *couv_thread_package_field(lua_State *L, const char *k) {
+  const char *str;
+  size_t len;
+  char *dup;
+
+  dup = NULL;
+  lua_getglobal(L, "package");
+  if (lua_istable(L, -1)) {
+    lua_getfield(L, -1, k);
+    str = lua_tolstring(L, -1, &len);
+    if (str)
+      dup = couv_thread_strdup(L, str, len);
+    lua_pop(L, 1);
+  }
+  lua_pop(L, 1);
+  return dup;
+}
+
+static void couv_thread_free(lua_State *L, couv_thread_t *t) {
+  couv_msg_free(L, &t->args);
+  couv_msg_free(L, &t->results);
+  couv_free(L, t->source);
+  couv_free(L, t->path);
+  couv_free(L, t->cpath);
+  couv_free(L, t->err);
+  couv_free(L, t);
+}
+
+static void couv_thread_set_error(couv_thread_t *t, lua_State *L,
+    const char *err) {
+  if (!err)
+    err = "unknown error";
+  t->err = couv_thread_strdup(L, err, strlen(err));
+}
+
+/* runs protected in the new lua_State and returns the loaded chunk. */
+static int couv_thread_setup(lua_State *L) {
+  couv_thread_t *t;
+
+  t = lua_touserdata(L, 1);
+  lua_getglobal(L, "package");
+  if (t->path) {
+    lua_pushstring(L, t->path);
+    lua_setfield(L, -2, "path");
+  }
+  if (t->cpath) {
+    lua_pushstring(L, t->cpath);
+    lua_setfield(L, -2, "cpath");
+  }
+  lua_pop(L, 1);
+
+  /* couv must be loaded before unpacking Buffers. */
+  lua_getglobal(L, "require");
+  lua_pushstring(L, "couv");
+  lua_call(L, 1, 0);
+
+  if (luaL_loadbuffer(L, t->source, t->source_len, "=thread") != 0)
+    return lua_error(L);
+  return 1;
+}
+
+static int couv_thread_pack(lua_State *L) {
+  couv_msg_t *msg;
+
+  msg = lua_touserdata(L, 1);
+  couv_msg_pack(L, msg, 2, lua_gettop(L) - 1);
+  return 0;
+}
+
+static void couv_thread_finish(couv_thread_t *t, lua_State *co) {
+  int nresults;
+
+  switch (lua_status(co)) {
+  case 0:
+    nresults = lua_gettop(co);
+    lua_pushcfunction(co, couv_thread_pack);
+    lua_insert(co, 1);
+    lua_pushlightuserdata(co, &t->results);
+    lua_insert(co, 2);
+    if (lua_pcall(co, nresults + 1, 0, 0) != 0) {
+      couv_msg_free(co, &t->results);
+      couv_thread_set_error(t, co, lua_tostring(co, -1));
+    }
+    break;
+  case LUA_YIELD:
+    couv_thread_set_error(t, co,
+        "thread is still waiting while it has no active handles");
+    break;
+  default:
+    couv_thread_set_error(t, co, lua_tostring(co, -1));
+    break;
+  }
+}
+
+static void couv_thread_entry(void *arg) {
+  couv_thread_t *t;
+  uv_loop_t *loop;
+  lua_State *L;
+  lua_State *co;
+  int nargs;
+
+  t = arg;
+  loop = uv_loop_new();
+  L = luaL_newstate();
+  luaL_openlibs(L);
+  lua_pushlightuserdata(L, loop);
+  lua_setfield(L, LUA_REGISTRYINDEX, COUV_LOOP_REGISTRY_KEY);
+
+  lua_pushcfunction(L, couv_thread_setup);
+  lua_pushlightuserdata(L, t);
+  if (lua_pcall(L, 1, 1, 0) != 0) {
+    couv_msg_free(L, &t->args);
+    couv_thread_set_error(t, L, lua_tostring(L, -1));
+  } else {
+    co = lua_newthread(L);
+    lua_insert(L, -2);
+    lua_xmove(L, co, 1);
+    nargs = couv_msg_unpack(co, &t->args);
+    couv_resume(co, L, nargs);
+    uv_run(loop);
+    couv_thread_finish(t, co);
+  }
+
+  /*
+   * run once more to finish the handles closed by lua_close, like Channels.
+   * The loop is taken from the state first, so that __gc in lua_close does
+   * not start handles whose userdata is being freed.
+   */
+  lua_pushnil(L);
+  lua_setfield(L, LUA_REGISTRYINDEX, COUV_LOOP_REGISTRY_KEY);
+  lua_close(L);
+  uv_run(loop);
+  uv_loop_delete(loop);
+  uv_async_send(&t->async);
+}
+
+static int couv_thread_push_results(lua_State *L, couv_thread_t *t) {
+  t->joined = 1;
+  if (t->err) {
+    lua_pushboolean(L, 0);
+    lua_pushstring(L, t->err);
+    return 2;
+  }
+  lua_pushboolean(L, 1);
+  return 1 + couv_msg_unpack(L, &t->results);
+}
+
+static void couv_thread_close_cb(uv_handle_t *handle) {
+  couv_thread_t *t;
+
+  t = container_of(handle, couv_thread_t, async);
+  t->closed = 1;
+  if (t->collected)
+    couv_thread_free(t->L, t);
+}
+
+static void couv_thread_async_cb(uv_async_t *async, int status) {
+  couv_thread_t *t;
+  lua_State *co;
+  int nresults;
+
+  t = container_of(async, couv_thread_t, async);
+  uv_thread_join(&t->tid);
+  t->done = 1;
+  uv_close((uv_handle_t *)async, couv_thread_close_cb);
+
+  co = t->waiter;
+  if (!co)
+    return;
+  t->waiter = NULL;
+  nresults = couv_thread_push_results(co, t);
+  couv_resume(co, co, nresults);
+  lua_pushnil(co);
+  couv_rawsetp(co, LUA_REGISTRYINDEX, COUV_THREAD_REG_KEY(t));
+}
+
+static couv_thread_t *couv_checkthread(lua_State *L, int index) {
+  return *(couv_thread_t **)luaL_checkudata(L, index, COUV_THREAD_MTBL_NAME);
+}
+
+static int thread_spawn(lua_State *L) {
+  const char *source;
+  size_t source_len;
+  couv_msg_t args;
+  couv_thread_t *t;
+  couv_thread_t **ud;
+
+  source = luaL_checklstring(L, 1, &source_len);
+  couv_msg_init(&args);
+  couv_msg_pack(L, &args, 2, lua_gettop(L) - 1);
+
+  t = couv_alloc(L, sizeof(couv_thread_t));
+  memset(t, 0, sizeof(couv_thread_t));
+  t->L = L;
+  t->source = couv_thread_strdup(L, source, source_len);
+  t->source_len = source_len;
+  t->path = couv_thread_package_field(L, "path");
+  t->cpath = couv_thread_package_field(L, "cpath");
+  t->args = args;
+  couv_msg_init(&t->results);
+
+  uv_async_init(couv_loop(L), &t->async, couv_thread_async_cb);
+  if (uv_thread_create(&t->tid, couv_thread_entry, t) != 0) {
+    t->collected = 1;
+    uv_close((uv_handle_t *)&t->async, couv_thread_close_cb);
+    return luaL_error(L, "EAGAIN");
+  }
+
+  ud = lua_newuserdata(L, sizeof(couv_thread_t *));
+  *ud = t;
+  luaL_getmetatable(L, COUV_THREAD_MTBL_NAME);
+  lua_setmetatable(L, -2);
+  return 1;
+}
+
+static int thread_is_done(lua_State *L) {
+  couv_thread_t *t;
+
+  t = couv_checkthread(L, 1);
+  lua_pushboolean(L, t->done);
+  return 1;
+}
+
+static int thread_join(lua_State *L) {
+  couv_thread_t *t;
+
+  t = couv_checkthread(L, 1);
+  if (t->joined)
+    return luaL_error(L, "EINVAL");
+  if (t->done)
+    return couv_thread_push_results(L, t);
+  if (t->waiter)
+    return luaL_error(L, "EBUSY");
+  if (couvL_is_mainthread(L))
+    return luaL_error(L, "join must be called in coroutine.");
+  couv_rawsetp(L, LUA_REGISTRYINDEX, COUV_THREAD_REG_KEY(t));
+  t->waiter = L;
+  return lua_yield(L, 0);
+}
+
+static int thread_gc(lua_State *L) {
+  couv_thread_t *t;
+
+  t = couv_checkthread(L, 1);
+  t->collected = 1;
+  if (t->closed)
+    couv_thread_free(L, t);
+  return 0;
+}
+
+static const struct luaL_Reg thread_functions[] = {
+  { "spawn", thread_spawn },
+  { NULL, NULL }
+};
+
+static const struct luaL_Reg thread_methods[] = {
+  { "__gc", thread_gc },
+  { "isDone", thread_is_done },
+  { "join", thread_join },
+  { NULL, NULL }
+};
+
+int luaopen_couv_thread(lua_State *L) {
+  couv_newmetatable(L, COUV_THREAD_MTBL_NAME, NULL);
+  couvL_setfuncs(L, thread_methods, 0);
+  lua_pop(L, 1);
+
+  lua_createtable(L, 0, ARRAY_SIZE(thread_functions) - 1);
+  couvL_setfuncs(L, thread_functions, 0);
+  lua_setfield(L, -2, "Thread");
+  return 0;
+}
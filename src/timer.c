@@ -18,6 +18,8 @@ void couv_clean_timer_handle(lua_State *L, uv_timer_t *handle) {
   couv_rawsetp(L, LUA_REGISTRYINDEX, COUV_TIMER_CB_REG_KEY(handle));
   lua_pushnil(L);
   couv_rawsetp(L, LUA_REGISTRYINDEX, COUV_USERDATA_REG_KEY(handle));
+  lua_pushnil(L);
+  couv_rawsetp(L, LUA_REGISTRYINDEX, COUV_THREAD_REG_KEY(handle));
 }
 
 static int couv_timer_create(lua_State *L) {
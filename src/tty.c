@@ -19,6 +19,8 @@ static uv_tty_t *couv_new_tty_handle(lua_State *L) {
 }
 
 void couv_clean_tty_handle(lua_State *L, uv_tty_t *handle) {
+  couv_clean_stream_proxy((uv_stream_t *)handle);
+
   lua_pushnil(L);
   couv_rawsetp(L, LUA_REGISTRYINDEX, COUV_USERDATA_REG_KEY(handle));
 
@@ -27,6 +29,8 @@ void couv_clean_tty_handle(lua_State *L, uv_tty_t *handle) {
 
   lua_pushnil(L);
   couv_rawsetp(L, LUA_REGISTRYINDEX, COUV_LISTEN_CB_REG_KEY(handle));
+
+  couv_cancel_stream_reader((uv_stream_t *)handle);
 }
 
 static int tty_new(lua_State *L) {
@@ -52,7 +56,7 @@ static int tty_new(lua_State *L) {
 
   handle->data = L;
   hdata = couv_get_stream_handle_data((uv_stream_t *)handle);
-  ngx_queue_init(&hdata->input_queue);
+  couv_init_stream_handle_data(hdata);
 
   lua_pushvalue(L, -1);
   couv_rawsetp(L, LUA_REGISTRYINDEX, COUV_USERDATA_REG_KEY(handle));
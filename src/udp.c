@@ -2,8 +2,90 @@
 
 #define couv_get_udp_handle_data(h) (&((couv_udp_t *)h)->hdata)
 
+/* a bind flag of our own, beside the uv_udp_flags. */
+#define COUV_UDP_REUSEPORT 0x100
+
+/* recv_flags bits, for the ancillary data received with datagrams. */
+#define COUV_UDP_RECV_GRO 0x01
+#define COUV_UDP_RECV_TIMESTAMP 0x02
+#define COUV_UDP_RECV_PKTINFO 0x04
+#define COUV_UDP_RECV_DROPS 0x08
+
+/* the largest payload of an IPv4 datagram. */
+#define COUV_UDP_MAX_DATAGRAM_SIZE 65507
+
+#if defined(__linux__)
+#include <netinet/udp.h>
+#if defined(UDP_SEGMENT) && defined(UDP_GRO)
+#define COUV_HAVE_UDP_GSO 1
+#ifndef SOL_UDP
+#define SOL_UDP IPPROTO_UDP
+#endif
+#endif
+#endif
+
+/* the kernel accepts up to 64 segments in a UDP_SEGMENT send. */
+#define COUV_UDP_MAX_SEGMENTS 64
+
+#define COUV_UDP_RING_DEFAULT_SLOT_SIZE 1500
+#define COUV_UDP_RING_MAX_SLOTS 65536
+
+/* ring->paused values, for the receive to restart. */
+#define COUV_UDP_RING_PAUSED_UV 1
+#define COUV_UDP_RING_PAUSED_POLL 2
+
+#ifndef _WIN32
+#define COUV_HAVE_UDP_RECV_BATCH 1
+
+#include <time.h>
+#include <sys/time.h>
+
+#ifndef __linux__
+struct mmsghdr {
+  struct msghdr msg_hdr;
+  unsigned int msg_len;
+};
+#endif
+
+#define COUV_UDP_RECV_BATCH_DEFAULT_SIZE 32
+#define COUV_UDP_RECV_BATCH_MAX_SIZE 1024
+#define COUV_UDP_RECV_BATCH_DEFAULT_SLOT_SIZE 2048
+#define COUV_UDP_RECV_CONTROL_SIZE 256
+/* a GRO datagram may be as large as this. */
+#define COUV_UDP_GRO_SLOT_SIZE 65536
+
+#if defined(IP_PKTINFO) && defined(IPV6_PKTINFO)
+#define COUV_HAVE_UDP_PKTINFO 1
+#ifndef IPV6_RECVPKTINFO
+#define IPV6_RECVPKTINFO IPV6_PKTINFO
+#endif
+#endif
+
+/*
+ * Batch receive state. libuv's own watcher stays on the udp socket for
+ * sending, so a duplicated fd is watched with uv_poll for receiving.
+ */
+struct couv_udp_recv_batch_s {
+  uv_udp_t *udp;
+  uv_poll_t poll;
+  uv_os_sock_t fd;
+  int size;
+  size_t slot_size;
+  struct mmsghdr *msgs;
+  struct iovec *iovs;
+  struct sockaddr_storage *addrs;
+  char *controls;
+  /* the block for the next receive, slots are sliced from it. */
+  void *mem;
+};
+
+static int couv_udp_start_recv_batch(lua_State *L, uv_udp_t *handle,
+    int size, int slot_size);
+#endif
+
 typedef struct couv_udp_send_s {
   uv_buf_t *bufs;
+  void **mems;
   uv_udp_send_t req;
 } couv_udp_send_t;
 
@@ -15,6 +97,7 @@ static couv_udp_send_t *couv_alloc_udp_send(lua_State *L, uv_buf_t *bufs) {
     return NULL;
 
   req->bufs = bufs;
+  req->mems = NULL;
   return req;
 }
 
@@ -40,12 +123,181 @@ static uv_udp_t *couv_new_udp_handle(lua_State *L) {
   return handle;
 }
 
+static void couv_udp_free_input(lua_State *L, couv_udp_input_t *input) {
+  if (!input->block)
+    couv_free(L, input);
+  else if (--input->block->ref_cnt == 0)
+    couv_free(L, input->block);
+}
+
+/*
+ * Receive ring. The slots are allocated at once, and each of them is a
+ * couv_buf_mem_t which goes back to the ring when its last reference is
+ * released. Receiving pauses while all the slots are out and restarts when
+ * one of them comes back. A slot may come back from Buffer __gc, even in
+ * lua_close, so the receive is restarted later from an idle callback, and
+ * not at all once the state has no loop, see couv_thread_entry.
+ */
+struct couv_udp_ring_s {
+  lua_State *L;
+  /* NULL after the handle is closed. */
+  uv_udp_t *udp;
+  size_t slot_size;
+  int count;
+  int nfree;
+  couv_buf_mem_t **free_slots;
+  char *slab;
+  int paused;
+  uv_idle_t idle;
+  int idle_closed;
+  double exhausted;
+};
+
+static void udp_recv_cb(uv_udp_t *handle, ssize_t nread, uv_buf_t buf,
+    struct sockaddr* addr, unsigned flags);
+#ifdef COUV_HAVE_UDP_RECV_BATCH
+static void udp_recv_batch_poll_cb(uv_poll_t *poll, int status, int events);
+#endif
+
+static void couv_udp_ring_maybe_free(couv_udp_ring_t *ring) {
+  if (ring->udp || ring->nfree < ring->count || !ring->idle_closed)
+    return;
+  couv_free(ring->L, ring->free_slots);
+  couv_free(ring->L, ring->slab);
+  couv_free(ring->L, ring);
+}
+
+/* takes a slot with one reference, or returns NULL if none is free. */
+static couv_buf_mem_t *couv_udp_ring_take(couv_udp_ring_t *ring) {
+  couv_buf_mem_t *mem;
+
+  if (ring->nfree == 0)
+    return NULL;
+  mem = ring->free_slots[--ring->nfree];
+  mem->ref_cnt = 1;
+  return mem;
+}
+
+static uv_buf_t couv_udp_ring_alloc_cb(uv_handle_t *handle,
+    size_t suggested_size) {
+  couv_udp_ring_t *ring;
+  couv_buf_mem_t *mem;
+
+  ring = couv_get_udp_handle_data(handle)->ring;
+  mem = couv_udp_ring_take(ring);
+  /* udp_recv_cb stops receiving before the ring runs out. */
+  if (!mem)
+    return couv_buf_alloc_cb(handle, ring->slot_size);
+  return uv_buf_init(mem->mem, ring->slot_size);
+}
+
+static void couv_udp_ring_idle_cb(uv_idle_t *idle, int status) {
+  couv_udp_ring_t *ring;
+  int paused;
+
+  ring = container_of(idle, couv_udp_ring_t, idle);
+  uv_idle_stop(idle);
+  paused = ring->paused;
+  ring->paused = 0;
+  if (paused == COUV_UDP_RING_PAUSED_UV)
+    uv_udp_recv_start(ring->udp, couv_udp_ring_alloc_cb, udp_recv_cb);
+#ifdef COUV_HAVE_UDP_RECV_BATCH
+  else if (paused == COUV_UDP_RING_PAUSED_POLL) {
+    uv_poll_start(&couv_get_udp_handle_data(ring->udp)->recv_batch->poll,
+        UV_READABLE, udp_recv_batch_poll_cb);
+  }
+#endif
+}
+
+static void couv_udp_ring_idle_close_cb(uv_handle_t *handle) {
+  couv_udp_ring_t *ring;
+
+  ring = container_of(handle, couv_udp_ring_t, idle);
+  ring->idle_closed = 1;
+  couv_udp_ring_maybe_free(ring);
+}
+
+static void couv_udp_ring_slot_free_cb(lua_State *L, couv_buf_mem_t *mem) {
+  couv_udp_ring_t *ring;
+
+  ring = mem->data;
+  ring->free_slots[ring->nfree++] = mem;
+  if (!ring->udp)
+    couv_udp_ring_maybe_free(ring);
+  else if (ring->paused && couv_loop(L))
+    uv_idle_start(&ring->idle, couv_udp_ring_idle_cb);
+}
+
+#ifdef COUV_HAVE_UDP_RECV_BATCH
+static void udp_recv_batch_close_cb(uv_handle_t *handle) {
+  couv_udp_recv_batch_t *batch;
+  lua_State *L;
+
+  batch = container_of(handle, couv_udp_recv_batch_t, poll);
+  L = handle->data;
+  close(batch->fd);
+  if (batch->mem)
+    couv_buf_mem_release(L, batch->mem);
+  couv_free(L, batch->msgs);
+  couv_free(L, batch->iovs);
+  couv_free(L, batch->addrs);
+  couv_free(L, batch->controls);
+  couv_free(L, batch);
+}
+#endif
+
 void couv_clean_udp_handle(lua_State *L, uv_udp_t *handle) {
+  couv_udp_handle_data_t *hdata;
+  couv_udp_input_t *input;
+  couv_udp_ring_t *ring;
+  lua_State *co;
+
+  hdata = couv_get_udp_handle_data(handle);
+  couv_clean_pacer(L, (uv_handle_t *)handle);
+  ring = hdata->ring;
+  if (ring)
+    ring->paused = 0;
+  while (!ngx_queue_empty(&hdata->input_queue)) {
+    input = (couv_udp_input_t *)ngx_queue_head(&hdata->input_queue);
+    ngx_queue_remove(input);
+    if (input->w_buf.orig)
+      couv_buf_mem_release(L, input->w_buf.orig);
+    couv_udp_free_input(L, input);
+  }
+#ifdef COUV_HAVE_UDP_RECV_BATCH
+  if (hdata->recv_batch) {
+    hdata->recv_batch->poll.data = L;
+    uv_close((uv_handle_t *)&hdata->recv_batch->poll,
+        udp_recv_batch_close_cb);
+    hdata->recv_batch = NULL;
+  }
+#endif
+  /* the ring is freed when the last slot comes back. */
+  if (ring) {
+    ring->udp = NULL;
+    hdata->ring = NULL;
+    uv_close((uv_handle_t *)&ring->idle, couv_udp_ring_idle_close_cb);
+  }
+
+  lua_pushnil(L);
+  couv_rawsetp(L, LUA_REGISTRYINDEX, COUV_RECV_INFO_REG_KEY(handle));
+
+  lua_pushnil(L);
+  couv_rawsetp(L, LUA_REGISTRYINDEX, COUV_ADDR_CACHE_REG_KEY(handle));
+
   lua_pushnil(L);
   couv_rawsetp(L, LUA_REGISTRYINDEX, COUV_USERDATA_REG_KEY(handle));
 
   lua_pushnil(L);
   couv_rawsetp(L, LUA_REGISTRYINDEX, COUV_THREAD_REG_KEY(handle));
+
+  /* the coroutine waiting in _recv or _recvBatch gets an error. */
+  co = couv_take_input_waiter((uv_handle_t *)handle, &hdata->recv_waiter);
+  if (co) {
+    lua_pushboolean(co, 0);
+    lua_pushstring(co, "ECANCELED");
+    couv_resume(co, co, 2);
+  }
 }
 
 static int udp_new(lua_State *L) {
@@ -67,12 +319,41 @@ static int udp_new(lua_State *L) {
   handle->data = L;
   hdata = couv_get_udp_handle_data(handle);
   ngx_queue_init(&hdata->input_queue);
+  hdata->recv_waiter = NULL;
+  hdata->send_pending = 0;
+  hdata->recv_batch = NULL;
+  hdata->recv_flags = 0;
+  hdata->ring = NULL;
+  hdata->sockopts.cnt = 0;
+  hdata->addr_cache_max = 0;
+  hdata->addr_cache_size = 0;
+  hdata->connected = 0;
+  hdata->try_sent = 0;
+  hdata->try_queued = 0;
+  hdata->pacer = NULL;
+  hdata->recv_truncated = 0;
+  hdata->recv_drops = 0;
+  hdata->try_failed = 0;
 
   lua_pushvalue(L, -1);
   couv_rawsetp(L, LUA_REGISTRYINDEX, COUV_USERDATA_REG_KEY(handle));
   return 1;
 }
 
+/*
+ * Sets the options kept while the handle had no socket, once libuv has
+ * created it in bind, recv or send.
+ */
+static void couv_udp_apply_sockopts(lua_State *L, uv_udp_t *handle) {
+  couv_udp_handle_data_t *hdata;
+
+  hdata = couv_get_udp_handle_data(handle);
+  if (hdata->sockopts.cnt == 0 || couv_handle_fd(handle) == -1)
+    return;
+  if (couv_apply_sockopts(couv_handle_fd(handle), &hdata->sockopts) < 0)
+    luaL_error(L, couvL_sock_lasterrname());
+}
+
 static int udp_open(lua_State *L) {
   uv_udp_t *handle;
   uv_os_sock_t sock;
@@ -87,15 +368,63 @@ static int udp_open(lua_State *L) {
   return 0;
 }
 
+#if !defined(_WIN32) && defined(SO_REUSEPORT)
+/*
+ * Creates the socket with SO_REUSEPORT, which must be set before bind, and
+ * lets the handle open it. Returns the error name, or NULL.
+ */
+static const char *couv_udp_bind_reuseport(uv_udp_t *handle,
+    struct sockaddr *addr, unsigned flags) {
+  uv_os_sock_t sock;
+  const char *err_name;
+
+  if (couv_handle_fd(handle) != -1)
+    return "EINVAL";
+  sock = couv_socket_nonblock(addr->sa_family, SOCK_DGRAM);
+  if (sock == -1)
+    return couvL_sock_lasterrname();
+  if (couv_setsockopt_int(sock, SOL_SOCKET, SO_REUSEPORT, 1) < 0
+      || couv_apply_sockopts(sock,
+          &couv_get_udp_handle_data(handle)->sockopts) < 0
+      || (addr->sa_family == AF_INET6 && (flags & UV_UDP_IPV6ONLY)
+      && couv_setsockopt_int(sock, IPPROTO_IPV6, IPV6_V6ONLY, 1) < 0)
+      || bind(sock, addr, addr->sa_family == AF_INET6
+      ? sizeof(struct sockaddr_in6) : sizeof(struct sockaddr_in)) < 0) {
+    err_name = couvL_sock_lasterrname();
+    close(sock);
+    return err_name;
+  }
+  if (uv_udp_open(handle, sock) < 0) {
+    close(sock);
+    return couvL_uv_lasterrname(handle->loop);
+  }
+  return NULL;
+}
+#endif
+
 static int udp_bind(lua_State *L) {
   uv_udp_t *handle;
   struct sockaddr *addr;
   unsigned flags;
   int r;
+#if !defined(_WIN32) && defined(SO_REUSEPORT)
+  const char *err_name;
+#endif
 
   handle = couvL_checkudataclass(L, 1, COUV_UDP_MTBL_NAME);
   addr = couvL_checkudataclass(L, 2, COUV_SOCK_ADDR_MTBL_NAME);
   flags = luaL_optint(L, 3, 0);
+  if (flags & COUV_UDP_REUSEPORT) {
+#if !defined(_WIN32) && defined(SO_REUSEPORT)
+    err_name = couv_udp_bind_reuseport(handle, addr,
+        flags & ~COUV_UDP_REUSEPORT);
+    if (err_name)
+      return luaL_error(L, err_name);
+    return 0;
+#else
+    return luaL_error(L, "ENOTSUP");
+#endif
+  }
   if (addr->sa_family == AF_INET)
     r = uv_udp_bind(handle, *(struct sockaddr_in *)addr, flags);
   else
@@ -103,6 +432,7 @@ static int udp_bind(lua_State *L) {
   if (r < 0) {
     return luaL_error(L, couvL_uv_lasterrname(couv_loop(L)));
   }
+  couv_udp_apply_sockopts(L, handle);
   return 0;
 }
 
@@ -112,30 +442,312 @@ static void udp_send_cb(uv_udp_send_t* req, int status) {
   int nresults;
 
   holder = container_of(req, couv_udp_send_t, req);
-  L = req->handle->data;
+  L = couv_take_req_thread((uv_req_t *)req);
+  --couv_get_udp_handle_data(req->handle)->send_pending;
   if (status < 0) {
     lua_pushstring(L, couvL_uv_lasterrname(req->handle->loop));
     nresults = 1;
   } else
     nresults = 0;
+  couv_release_buf_mems(L, holder->mems);
   couv_free(L, holder->bufs);
   couv_free(L, holder);
   couv_resume(L, L, nresults);
 }
 
+/*
+ * Returns the SockAddr at index, or the peer address if it is nil and the
+ * handle is connected.
+ */
+static struct sockaddr *couv_udp_check_dest(lua_State *L, uv_udp_t *handle,
+    int index) {
+  couv_udp_handle_data_t *hdata;
+
+  hdata = couv_get_udp_handle_data(handle);
+  if (lua_isnoneornil(L, index) && hdata->connected)
+    return (struct sockaddr *)&hdata->peer;
+  return couvL_checkudataclass(L, index, COUV_SOCK_ADDR_MTBL_NAME);
+}
+
+#ifndef _WIN32
+/*
+ * Sends on a connected socket without yielding. Returns 1 if sent, 0 if
+ * the socket is not writable. Raises an error if send fails.
+ */
+static int couv_udp_send_connected(lua_State *L, uv_udp_t *handle,
+    uv_buf_t *bufs, size_t bufcnt) {
+  struct msghdr msg;
+
+  memset(&msg, 0, sizeof(msg));
+  /* uv_buf_t has the same layout as struct iovec on unix. */
+  msg.msg_iov = (struct iovec *)bufs;
+  msg.msg_iovlen = bufcnt;
+  if (sendmsg(couv_handle_fd(handle), &msg, MSG_DONTWAIT) >= 0)
+    return 1;
+  if (errno == EAGAIN || errno == EWOULDBLOCK || errno == ENOBUFS)
+    return 0;
+  couv_free(L, bufs);
+  luaL_error(L, couvL_sys_errname(errno));
+  return 0;
+}
+#endif
+
+#ifdef COUV_HAVE_UDP_PKTINFO
+/*
+ * Sends from the source address src, and out of the interface ifindex if
+ * it is not 0, with IP_PKTINFO or IPV6_PKTINFO. dest is NULL on a connected
+ * socket. Returns the result of sendmsg.
+ */
+static ssize_t couv_udp_send_from(uv_udp_t *handle, uv_buf_t *bufs,
+    size_t bufcnt, struct sockaddr *dest, struct sockaddr *src,
+    unsigned ifindex) {
+  struct msghdr msg;
+  struct cmsghdr *cmsg;
+  struct in_pktinfo pi;
+  struct in6_pktinfo pi6;
+  union {
+    struct cmsghdr align;
+    char buf[CMSG_SPACE(sizeof(struct in6_pktinfo))];
+  } control;
+
+  memset(&msg, 0, sizeof(msg));
+  memset(&control, 0, sizeof(control));
+  if (dest) {
+    msg.msg_name = dest;
+    msg.msg_namelen = dest->sa_family == AF_INET6
+        ? sizeof(struct sockaddr_in6) : sizeof(struct sockaddr_in);
+  }
+  /* uv_buf_t has the same layout as struct iovec on unix. */
+  msg.msg_iov = (struct iovec *)bufs;
+  msg.msg_iovlen = bufcnt;
+  msg.msg_control = control.buf;
+  if (src->sa_family == AF_INET6) {
+    memset(&pi6, 0, sizeof(pi6));
+    pi6.ipi6_addr = ((struct sockaddr_in6 *)src)->sin6_addr;
+    pi6.ipi6_ifindex = ifindex ? ifindex
+        : ((struct sockaddr_in6 *)src)->sin6_scope_id;
+    msg.msg_controllen = CMSG_SPACE(sizeof(pi6));
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = IPPROTO_IPV6;
+    cmsg->cmsg_type = IPV6_PKTINFO;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(pi6));
+    memcpy(CMSG_DATA(cmsg), &pi6, sizeof(pi6));
+  } else {
+    memset(&pi, 0, sizeof(pi));
+    pi.ipi_spec_dst = ((struct sockaddr_in *)src)->sin_addr;
+    pi.ipi_ifindex = ifindex;
+    msg.msg_controllen = CMSG_SPACE(sizeof(pi));
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = IPPROTO_IP;
+    cmsg->cmsg_type = IP_PKTINFO;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(pi));
+    memcpy(CMSG_DATA(cmsg), &pi, sizeof(pi));
+  }
+  return sendmsg(couv_handle_fd(handle), &msg, MSG_DONTWAIT);
+}
+#endif
+
+/*
+ * Returns the source SockAddr at index, or NULL if it is nil. Raises
+ * ENOTSUP if sending from a source address is not supported.
+ */
+static struct sockaddr *couv_udp_check_src(lua_State *L, int index,
+    uv_buf_t *bufs) {
+  if (lua_isnoneornil(L, index))
+    return NULL;
+#ifdef COUV_HAVE_UDP_PKTINFO
+  return couvL_checkudataclass(L, index, COUV_SOCK_ADDR_MTBL_NAME);
+#else
+  couv_free(L, bufs);
+  luaL_error(L, "ENOTSUP");
+  return NULL;
+#endif
+}
+
+/*
+ * A send held back by pacing. bufs point into the arguments of the yielded
+ * coroutine, or to the copy in data for trySend.
+ */
+typedef struct couv_udp_paced_s {
+  couv_pacer_item_t item;
+  uv_udp_send_t req;
+  uv_udp_t *handle;
+  uv_buf_t *bufs;
+  size_t bufcnt;
+  void **mems;
+  int to_peer;
+  struct sockaddr_storage dest;
+  struct sockaddr_storage src;
+  unsigned ifindex;
+  uv_buf_t buf;
+  char data[1];
+} couv_udp_paced_t;
+
+static void couv_udp_paced_done(couv_udp_paced_t *paced,
+    const char *err_name) {
+  couv_udp_handle_data_t *hdata;
+
+  if (paced->item.co) {
+    couv_release_buf_mems(paced->item.co, paced->mems);
+    couv_free(paced->item.co, paced->bufs);
+  } else {
+    hdata = couv_get_udp_handle_data(paced->handle);
+    if (err_name)
+      ++hdata->try_failed;
+    else
+      ++hdata->try_sent;
+  }
+  couv_pacer_finish(&paced->item, err_name);
+}
+
+static void udp_paced_send_cb(uv_udp_send_t *req, int status) {
+  --couv_get_udp_handle_data(req->handle)->send_pending;
+  couv_udp_paced_done(container_of(req, couv_udp_paced_t, req),
+      status < 0 ? couvL_uv_lasterrname(req->handle->loop) : NULL);
+}
+
+static void couv_udp_release_paced(couv_pacer_item_t *item, int status) {
+  couv_udp_paced_t *paced;
+  uv_udp_t *handle;
+  int r;
+
+  paced = (couv_udp_paced_t *)item;
+  handle = paced->handle;
+  if (status < 0) {
+    couv_udp_paced_done(paced, "ECANCELED");
+    return;
+  }
+#ifdef COUV_HAVE_UDP_PKTINFO
+  if (paced->src.ss_family != AF_UNSPEC) {
+    r = couv_udp_send_from(handle, paced->bufs, paced->bufcnt,
+        paced->to_peer ? NULL : (struct sockaddr *)&paced->dest,
+        (struct sockaddr *)&paced->src, paced->ifindex) < 0 ? errno : 0;
+    couv_udp_paced_done(paced, r ? couvL_sys_errname(r) : NULL);
+    return;
+  }
+#endif
+  if (paced->dest.ss_family == AF_INET6) {
+    r = uv_udp_send6(&paced->req, handle, paced->bufs, (int)paced->bufcnt,
+        *(struct sockaddr_in6 *)&paced->dest, udp_paced_send_cb);
+  } else {
+    r = uv_udp_send(&paced->req, handle, paced->bufs, (int)paced->bufcnt,
+        *(struct sockaddr_in *)&paced->dest, udp_paced_send_cb);
+  }
+  if (r < 0) {
+    couv_udp_paced_done(paced, couvL_uv_lasterrname(handle->loop));
+    return;
+  }
+  ++couv_get_udp_handle_data(handle)->send_pending;
+}
+
+/*
+ * Queues a send to the pacer of the handle. trySend passes copy to queue a
+ * copy of the data without waiting, and bufs is freed then. Otherwise the
+ * Buffers of the array at index 2, which bufs points into, are retained.
+ */
+static void couv_udp_queue_paced(lua_State *L, uv_udp_t *handle,
+    uv_buf_t *bufs, size_t bufcnt, size_t len, struct sockaddr *addr,
+    struct sockaddr *src, unsigned ifindex, int copy) {
+  couv_udp_paced_t *paced;
+  size_t i;
+
+  if (copy) {
+    paced = couv_alloc(L, offsetof(couv_udp_paced_t, data) + len);
+    len = 0;
+    for (i = 0; i < bufcnt; ++i) {
+      memcpy(paced->data + len, bufs[i].base, bufs[i].len);
+      len += bufs[i].len;
+    }
+    couv_free(L, bufs);
+    paced->buf = uv_buf_init(paced->data, len);
+    paced->bufs = &paced->buf;
+    paced->bufcnt = 1;
+  } else {
+    paced = couv_alloc(L, sizeof(couv_udp_paced_t));
+    paced->bufs = bufs;
+    paced->bufcnt = bufcnt;
+    paced->mems = couv_retain_buf_mems(L, 2);
+  }
+  paced->handle = handle;
+  paced->to_peer =
+      addr == (struct sockaddr *)&couv_get_udp_handle_data(handle)->peer;
+  memcpy(&paced->dest, addr, addr->sa_family == AF_INET6
+      ? sizeof(struct sockaddr_in6) : sizeof(struct sockaddr_in));
+  paced->src.ss_family = AF_UNSPEC;
+  if (src) {
+    memcpy(&paced->src, src, src->sa_family == AF_INET6
+        ? sizeof(struct sockaddr_in6) : sizeof(struct sockaddr_in));
+  }
+  paced->ifindex = ifindex;
+  couv_pacer_enqueue(L, couv_get_udp_handle_data(handle)->pacer,
+      &paced->item, len, couv_udp_release_paced, !copy);
+}
+
+static size_t couv_udp_bufs_len(uv_buf_t *bufs, size_t bufcnt) {
+  size_t len;
+  size_t i;
+
+  len = 0;
+  for (i = 0; i < bufcnt; ++i)
+    len += bufs[i].len;
+  return len;
+}
+
+/*
+ * send(bufs, addr, src, ifindex). A datagram with the source address src
+ * is sent at once with sendmsg, EAGAIN is raised if the socket buffer is
+ * full. With pacing, the coroutine waits until the datagram is released.
+ */
 static int udp_send(lua_State *L) {
   uv_udp_t *handle;
   struct sockaddr *addr;
+  struct sockaddr *src;
   uv_buf_t *bufs;
   size_t bufcnt;
   couv_udp_send_t *holder;
   uv_udp_send_t *req;
+  couv_pacer_t *pacer;
+  unsigned ifindex;
+  size_t len;
   int r;
 
   handle = couvL_checkudataclass(L, 1, COUV_UDP_MTBL_NAME);
   bufs = couv_checkbuforstrtable(L, 2, &bufcnt);
-  addr = couvL_checkudataclass(L, 3, COUV_SOCK_ADDR_MTBL_NAME);
+  addr = couv_udp_check_dest(L, handle, 3);
+  src = couv_udp_check_src(L, 4, bufs);
+  ifindex = (unsigned)luaL_optnumber(L, 5, 0);
+  pacer = couv_get_udp_handle_data(handle)->pacer;
+  if (pacer) {
+    len = couv_udp_bufs_len(bufs, bufcnt);
+    if (!couv_pacer_admit(pacer, len)) {
+      couv_udp_queue_paced(L, handle, bufs, bufcnt, len, addr, src, ifindex,
+          0);
+      return lua_yield(L, 0);
+    }
+  }
+#ifdef COUV_HAVE_UDP_PKTINFO
+  if (src) {
+    if (addr == (struct sockaddr *)&couv_get_udp_handle_data(handle)->peer)
+      addr = NULL;
+    r = couv_udp_send_from(handle, bufs, bufcnt, addr, src, ifindex) < 0
+        ? errno : 0;
+    couv_free(L, bufs);
+    if (r)
+      return luaL_error(L, couvL_sys_errname(r));
+    return 0;
+  }
+#endif
+#ifndef _WIN32
+  /* the kernel has the route, so try sending at once. */
+  if (addr == (struct sockaddr *)&couv_get_udp_handle_data(handle)->peer
+      && couv_get_udp_handle_data(handle)->send_pending == 0
+      && couv_udp_send_connected(L, handle, bufs, bufcnt)) {
+    couv_free(L, bufs);
+    return 0;
+  }
+#endif
   holder = couv_alloc_udp_send(L, bufs);
+  holder->mems = couv_retain_buf_mems(L, 2);
   req = &holder->req;
   if (addr->sa_family == AF_INET) {
     r = uv_udp_send(req, handle, bufs, (int)bufcnt,
@@ -145,19 +757,588 @@ static int udp_send(lua_State *L) {
         *(struct sockaddr_in6 *)addr, udp_send_cb);
   }
   if (r < 0) {
+    couv_release_buf_mems(L, holder->mems);
+    couv_free(L, bufs);
+    couv_free(L, holder);
     return luaL_error(L, couvL_uv_lasterrname(couv_loop(L)));
   }
+  ++couv_get_udp_handle_data(handle)->send_pending;
+  couv_set_req_thread(L, (uv_req_t *)req);
   return lua_yield(L, 0);
 }
 
+/*
+ * trySend sends without yielding. The datagram is sent at once if the
+ * socket is writable and nothing is queued before it. Otherwise it is
+ * copied and queued with uv_udp_send. Errors are counted instead of raised.
+ */
+typedef struct couv_udp_try_send_s {
+  uv_udp_send_t req;
+  char data[1];
+} couv_udp_try_send_t;
+
+static void udp_try_send_cb(uv_udp_send_t *req, int status) {
+  couv_udp_handle_data_t *hdata;
+
+  hdata = couv_get_udp_handle_data(req->handle);
+  --hdata->send_pending;
+  if (status < 0)
+    ++hdata->try_failed;
+  else
+    ++hdata->try_sent;
+  couv_free(req->handle->data,
+      container_of(req, couv_udp_try_send_t, req));
+}
+
+static int udp_try_send(lua_State *L) {
+  uv_udp_t *handle;
+  couv_udp_handle_data_t *hdata;
+  struct sockaddr *addr;
+  struct sockaddr *src;
+  couv_udp_try_send_t *holder;
+  uv_buf_t *bufs;
+  uv_buf_t buf;
+  size_t bufcnt;
+  size_t len;
+  size_t i;
+  unsigned ifindex;
+  int r;
+#ifndef _WIN32
+  struct msghdr msg;
+#endif
+
+  handle = couvL_checkudataclass(L, 1, COUV_UDP_MTBL_NAME);
+  bufs = couv_checkbuforstrtable(L, 2, &bufcnt);
+  addr = couv_udp_check_dest(L, handle, 3);
+  src = couv_udp_check_src(L, 4, bufs);
+  ifindex = (unsigned)luaL_optnumber(L, 5, 0);
+  hdata = couv_get_udp_handle_data(handle);
+
+  if (hdata->pacer) {
+    len = couv_udp_bufs_len(bufs, bufcnt);
+    if (!couv_pacer_admit(hdata->pacer, len)) {
+      couv_udp_queue_paced(L, handle, bufs, bufcnt, len, addr, src, ifindex,
+          1);
+      ++hdata->try_queued;
+      return 0;
+    }
+  }
+
+#ifdef COUV_HAVE_UDP_PKTINFO
+  /* uv_udp_send cannot set the source, so it is sent now or dropped. */
+  if (src) {
+    if (couv_udp_send_from(handle, bufs, bufcnt,
+        addr == (struct sockaddr *)&hdata->peer ? NULL : addr, src,
+        ifindex) < 0)
+      ++hdata->try_failed;
+    else
+      ++hdata->try_sent;
+    couv_free(L, bufs);
+    return 0;
+  }
+#endif
+
+#ifndef _WIN32
+  if (couv_handle_fd(handle) != -1 && hdata->send_pending == 0) {
+    memset(&msg, 0, sizeof(msg));
+    if (addr != (struct sockaddr *)&hdata->peer) {
+      msg.msg_name = addr;
+      msg.msg_namelen = addr->sa_family == AF_INET6
+          ? sizeof(struct sockaddr_in6) : sizeof(struct sockaddr_in);
+    }
+    /* uv_buf_t has the same layout as struct iovec on unix. */
+    msg.msg_iov = (struct iovec *)bufs;
+    msg.msg_iovlen = bufcnt;
+    if (sendmsg(couv_handle_fd(handle), &msg, MSG_DONTWAIT) >= 0) {
+      ++hdata->try_sent;
+      couv_free(L, bufs);
+      return 0;
+    }
+    if (errno != EAGAIN && errno != EWOULDBLOCK && errno != ENOBUFS) {
+      ++hdata->try_failed;
+      couv_free(L, bufs);
+      return 0;
+    }
+  }
+#endif
+
+  len = couv_udp_bufs_len(bufs, bufcnt);
+  holder = couv_alloc(L, offsetof(couv_udp_try_send_t, data) + len);
+  len = 0;
+  for (i = 0; i < bufcnt; ++i) {
+    memcpy(holder->data + len, bufs[i].base, bufs[i].len);
+    len += bufs[i].len;
+  }
+  couv_free(L, bufs);
+  buf = uv_buf_init(holder->data, len);
+  if (addr->sa_family == AF_INET6) {
+    r = uv_udp_send6(&holder->req, handle, &buf, 1,
+        *(struct sockaddr_in6 *)addr, udp_try_send_cb);
+  } else {
+    r = uv_udp_send(&holder->req, handle, &buf, 1,
+        *(struct sockaddr_in *)addr, udp_try_send_cb);
+  }
+  if (r < 0) {
+    couv_free(L, holder);
+    ++hdata->try_failed;
+    return 0;
+  }
+  ++hdata->try_queued;
+  ++hdata->send_pending;
+  return 0;
+}
+
+static int udp_get_send_stats(lua_State *L) {
+  uv_udp_t *handle;
+  couv_udp_handle_data_t *hdata;
+
+  handle = couvL_checkudataclass(L, 1, COUV_UDP_MTBL_NAME);
+  hdata = couv_get_udp_handle_data(handle);
+  lua_createtable(L, 0, 4);
+  couvL_SET_FIELD(L, sent, number, hdata->try_sent);
+  couvL_SET_FIELD(L, queued, number, hdata->try_queued);
+  couvL_SET_FIELD(L, failed, number, hdata->try_failed);
+  couvL_SET_FIELD(L, pending, number, hdata->send_pending);
+  return 1;
+}
+
+/*
+ * sendBatch sends datagrams with sendmmsg while the socket is writable, and
+ * queues the rest with uv_udp_send. The status array has true or the error
+ * name for each datagram. With pacing, the batch waits until all its bytes
+ * are released, and couv.lua calls _sendBatch again.
+ */
+typedef struct couv_udp_send_batch_s {
+  lua_State *L;
+  int pending;
+  uv_buf_t *bufs;
+  void **mems;
+} couv_udp_send_batch_t;
+
+typedef struct couv_udp_batch_send_s {
+  uv_udp_send_t req;
+  couv_udp_send_batch_t *batch;
+  int index;
+} couv_udp_batch_send_t;
+
+static void udp_batch_send_cb(uv_udp_send_t *req, int status) {
+  couv_udp_batch_send_t *holder;
+  couv_udp_send_batch_t *batch;
+  lua_State *L;
+
+  holder = container_of(req, couv_udp_batch_send_t, req);
+  batch = holder->batch;
+  L = batch->L;
+  --couv_get_udp_handle_data(req->handle)->send_pending;
+
+  couv_rawgetp(L, LUA_REGISTRYINDEX, batch);
+  if (status < 0)
+    lua_pushstring(L, couvL_uv_lasterrname(req->handle->loop));
+  else
+    lua_pushboolean(L, 1);
+  lua_rawseti(L, -2, holder->index + 1);
+  couv_free(L, holder);
+
+  if (--batch->pending > 0) {
+    lua_pop(L, 1);
+    return;
+  }
+  lua_pushnil(L);
+  couv_rawsetp(L, LUA_REGISTRYINDEX, batch);
+  lua_pushnil(L);
+  couv_rawsetp(L, LUA_REGISTRYINDEX, COUV_THREAD_REG_KEY(batch));
+  couv_release_buf_mems(L, batch->mems);
+  couv_free(L, batch->bufs);
+  couv_free(L, batch);
+  couv_resume(L, L, 1);
+}
+
+#ifdef COUV_HAVE_UDP_RECV_BATCH
+static int couv_udp_sendmmsg(uv_os_sock_t fd, struct mmsghdr *msgs, int n) {
+#ifdef __linux__
+  return sendmmsg(fd, msgs, n, MSG_DONTWAIT);
+#else
+  ssize_t r;
+  int i;
+
+  for (i = 0; i < n; ++i) {
+    r = sendmsg(fd, &msgs[i].msg_hdr, MSG_DONTWAIT);
+    if (r < 0)
+      return i > 0 ? i : -1;
+    msgs[i].msg_len = r;
+  }
+  return n;
+#endif
+}
+
+/*
+ * Sends as many datagrams from i to n - 1 as possible without blocking, and
+ * sets their statuses to the table at status_index. Returns the index of
+ * the first datagram not sent.
+ */
+static int couv_udp_send_now(lua_State *L, uv_udp_t *handle,
+    struct sockaddr **addrs, uv_buf_t *bufs, int *offsets, int i, int n,
+    int status_index) {
+  struct mmsghdr *msgs;
+  struct msghdr *hdr;
+  int first;
+  int j;
+  int r;
+
+  first = i;
+  msgs = couv_alloc(L, (n - first) * sizeof(struct mmsghdr));
+  for (j = first; j < n; ++j) {
+    hdr = &msgs[j - first].msg_hdr;
+    memset(hdr, 0, sizeof(struct msghdr));
+    hdr->msg_name = addrs[j];
+    hdr->msg_namelen = addrs[j]->sa_family == AF_INET6
+        ? sizeof(struct sockaddr_in6) : sizeof(struct sockaddr_in);
+    /* uv_buf_t has the same layout as struct iovec on unix. */
+    hdr->msg_iov = (struct iovec *)&bufs[offsets[j]];
+    hdr->msg_iovlen = offsets[j + 1] - offsets[j];
+  }
+
+  while (i < n) {
+    r = couv_udp_sendmmsg(couv_handle_fd(handle), msgs + (i - first), n - i);
+    if (r > 0) {
+      for (; r > 0; --r, ++i) {
+        lua_pushboolean(L, 1);
+        lua_rawseti(L, status_index, i + 1);
+      }
+    } else if (errno == EAGAIN || errno == EWOULDBLOCK || errno == ENOBUFS)
+      break;
+    else {
+      lua_pushstring(L, couvL_sys_errname(errno));
+      lua_rawseti(L, status_index, ++i);
+    }
+  }
+  couv_free(L, msgs);
+  return i;
+}
+#endif
+
+/*
+ * Sends the datagrams from i to n - 1 with uv_udp_send, and yields until
+ * they are sent. The arrays are freed, and mems, the retained Buffers which
+ * bufs point into, are released. The status table at status_index must be
+ * at the stack top, it is returned if nothing was queued.
+ */
+static int couv_udp_queue_sends(lua_State *L, uv_udp_t *handle,
+    struct sockaddr **addrs, uv_buf_t *bufs, void **mems, int *offsets,
+    int i, int n, int status_index) {
+  couv_udp_handle_data_t *hdata;
+  couv_udp_send_batch_t *batch;
+  couv_udp_batch_send_t *holder;
+  int cnt;
+  int r;
+
+  hdata = couv_get_udp_handle_data(handle);
+  batch = NULL;
+  for (; i < n; ++i) {
+    if (!batch) {
+      batch = couv_alloc(L, sizeof(couv_udp_send_batch_t));
+      batch->L = L;
+      batch->pending = 0;
+      batch->bufs = bufs;
+      batch->mems = mems;
+    }
+    holder = couv_alloc(L, sizeof(couv_udp_batch_send_t));
+    holder->batch = batch;
+    holder->index = i;
+    cnt = offsets[i + 1] - offsets[i];
+    if (addrs[i]->sa_family == AF_INET6) {
+      r = uv_udp_send6(&holder->req, handle, &bufs[offsets[i]], cnt,
+          *(struct sockaddr_in6 *)addrs[i], udp_batch_send_cb);
+    } else {
+      r = uv_udp_send(&holder->req, handle, &bufs[offsets[i]], cnt,
+          *(struct sockaddr_in *)addrs[i], udp_batch_send_cb);
+    }
+    if (r < 0) {
+      couv_free(L, holder);
+      lua_pushstring(L, couvL_uv_lasterrname(couv_loop(L)));
+      lua_rawseti(L, status_index, i + 1);
+    } else {
+      ++batch->pending;
+      ++hdata->send_pending;
+    }
+  }
+  couv_free(L, offsets);
+  couv_free(L, addrs);
+
+  if (!batch || batch->pending == 0) {
+    couv_release_buf_mems(L, mems);
+    couv_free(L, bufs);
+    couv_free(L, batch);
+    return 1;
+  }
+  lua_pushvalue(L, status_index);
+  couv_rawsetp(L, LUA_REGISTRYINDEX, batch);
+  lua_pushthread(L);
+  couv_rawsetp(L, LUA_REGISTRYINDEX, COUV_THREAD_REG_KEY(batch));
+  return lua_yield(L, 0);
+}
+
+static int udp_send_batch(lua_State *L) {
+  uv_udp_t *handle;
+  couv_udp_handle_data_t *hdata;
+  struct sockaddr **addrs;
+  uv_buf_t *bufs;
+  void **mems;
+  size_t memcnt;
+  int *offsets;
+  int n;
+  int i;
+  int j;
+  int cnt;
+
+  handle = couvL_checkudataclass(L, 1, COUV_UDP_MTBL_NAME);
+  hdata = couv_get_udp_handle_data(handle);
+  luaL_checktype(L, 2, LUA_TTABLE);
+  lua_settop(L, 2);
+  n = couv_rawlen(L, 2);
+
+  offsets = couv_alloc(L, (n + 1) * sizeof(int));
+  offsets[0] = 0;
+  for (i = 0; i < n; ++i) {
+    lua_rawgeti(L, 2, i + 1);
+    if (lua_istable(L, -1))
+      lua_rawgeti(L, -1, 1);
+    else
+      lua_pushnil(L);
+    cnt = lua_istable(L, -1) ? (int)couv_rawlen(L, -1) : 1;
+    lua_pop(L, 2);
+    offsets[i + 1] = offsets[i] + cnt;
+  }
+
+  bufs = couv_alloc(L, offsets[n] * sizeof(uv_buf_t) + 1);
+  addrs = couv_alloc(L, n * sizeof(struct sockaddr *) + 1);
+  mems = couv_alloc(L, (offsets[n] + 1) * sizeof(void *));
+  memcnt = 0;
+  for (i = 0; i < n; ++i) {
+    lua_rawgeti(L, 2, i + 1);
+    if (!lua_istable(L, -1)) {
+      lua_newtable(L);
+      lua_replace(L, -2);
+    }
+    lua_rawgeti(L, -1, 2);
+    if (lua_isnil(L, -1) && hdata->connected)
+      addrs[i] = (struct sockaddr *)&hdata->peer;
+    else
+      addrs[i] = couvL_testudataclass(L, -1, COUV_SOCK_ADDR_MTBL_NAME);
+    lua_pop(L, 1);
+    lua_rawgeti(L, -1, 1);
+    for (j = offsets[i]; j < offsets[i + 1]; ++j) {
+      if (lua_istable(L, -1)) {
+        lua_rawgeti(L, -1, j - offsets[i] + 1);
+        bufs[j] = couv_tobuforstr(L, -1);
+        memcnt = couv_retain_buf_mem(L, -1, mems, memcnt);
+        lua_pop(L, 1);
+      } else {
+        bufs[j] = couv_tobuforstr(L, -1);
+        memcnt = couv_retain_buf_mem(L, -1, mems, memcnt);
+      }
+      if (!bufs[j].base)
+        addrs[i] = NULL;
+    }
+    lua_pop(L, 2);
+    mems[memcnt] = NULL;
+    if (!addrs[i]) {
+      couv_release_buf_mems(L, mems);
+      couv_free(L, offsets);
+      couv_free(L, bufs);
+      couv_free(L, addrs);
+      return luaL_argerror(L, 2,
+          "must be an array of {bufs, addr} with bufs of strings or Buffers"
+          " and addr omitted only when connected");
+    }
+  }
+
+  if (hdata->pacer && !couv_pacer_admit_or_wait(L, hdata->pacer,
+      couv_udp_bufs_len(bufs, offsets[n]))) {
+    couv_release_buf_mems(L, mems);
+    couv_free(L, offsets);
+    couv_free(L, bufs);
+    couv_free(L, addrs);
+    return lua_yield(L, 0);
+  }
+
+  lua_createtable(L, n, 0);
+  i = 0;
+#ifdef COUV_HAVE_UDP_RECV_BATCH
+  /* don't overtake the sends queued in libuv. */
+  if (n > 0 && couv_handle_fd(handle) != -1 && hdata->send_pending == 0)
+    i = couv_udp_send_now(L, handle, addrs, bufs, offsets, 0, n, 3);
+#endif
+  return couv_udp_queue_sends(L, handle, addrs, bufs, mems, offsets, i, n,
+      3);
+}
+
+#ifdef COUV_HAVE_UDP_GSO
+/*
+ * Sends the segments with UDP_SEGMENT while the socket is writable, up to
+ * COUV_UDP_MAX_SEGMENTS of them in one sendmsg. Returns the index of the
+ * first segment not sent, which is less than nseg also when the kernel or
+ * the device doesn't support segmentation offload.
+ */
+static int couv_udp_send_gso(lua_State *L, uv_udp_t *handle, uv_buf_t buf,
+    struct sockaddr *addr, size_t seg_size, int nseg, int status_index) {
+  struct msghdr msg;
+  struct iovec iov;
+  struct cmsghdr *cmsg;
+  union {
+    char buf[CMSG_SPACE(sizeof(uint16_t))];
+    struct cmsghdr align;
+  } control;
+  const char *err;
+  size_t offset;
+  int max_chunk;
+  int chunk;
+  int i;
+  int j;
+
+  max_chunk = (int)(COUV_UDP_MAX_DATAGRAM_SIZE / seg_size);
+  if (max_chunk > COUV_UDP_MAX_SEGMENTS)
+    max_chunk = COUV_UDP_MAX_SEGMENTS;
+
+  i = 0;
+  while (i < nseg) {
+    chunk = nseg - i < max_chunk ? nseg - i : max_chunk;
+    offset = i * seg_size;
+    iov.iov_base = buf.base + offset;
+    iov.iov_len = buf.len - offset < chunk * seg_size
+        ? buf.len - offset : chunk * seg_size;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_name = addr;
+    msg.msg_namelen = addr->sa_family == AF_INET6
+        ? sizeof(struct sockaddr_in6) : sizeof(struct sockaddr_in);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    if (chunk > 1) {
+      msg.msg_control = control.buf;
+      msg.msg_controllen = sizeof(control.buf);
+      cmsg = CMSG_FIRSTHDR(&msg);
+      cmsg->cmsg_level = SOL_UDP;
+      cmsg->cmsg_type = UDP_SEGMENT;
+      cmsg->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+      *(uint16_t *)CMSG_DATA(cmsg) = (uint16_t)seg_size;
+    }
+
+    if (sendmsg(couv_handle_fd(handle), &msg, MSG_DONTWAIT) < 0) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK || errno == ENOBUFS)
+        break;
+      /* let the segments be sent one by one, which reports real errors. */
+      if (chunk > 1 && (errno == EINVAL || errno == EIO
+          || errno == ENOPROTOOPT || errno == EOPNOTSUPP))
+        break;
+      err = couvL_sys_errname(errno);
+      for (j = 0; j < chunk; ++j) {
+        lua_pushstring(L, err);
+        lua_rawseti(L, status_index, i + j + 1);
+      }
+    } else {
+      for (j = 0; j < chunk; ++j) {
+        lua_pushboolean(L, 1);
+        lua_rawseti(L, status_index, i + j + 1);
+      }
+    }
+    i += chunk;
+  }
+  return i;
+}
+#endif
+
+/*
+ * Sends a string or Buffer as datagrams of segSize bytes, the last of which
+ * may be shorter. With UDP_SEGMENT the kernel splits the datagrams, so up
+ * to 64 of them are sent in one syscall. Otherwise they are sent as in
+ * sendBatch. Returns the status array of the datagrams.
+ */
+static int udp_send_segmented(lua_State *L) {
+  uv_udp_t *handle;
+  couv_pacer_t *pacer;
+  uv_buf_t buf;
+  struct sockaddr *addr;
+  struct sockaddr **addrs;
+  uv_buf_t *bufs;
+  void **mems;
+  int *offsets;
+  size_t seg_size;
+  int seg;
+  int nseg;
+  int i;
+  int j;
+
+  handle = couvL_checkudataclass(L, 1, COUV_UDP_MTBL_NAME);
+  buf = couv_checkbuforstr(L, 2);
+  addr = couv_udp_check_dest(L, handle, 3);
+  seg = luaL_checkint(L, 4);
+  luaL_argcheck(L, 0 < seg && seg <= COUV_UDP_MAX_DATAGRAM_SIZE, 4,
+      "must be 1 <= segSize <= 65507");
+  seg_size = seg;
+  lua_settop(L, 4);
+  pacer = couv_get_udp_handle_data(handle)->pacer;
+  if (pacer && !couv_pacer_admit_or_wait(L, pacer, buf.len))
+    return lua_yield(L, 0);
+  nseg = buf.len == 0 ? 1 : (int)((buf.len + seg_size - 1) / seg_size);
+  lua_createtable(L, nseg, 0);
+
+  i = 0;
+#ifdef COUV_HAVE_UDP_GSO
+  if (couv_handle_fd(handle) != -1
+      && couv_get_udp_handle_data(handle)->send_pending == 0) {
+    i = couv_udp_send_gso(L, handle, buf, addr, seg_size, nseg, 5);
+    if (i == nseg)
+      return 1;
+  }
+#endif
+
+  bufs = couv_alloc(L, nseg * sizeof(uv_buf_t));
+  addrs = couv_alloc(L, nseg * sizeof(struct sockaddr *));
+  offsets = couv_alloc(L, (nseg + 1) * sizeof(int));
+  mems = couv_alloc(L, 2 * sizeof(void *));
+  mems[couv_retain_buf_mem(L, 2, mems, 0)] = NULL;
+  for (j = 0; j < nseg; ++j) {
+    bufs[j] = uv_buf_init(buf.base + j * seg_size, j < nseg - 1
+        ? seg_size : buf.len - j * seg_size);
+    addrs[j] = addr;
+    offsets[j] = j;
+  }
+  offsets[nseg] = nseg;
+#ifdef COUV_HAVE_UDP_RECV_BATCH
+  if (i < nseg && couv_handle_fd(handle) != -1
+      && couv_get_udp_handle_data(handle)->send_pending == 0)
+    i = couv_udp_send_now(L, handle, addrs, bufs, offsets, i, nseg, 5);
+#endif
+  return couv_udp_queue_sends(L, handle, addrs, bufs, mems, offsets, i,
+      nseg, 5);
+}
+
+/* Resume only a coroutine waiting in _recv, not one waiting in _send. */
+static void couv_udp_resume_receiver(uv_udp_t *handle,
+    couv_udp_handle_data_t *hdata) {
+  lua_State *L;
+
+  L = couv_take_input_waiter((uv_handle_t *)handle, &hdata->recv_waiter);
+  if (L)
+    couv_resume(L, L, 0);
+}
+
 static void udp_recv_cb(uv_udp_t *handle, ssize_t nread, uv_buf_t buf,
     struct sockaddr* addr, unsigned flags) {
   lua_State *L;
   couv_udp_input_t *input;
   couv_udp_handle_data_t *hdata;
+  couv_udp_ring_t *ring;
 
   L = handle->data;
 
+  /* nothing was read. */
+  if (nread == 0 && !addr) {
+    if (buf.base)
+      couv_buf_mem_release(L, buf.base);
+    return;
+  }
+
   input = couv_alloc(L, sizeof(couv_udp_input_t));
   if (!input)
     return;
@@ -165,33 +1346,84 @@ static void udp_recv_cb(uv_udp_t *handle, ssize_t nread, uv_buf_t buf,
   input->nread = nread;
   input->w_buf.orig = buf.base;
   input->w_buf.buf = buf;
-  if (addr)
+  input->segment_size = 0;
+  input->timestamp_sec = 0;
+  input->timestamp_nsec = 0;
+  input->dst.sa.sa_family = AF_UNSPEC;
+  input->truncated = (flags & UV_UDP_PARTIAL) != 0;
+  input->drops = -1;
+  /* e.g. ECONNREFUSED for an ICMP error on a connected socket. */
+  input->err_name = nread < 0 ? couvL_uv_lasterrname(handle->loop) : NULL;
+  input->block = NULL;
+  if (addr && addr->sa_family == AF_INET6)
+    input->addr.v6 = *(struct sockaddr_in6 *)addr;
+  else if (addr)
     input->addr.v4 = *(struct sockaddr_in *)addr;
+  else
+    input->addr.storage.ss_family = AF_UNSPEC;
 
   hdata = couv_get_udp_handle_data(handle);
+  if (input->truncated)
+    ++hdata->recv_truncated;
   ngx_queue_insert_tail(&hdata->input_queue, (ngx_queue_t *)input);
 
-  if (lua_status(L) == LUA_YIELD)
-    couv_resume(L, L, 0);
+  ring = hdata->ring;
+  if (ring && ring->nfree == 0) {
+    uv_udp_recv_stop(handle);
+    ring->paused = COUV_UDP_RING_PAUSED_UV;
+    ++ring->exhausted;
+  }
+
+  couv_udp_resume_receiver(handle, hdata);
 }
 
+/*
+ * libuv doesn't pass ancillary data, so once GRO, drops, timestamps or
+ * pktinfo are turned on, startRecv receives as startRecvBatch(1) does:
+ * into the slots of the ring if one is set, else into 64KB for GRO or
+ * slots of the startRecvBatch default size, which truncate longer
+ * datagrams.
+ */
 static int udp_recv_start(lua_State *L) {
   uv_udp_t *handle;
+  couv_udp_handle_data_t *hdata;
   int r;
 
   handle = couvL_checkudataclass(L, 1, COUV_UDP_MTBL_NAME);
-  r = uv_udp_recv_start(handle, couv_buf_alloc_cb, udp_recv_cb);
+  hdata = couv_get_udp_handle_data(handle);
+#ifdef COUV_HAVE_UDP_RECV_BATCH
+  if (hdata->recv_flags) {
+    return couv_udp_start_recv_batch(L, handle, 1,
+        COUV_UDP_RECV_BATCH_DEFAULT_SLOT_SIZE);
+  }
+#endif
+  if (hdata->ring) {
+    /* it restarts by itself when a slot comes back. */
+    if (hdata->ring->paused)
+      return 0;
+    r = uv_udp_recv_start(handle, couv_udp_ring_alloc_cb, udp_recv_cb);
+  } else
+    r = uv_udp_recv_start(handle, couv_buf_alloc_cb, udp_recv_cb);
   if (r < 0) {
     return luaL_error(L, couvL_uv_lasterrname(couv_loop(L)));
   }
+  couv_udp_apply_sockopts(L, handle);
   return 0;
 }
 
 static int udp_recv_stop(lua_State *L) {
   uv_udp_t *handle;
+  couv_udp_handle_data_t *hdata;
   int r;
 
   handle = couvL_checkudataclass(L, 1, COUV_UDP_MTBL_NAME);
+  hdata = couv_get_udp_handle_data(handle);
+  if (hdata->ring)
+    hdata->ring->paused = 0;
+#ifdef COUV_HAVE_UDP_RECV_BATCH
+  if (hdata->recv_batch)
+    uv_poll_stop(&hdata->recv_batch->poll);
+#endif
   r = uv_udp_recv_stop(handle);
   if (r < 0) {
     return luaL_error(L, couvL_uv_lasterrname(couv_loop(L)));
@@ -199,33 +1431,636 @@ static int udp_recv_stop(lua_State *L) {
   return 0;
 }
 
+static void couv_udp_push_input_buf(lua_State *L, couv_udp_input_t *input) {
+  couv_buf_t *w_buf;
+
+  w_buf = lua_newuserdata(L, sizeof(couv_buf_t));
+  luaL_getmetatable(L, COUV_BUFFER_MTBL_NAME);
+  lua_setmetatable(L, -2);
+  *w_buf = input->w_buf;
+}
+
+/* pushes the family, port and address (and scope id) as a string. */
+static void couv_udp_push_addr_key(lua_State *L, couv_udp_input_t *input) {
+  char key[1 + sizeof(unsigned short) + sizeof(struct in6_addr)
+      + sizeof(uint32_t)];
+  size_t len;
+
+  if (input->addr.storage.ss_family == AF_INET6) {
+    key[0] = 6;
+    len = 1;
+    memcpy(key + len, &input->addr.v6.sin6_port, sizeof(unsigned short));
+    len += sizeof(unsigned short);
+    memcpy(key + len, &input->addr.v6.sin6_addr, sizeof(struct in6_addr));
+    len += sizeof(struct in6_addr);
+    memcpy(key + len, &input->addr.v6.sin6_scope_id, sizeof(uint32_t));
+    len += sizeof(uint32_t);
+  } else {
+    key[0] = 4;
+    len = 1;
+    memcpy(key + len, &input->addr.v4.sin_port, sizeof(unsigned short));
+    len += sizeof(unsigned short);
+    memcpy(key + len, &input->addr.v4.sin_addr, sizeof(struct in_addr));
+    len += sizeof(struct in_addr);
+  }
+  lua_pushlstring(L, key, len);
+}
+
+/*
+ * Pushes the source address of the input. With the address cache, the
+ * SockAddr of a repeat peer is the same object. The cache is emptied when
+ * it is full.
+ */
+static void couv_udp_push_input_addr(lua_State *L, uv_udp_t *handle,
+    couv_udp_input_t *input) {
+  couv_udp_handle_data_t *hdata;
+
+  if (input->addr.storage.ss_family == AF_UNSPEC) {
+    lua_pushnil(L);
+    return;
+  }
+  hdata = couv_get_udp_handle_data(handle);
+  if (hdata->addr_cache_max == 0) {
+    couvL_pushsockaddr(L, (struct sockaddr *)&input->addr.storage);
+    return;
+  }
+
+  couv_rawgetp(L, LUA_REGISTRYINDEX, COUV_ADDR_CACHE_REG_KEY(handle));
+  couv_udp_push_addr_key(L, input);
+  lua_pushvalue(L, -1);
+  lua_rawget(L, -3);
+  if (lua_isnil(L, -1)) {
+    lua_pop(L, 1);
+    if (hdata->addr_cache_size >= hdata->addr_cache_max) {
+      lua_newtable(L);
+      lua_pushvalue(L, -1);
+      couv_rawsetp(L, LUA_REGISTRYINDEX, COUV_ADDR_CACHE_REG_KEY(handle));
+      lua_replace(L, -3);
+      hdata->addr_cache_size = 0;
+    }
+    couvL_pushsockaddr(L, (struct sockaddr *)&input->addr.storage);
+    lua_pushvalue(L, -2);
+    lua_pushvalue(L, -2);
+    lua_rawset(L, -5);
+    ++hdata->addr_cache_size;
+  }
+  lua_replace(L, -3);
+  lua_pop(L, 1);
+}
+
+#ifdef COUV_HAVE_UDP_RECV_BATCH
+/* returns the nsecs from the kernel receive time of the input to now. */
+static double couv_udp_input_delay(couv_udp_input_t *input) {
+#ifdef __linux__
+  struct timespec now;
+
+  clock_gettime(CLOCK_REALTIME, &now);
+  return (double)(now.tv_sec - input->timestamp_sec) * 1e9
+      + (double)(now.tv_nsec - input->timestamp_nsec);
+#else
+  struct timeval now;
+
+  gettimeofday(&now, NULL);
+  return (double)(now.tv_sec - input->timestamp_sec) * 1e9
+      + (double)(now.tv_usec * 1000 - input->timestamp_nsec);
+#endif
+}
+#endif
+
+/*
+ * Sets the ancillary data of the input to the table at the stack top.
+ * truncated is set if the datagram did not fit in the buffer. drops is the
+ * count of datagrams the kernel dropped so far, after setRecvDrops.
+ * dstAddr is the local address the datagram was sent to, with port 0.
+ * timestamp is in seconds since the epoch, delay is in nanoseconds.
+ */
+static void couv_udp_set_input_info(lua_State *L, couv_udp_input_t *input) {
+  if (input->segment_size > 0)
+    lua_pushnumber(L, input->segment_size);
+  else
+    lua_pushnil(L);
+  lua_setfield(L, -2, "segmentSize");
+
+  lua_pushboolean(L, input->truncated);
+  lua_setfield(L, -2, "truncated");
+
+  if (input->drops >= 0)
+    lua_pushnumber(L, input->drops);
+  else
+    lua_pushnil(L);
+  lua_setfield(L, -2, "drops");
+
+  if (input->dst.sa.sa_family != AF_UNSPEC) {
+    couvL_pushsockaddr(L, &input->dst.sa);
+    lua_setfield(L, -2, "dstAddr");
+    lua_pushnumber(L, input->ifindex);
+  } else {
+    lua_pushnil(L);
+    lua_setfield(L, -2, "dstAddr");
+    lua_pushnil(L);
+  }
+  lua_setfield(L, -2, "ifindex");
+
+#ifdef COUV_HAVE_UDP_RECV_BATCH
+  if (input->timestamp_sec || input->timestamp_nsec) {
+    lua_pushnumber(L, input->timestamp_sec + input->timestamp_nsec / 1e9);
+    lua_setfield(L, -2, "timestamp");
+    lua_pushnumber(L, couv_udp_input_delay(input));
+    lua_setfield(L, -2, "delay");
+    return;
+  }
+#endif
+  lua_pushnil(L);
+  lua_setfield(L, -2, "timestamp");
+  lua_pushnil(L);
+  lua_setfield(L, -2, "delay");
+}
+
+/*
+ * Returns nread, buf and addr. When ancillary data is enabled, the info
+ * table is returned too. It is reused by the next call. Returns false and
+ * the error name if receiving failed.
+ */
 static int udp_prim_recv(lua_State *L) {
   uv_udp_t *handle;
   couv_udp_input_t *input;
-  couv_buf_t *w_buf;
-  struct sockaddr_in *ip4addr;
   couv_udp_handle_data_t *hdata;
 
   handle = couvL_checkudataclass(L, 1, COUV_UDP_MTBL_NAME);
   hdata = couv_get_udp_handle_data(handle);
-  if (ngx_queue_empty(&hdata->input_queue))
+  if (ngx_queue_empty(&hdata->input_queue)) {
+    if (hdata->recv_waiter)
+      return luaL_error(L, "EBUSY");
+    couv_set_input_waiter(L, (uv_handle_t *)handle, &hdata->recv_waiter);
     return lua_yield(L, 0);
+  }
   input = (couv_udp_input_t *)ngx_queue_head(&hdata->input_queue);
   ngx_queue_remove(input);
 
+  if (input->err_name) {
+    lua_pushboolean(L, 0);
+    lua_pushstring(L, input->err_name);
+    if (input->w_buf.orig)
+      couv_buf_mem_release(L, input->w_buf.orig);
+    couv_udp_free_input(L, input);
+    return 2;
+  }
+
   lua_pushnumber(L, input->nread);
+  couv_udp_push_input_buf(L, input);
+  couv_udp_push_input_addr(L, handle, input);
+  if (!hdata->recv_flags) {
+    couv_udp_free_input(L, input);
+    return 3;
+  }
 
-  w_buf = lua_newuserdata(L, sizeof(couv_buf_t));
-  luaL_getmetatable(L, COUV_BUFFER_MTBL_NAME);
-  lua_setmetatable(L, -2);
-  *w_buf = input->w_buf;
+  couv_rawgetp(L, LUA_REGISTRYINDEX, COUV_RECV_INFO_REG_KEY(handle));
+  if (!lua_istable(L, -1)) {
+    lua_pop(L, 1);
+    lua_newtable(L);
+    lua_pushvalue(L, -1);
+    couv_rawsetp(L, LUA_REGISTRYINDEX, COUV_RECV_INFO_REG_KEY(handle));
+  }
+  couv_udp_set_input_info(L, input);
+  couv_udp_free_input(L, input);
+  return 4;
+}
 
-  ip4addr = lua_newuserdata(L, sizeof(struct sockaddr_in));
-  luaL_getmetatable(L, COUV_SOCK_ADDR_V4_MTBL_NAME);
-  lua_setmetatable(L, -2);
-  *ip4addr = input->addr.v4;
+/*
+ * Returns all the received datagrams as an array of {nread, buf, addr}
+ * entries and the count of them. The fields of the info table of _recv are
+ * set to the entries too. If the array is passed, its entry tables are
+ * reused and the entries after the count are left as they are.
+ */
+static int udp_prim_recv_batch(lua_State *L) {
+  uv_udp_t *handle;
+  couv_udp_input_t *input;
+  couv_udp_handle_data_t *hdata;
+  int n;
+
+  handle = couvL_checkudataclass(L, 1, COUV_UDP_MTBL_NAME);
+  hdata = couv_get_udp_handle_data(handle);
+  if (ngx_queue_empty(&hdata->input_queue)) {
+    if (hdata->recv_waiter)
+      return luaL_error(L, "EBUSY");
+    couv_set_input_waiter(L, (uv_handle_t *)handle, &hdata->recv_waiter);
+    return lua_yield(L, 0);
+  }
+
+  if (lua_istable(L, 2))
+    lua_settop(L, 2);
+  else {
+    luaL_argcheck(L, lua_isnoneornil(L, 2), 2, "must be table or nil");
+    lua_settop(L, 1);
+    lua_newtable(L);
+  }
+
+  for (n = 1; !ngx_queue_empty(&hdata->input_queue); ++n) {
+    input = (couv_udp_input_t *)ngx_queue_head(&hdata->input_queue);
+    ngx_queue_remove(input);
+
+    lua_rawgeti(L, 2, n);
+    if (!lua_istable(L, -1)) {
+      lua_pop(L, 1);
+      lua_createtable(L, 0, 3);
+      lua_pushvalue(L, -1);
+      lua_rawseti(L, 2, n);
+    }
+    couvL_SET_FIELD(L, nread, number, input->nread);
+    if (input->err_name)
+      lua_pushstring(L, input->err_name);
+    else
+      lua_pushnil(L);
+    lua_setfield(L, -2, "err");
+    couv_udp_push_input_buf(L, input);
+    lua_setfield(L, -2, "buf");
+    couv_udp_push_input_addr(L, handle, input);
+    lua_setfield(L, -2, "addr");
+    if (hdata->recv_flags)
+      couv_udp_set_input_info(L, input);
+    lua_pop(L, 1);
+
+    couv_udp_free_input(L, input);
+  }
+  lua_pushnumber(L, n - 1);
+  return 2;
+}
+
+#ifdef COUV_HAVE_UDP_RECV_BATCH
+static int couv_udp_recvmmsg(uv_os_sock_t fd, struct mmsghdr *msgs, int n) {
+#ifdef __linux__
+  return recvmmsg(fd, msgs, n, MSG_DONTWAIT, NULL);
+#else
+  ssize_t r;
+  int i;
+
+  for (i = 0; i < n; ++i) {
+    r = recvmsg(fd, &msgs[i].msg_hdr, MSG_DONTWAIT);
+    if (r < 0)
+      return i > 0 ? i : -1;
+    msgs[i].msg_len = r;
+  }
+  return n;
+#endif
+}
+
+/* queues a failed receive, e.g. an ICMP error on a connected socket. */
+static void couv_udp_queue_error(lua_State *L, couv_udp_handle_data_t *hdata,
+    const char *err_name) {
+  couv_udp_input_t *input;
+
+  input = couv_alloc(L, sizeof(couv_udp_input_t));
+  input->nread = -1;
+  input->w_buf.orig = NULL;
+  input->w_buf.buf = uv_buf_init(NULL, 0);
+  input->addr.storage.ss_family = AF_UNSPEC;
+  input->segment_size = 0;
+  input->timestamp_sec = 0;
+  input->timestamp_nsec = 0;
+  input->dst.sa.sa_family = AF_UNSPEC;
+  input->truncated = 0;
+  input->drops = -1;
+  input->err_name = err_name;
+  input->block = NULL;
+  ngx_queue_insert_tail(&hdata->input_queue, (ngx_queue_t *)input);
+}
+
+/* reads the ancillary data of a received datagram. */
+static void couv_udp_parse_control(struct msghdr *hdr,
+    couv_udp_input_t *input) {
+  struct cmsghdr *cmsg;
+#ifdef COUV_HAVE_UDP_GSO
+  int value;
+#endif
+#ifdef SCM_TIMESTAMPNS
+  struct timespec ts;
+#elif defined(SCM_TIMESTAMP)
+  struct timeval tv;
+#endif
+#ifdef COUV_HAVE_UDP_PKTINFO
+  struct in_pktinfo pi;
+  struct in6_pktinfo pi6;
+#endif
+#ifdef SO_RXQ_OVFL
+  uint32_t drops;
+#endif
+
+  for (cmsg = CMSG_FIRSTHDR(hdr); cmsg; cmsg = CMSG_NXTHDR(hdr, cmsg)) {
+#ifdef COUV_HAVE_UDP_GSO
+    if (cmsg->cmsg_level == SOL_UDP && cmsg->cmsg_type == UDP_GRO) {
+      memcpy(&value, CMSG_DATA(cmsg), sizeof(int));
+      input->segment_size = value;
+    }
+#endif
+#ifdef SCM_TIMESTAMPNS
+    if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_TIMESTAMPNS) {
+      memcpy(&ts, CMSG_DATA(cmsg), sizeof(ts));
+      input->timestamp_sec = ts.tv_sec;
+      input->timestamp_nsec = ts.tv_nsec;
+    }
+#elif defined(SCM_TIMESTAMP)
+    if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_TIMESTAMP) {
+      memcpy(&tv, CMSG_DATA(cmsg), sizeof(tv));
+      input->timestamp_sec = tv.tv_sec;
+      input->timestamp_nsec = tv.tv_usec * 1000;
+    }
+#endif
+#ifdef COUV_HAVE_UDP_PKTINFO
+    if (cmsg->cmsg_level == IPPROTO_IP && cmsg->cmsg_type == IP_PKTINFO) {
+      memcpy(&pi, CMSG_DATA(cmsg), sizeof(pi));
+      memset(&input->dst.v4, 0, sizeof(struct sockaddr_in));
+      input->dst.v4.sin_family = AF_INET;
+      input->dst.v4.sin_addr = pi.ipi_addr;
+      input->ifindex = pi.ipi_ifindex;
+    } else if (cmsg->cmsg_level == IPPROTO_IPV6
+        && cmsg->cmsg_type == IPV6_PKTINFO) {
+      memcpy(&pi6, CMSG_DATA(cmsg), sizeof(pi6));
+      memset(&input->dst.v6, 0, sizeof(struct sockaddr_in6));
+      input->dst.v6.sin6_family = AF_INET6;
+      input->dst.v6.sin6_addr = pi6.ipi6_addr;
+      if (IN6_IS_ADDR_LINKLOCAL(&pi6.ipi6_addr))
+        input->dst.v6.sin6_scope_id = pi6.ipi6_ifindex;
+      input->ifindex = pi6.ipi6_ifindex;
+    }
+#endif
+#ifdef SO_RXQ_OVFL
+    /* sent only when the count is not 0. */
+    if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SO_RXQ_OVFL) {
+      memcpy(&drops, CMSG_DATA(cmsg), sizeof(drops));
+      input->drops = (long)drops;
+    }
+#endif
+  }
+}
+
+/*
+ * Receives datagrams while available, into one block of slots at a time or
+ * into the slots of the ring.
+ */
+static void udp_recv_batch_poll_cb(uv_poll_t *poll, int status, int events) {
+  couv_udp_recv_batch_t *batch;
+  couv_udp_handle_data_t *hdata;
+  couv_udp_input_block_t *block;
+  couv_udp_input_t *input;
+  couv_udp_ring_t *ring;
+  couv_buf_mem_t *slot;
+  struct msghdr *hdr;
+  lua_State *L;
+  char *base;
+  int received;
+  int cnt;
+  int n;
+  int i;
+
+  batch = container_of(poll, couv_udp_recv_batch_t, poll);
+  L = batch->udp->data;
+  hdata = couv_get_udp_handle_data(batch->udp);
+  ring = hdata->ring;
+  received = 0;
+  while (status == 0) {
+    if (ring) {
+      cnt = ring->nfree < batch->size ? ring->nfree : batch->size;
+      for (i = 0; i < cnt; ++i) {
+        slot = couv_udp_ring_take(ring);
+        batch->iovs[i].iov_base = slot->mem;
+        batch->iovs[i].iov_len = ring->slot_size;
+      }
+    } else {
+      if (!batch->mem) {
+        batch->mem = couv_buf_mem_alloc(L, batch->size * batch->slot_size);
+        if (!batch->mem)
+          break;
+      }
+      cnt = batch->size;
+      base = batch->mem;
+      for (i = 0; i < cnt; ++i) {
+        batch->iovs[i].iov_base = base + i * batch->slot_size;
+        batch->iovs[i].iov_len = batch->slot_size;
+      }
+    }
+    if (cnt == 0)
+      break;
+    for (i = 0; i < cnt; ++i) {
+      hdr = &batch->msgs[i].msg_hdr;
+      memset(hdr, 0, sizeof(struct msghdr));
+      hdr->msg_name = &batch->addrs[i];
+      hdr->msg_namelen = sizeof(struct sockaddr_storage);
+      hdr->msg_iov = &batch->iovs[i];
+      hdr->msg_iovlen = 1;
+      if (hdata->recv_flags) {
+        hdr->msg_control = batch->controls + i * COUV_UDP_RECV_CONTROL_SIZE;
+        hdr->msg_controllen = COUV_UDP_RECV_CONTROL_SIZE;
+      }
+    }
+
+    n = couv_udp_recvmmsg(batch->fd, batch->msgs, cnt);
+    if (ring) {
+      for (i = n > 0 ? n : 0; i < cnt; ++i)
+        couv_buf_mem_release(L, batch->iovs[i].iov_base);
+    }
+    if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+      couv_udp_queue_error(L, hdata, couvL_sys_errname(errno));
+      ++received;
+    }
+    if (n <= 0)
+      break;
+
+    block = couv_alloc(L, offsetof(couv_udp_input_block_t, inputs)
+        + n * sizeof(couv_udp_input_t));
+    block->ref_cnt = n;
+    for (i = 0; i < n; ++i) {
+      input = &block->inputs[i];
+      input->block = block;
+      input->nread = batch->msgs[i].msg_len;
+      if (ring)
+        input->w_buf.orig = batch->iovs[i].iov_base;
+      else {
+        couv_buf_mem_retain(L, batch->mem);
+        input->w_buf.orig = batch->mem;
+      }
+      input->w_buf.buf = uv_buf_init(batch->iovs[i].iov_base,
+          batch->msgs[i].msg_len);
+      memcpy(&input->addr.storage, &batch->addrs[i],
+          batch->msgs[i].msg_hdr.msg_namelen);
+      input->segment_size = 0;
+      input->timestamp_sec = 0;
+      input->timestamp_nsec = 0;
+      input->dst.sa.sa_family = AF_UNSPEC;
+      input->truncated = (batch->msgs[i].msg_hdr.msg_flags & MSG_TRUNC) != 0;
+      input->drops = -1;
+      input->err_name = NULL;
+      if (input->truncated)
+        ++hdata->recv_truncated;
+      if (hdata->recv_flags & COUV_UDP_RECV_DROPS)
+        input->drops = 0;
+      if (hdata->recv_flags)
+        couv_udp_parse_control(&batch->msgs[i].msg_hdr, input);
+      if (input->drops > hdata->recv_drops)
+        hdata->recv_drops = input->drops;
+      ngx_queue_insert_tail(&hdata->input_queue, (ngx_queue_t *)input);
+    }
+    if (!ring) {
+      couv_buf_mem_release(L, batch->mem);
+      batch->mem = NULL;
+    }
+    received += n;
+    if (n < cnt)
+      break;
+  }
+
+  if (ring && ring->nfree == 0) {
+    uv_poll_stop(poll);
+    ring->paused = COUV_UDP_RING_PAUSED_POLL;
+    ++ring->exhausted;
+  }
+  if (received)
+    couv_udp_resume_receiver(batch->udp, hdata);
+}
+
+static int couv_udp_start_recv_batch(lua_State *L, uv_udp_t *handle,
+    int size, int slot_size) {
+  couv_udp_handle_data_t *hdata;
+  couv_udp_recv_batch_t *batch;
+  uv_os_sock_t fd;
+  int r;
+
+  hdata = couv_get_udp_handle_data(handle);
+  /* the ring has its own slots. coalesced datagrams must not be truncated. */
+  if (hdata->ring)
+    slot_size = hdata->ring->slot_size;
+  else if (hdata->recv_flags & COUV_UDP_RECV_GRO)
+    slot_size = COUV_UDP_GRO_SLOT_SIZE;
+
+  batch = hdata->recv_batch;
+  if (!batch) {
+    if (couv_handle_fd(handle) == -1)
+      return luaL_error(L, "EBADF");
+    fd = dup(couv_handle_fd(handle));
+    if (fd == -1)
+      return luaL_error(L, couvL_sock_lasterrname());
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+
+    batch = couv_alloc(L, sizeof(couv_udp_recv_batch_t));
+    memset(batch, 0, sizeof(couv_udp_recv_batch_t));
+    batch->udp = handle;
+    batch->fd = fd;
+    r = uv_poll_init(couv_loop(L), &batch->poll, fd);
+    if (r < 0) {
+      close(fd);
+      couv_free(L, batch);
+      return luaL_error(L, couvL_uv_lasterrname(couv_loop(L)));
+    }
+    hdata->recv_batch = batch;
+  }
+
+  if (batch->size != size || batch->slot_size != (size_t)slot_size) {
+    couv_free(L, batch->msgs);
+    couv_free(L, batch->iovs);
+    couv_free(L, batch->addrs);
+    couv_free(L, batch->controls);
+    if (batch->mem) {
+      couv_buf_mem_release(L, batch->mem);
+      batch->mem = NULL;
+    }
+    batch->size = size;
+    batch->slot_size = slot_size;
+    batch->msgs = couv_alloc(L, size * sizeof(struct mmsghdr));
+    batch->iovs = couv_alloc(L, size * sizeof(struct iovec));
+    batch->addrs = couv_alloc(L, size * sizeof(struct sockaddr_storage));
+    batch->controls = couv_alloc(L, size * COUV_UDP_RECV_CONTROL_SIZE);
+  }
+
+  if (hdata->ring && hdata->ring->paused)
+    return 0;
+  r = uv_poll_start(&batch->poll, UV_READABLE, udp_recv_batch_poll_cb);
+  if (r < 0)
+    return luaL_error(L, couvL_uv_lasterrname(couv_loop(L)));
+  return 0;
+}
+
+static int udp_recv_batch_start(lua_State *L) {
+  uv_udp_t *handle;
+  int size;
+  int slot_size;
 
-  return 3;
+  handle = couvL_checkudataclass(L, 1, COUV_UDP_MTBL_NAME);
+  size = luaL_optint(L, 2, COUV_UDP_RECV_BATCH_DEFAULT_SIZE);
+  luaL_argcheck(L, 0 < size && size <= COUV_UDP_RECV_BATCH_MAX_SIZE, 2,
+      "must be 1 <= batch <= 1024");
+  slot_size = luaL_optint(L, 3, COUV_UDP_RECV_BATCH_DEFAULT_SLOT_SIZE);
+  luaL_argcheck(L, 0 < slot_size && slot_size <= 65536, 3,
+      "must be 1 <= slotSize <= 65536");
+  return couv_udp_start_recv_batch(L, handle, size, slot_size);
+}
+#else
+static int udp_recv_batch_start(lua_State *L) {
+  return luaL_error(L, "ENOTSUP");
+}
+#endif
+
+/*
+ * Connects the socket to the address, which creates it bound to an
+ * ephemeral port if needed. Then send takes no address, and ICMP errors
+ * are raised from recv.
+ */
+static int udp_connect(lua_State *L) {
+  uv_udp_t *handle;
+  couv_udp_handle_data_t *hdata;
+  struct sockaddr *addr;
+  socklen_t addrlen;
+  int r;
+
+  handle = couvL_checkudataclass(L, 1, COUV_UDP_MTBL_NAME);
+  addr = couvL_checkudataclass(L, 2, COUV_SOCK_ADDR_MTBL_NAME);
+  if (couv_handle_fd(handle) == -1) {
+    if (addr->sa_family == AF_INET6)
+      r = uv_udp_bind6(handle, uv_ip6_addr("::", 0), 0);
+    else
+      r = uv_udp_bind(handle, uv_ip4_addr("0.0.0.0", 0), 0);
+    if (r < 0)
+      return luaL_error(L, couvL_uv_lasterrname(couv_loop(L)));
+  }
+  couv_udp_apply_sockopts(L, handle);
+
+  addrlen = addr->sa_family == AF_INET6
+      ? sizeof(struct sockaddr_in6) : sizeof(struct sockaddr_in);
+  if (connect(couv_handle_fd(handle), addr, addrlen) < 0)
+    return luaL_error(L, couvL_sock_lasterrname());
+  hdata = couv_get_udp_handle_data(handle);
+  memcpy(&hdata->peer, addr, addrlen);
+  hdata->connected = 1;
+  return 0;
+}
+
+static int udp_disconnect(lua_State *L) {
+  uv_udp_t *handle;
+  couv_udp_handle_data_t *hdata;
+  struct sockaddr addr;
+
+  handle = couvL_checkudataclass(L, 1, COUV_UDP_MTBL_NAME);
+  hdata = couv_get_udp_handle_data(handle);
+  if (!hdata->connected)
+    return 0;
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sa_family = AF_UNSPEC;
+  /* some systems dissolve the association but return EAFNOSUPPORT. */
+  if (connect(couv_handle_fd(handle), &addr, sizeof(addr)) < 0
+      && couv_sock_errno() != EAFNOSUPPORT)
+    return luaL_error(L, couvL_sock_lasterrname());
+  hdata->connected = 0;
+  return 0;
+}
+
+static int udp_getpeername(lua_State *L) {
+  uv_udp_t *handle;
+  couv_udp_handle_data_t *hdata;
+
+  handle = couvL_checkudataclass(L, 1, COUV_UDP_MTBL_NAME);
+  hdata = couv_get_udp_handle_data(handle);
+  if (!hdata->connected)
+    return luaL_error(L, "ENOTCONN");
+  return couvL_pushsockaddr(L, (struct sockaddr *)&hdata->peer);
 }
 
 static int udp_getsockname(lua_State *L) {
@@ -310,6 +2145,272 @@ static int udp_set_broadcast(lua_State *L) {
   return 0;
 }
 
+/*
+ * Enables receiving coalesced datagrams (UDP_GRO). Call this before
+ * startRecv or startRecvBatch, whose slots are made 64KB large then.
+ */
+static int udp_set_gro(lua_State *L) {
+  uv_udp_t *handle;
+#ifdef COUV_HAVE_UDP_GSO
+  couv_udp_handle_data_t *hdata;
+#endif
+  int on;
+
+  handle = couvL_checkudataclass(L, 1, COUV_UDP_MTBL_NAME);
+  on = lua_toboolean(L, 2);
+#ifdef COUV_HAVE_UDP_GSO
+  if (couv_setsockopt_int(couv_handle_fd(handle), SOL_UDP, UDP_GRO, on) < 0)
+    return luaL_error(L, couvL_sock_lasterrname());
+  hdata = couv_get_udp_handle_data(handle);
+  if (on)
+    hdata->recv_flags |= COUV_UDP_RECV_GRO;
+  else
+    hdata->recv_flags &= ~COUV_UDP_RECV_GRO;
+  return 0;
+#else
+  return luaL_error(L, "ENOTSUP");
+#endif
+}
+
+/*
+ * Makes the handle receive into a ring of preallocated slots of slotSize
+ * bytes instead of allocating 64KB for each datagram. Longer datagrams are
+ * truncated. Call this before startRecv or startRecvBatch.
+ */
+static int udp_set_recv_ring(lua_State *L) {
+  uv_udp_t *handle;
+  couv_udp_handle_data_t *hdata;
+  couv_udp_ring_t *ring;
+  couv_buf_mem_t *mem;
+  size_t stride;
+  int count;
+  int slot_size;
+  int i;
+
+  handle = couvL_checkudataclass(L, 1, COUV_UDP_MTBL_NAME);
+  count = luaL_checkint(L, 2);
+  luaL_argcheck(L, 0 < count && count <= COUV_UDP_RING_MAX_SLOTS, 2,
+      "must be 1 <= slots <= 65536");
+  slot_size = luaL_optint(L, 3, COUV_UDP_RING_DEFAULT_SLOT_SIZE);
+  luaL_argcheck(L, 0 < slot_size && slot_size <= 65536, 3,
+      "must be 1 <= slotSize <= 65536");
+
+  hdata = couv_get_udp_handle_data(handle);
+  if (hdata->ring || handle->recv_cb)
+    return luaL_error(L, "EBUSY");
+#ifdef COUV_HAVE_UDP_RECV_BATCH
+  if (hdata->recv_batch
+      && uv_is_active((uv_handle_t *)&hdata->recv_batch->poll))
+    return luaL_error(L, "EBUSY");
+#endif
+
+  /* keep the slots aligned for the Buffer read and write methods. */
+  stride = (offsetof(couv_buf_mem_t, mem) + slot_size + 15) & ~(size_t)15;
+  ring = couv_alloc(L, sizeof(couv_udp_ring_t));
+  ring->L = L;
+  ring->udp = handle;
+  ring->slot_size = slot_size;
+  ring->count = count;
+  ring->nfree = count;
+  ring->paused = 0;
+  uv_idle_init(couv_loop(L), &ring->idle);
+  ring->idle_closed = 0;
+  ring->exhausted = 0;
+  ring->slab = couv_alloc(L, count * stride);
+  ring->free_slots = couv_alloc(L, count * sizeof(couv_buf_mem_t *));
+  for (i = 0; i < count; ++i) {
+    mem = (couv_buf_mem_t *)(ring->slab + i * stride);
+    mem->ref_cnt = 0;
+    mem->free_cb = couv_udp_ring_slot_free_cb;
+    mem->data = ring;
+    ring->free_slots[count - 1 - i] = mem;
+  }
+  hdata->ring = ring;
+  return 0;
+}
+
+static int udp_get_recv_ring_stats(lua_State *L) {
+  uv_udp_t *handle;
+  couv_udp_ring_t *ring;
+
+  handle = couvL_checkudataclass(L, 1, COUV_UDP_MTBL_NAME);
+  ring = couv_get_udp_handle_data(handle)->ring;
+  if (!ring) {
+    lua_pushnil(L);
+    return 1;
+  }
+
+  lua_createtable(L, 0, 4);
+  couvL_SET_FIELD(L, slots, number, ring->count);
+  couvL_SET_FIELD(L, free, number, ring->nfree);
+  couvL_SET_FIELD(L, slotSize, number, ring->slot_size);
+  couvL_SET_FIELD(L, exhausted, number, ring->exhausted);
+  return 1;
+}
+
+/* Without a socket, the size is kept until bind or startRecv creates it. */
+static int udp_set_recv_buffer_size(lua_State *L) {
+  uv_udp_t *handle;
+
+  handle = couvL_checkudataclass(L, 1, COUV_UDP_MTBL_NAME);
+  return couvL_set_int_sockopt(L, couv_handle_fd(handle),
+      &couv_get_udp_handle_data(handle)->sockopts, SOL_SOCKET, SO_RCVBUF);
+}
+
+static int udp_get_recv_buffer_size(lua_State *L) {
+  uv_udp_t *handle;
+
+  handle = couvL_checkudataclass(L, 1, COUV_UDP_MTBL_NAME);
+  return couvL_get_int_sockopt(L, couv_handle_fd(handle),
+      &couv_get_udp_handle_data(handle)->sockopts, SOL_SOCKET, SO_RCVBUF);
+}
+
+/*
+ * Enables the count of datagrams dropped by the kernel (SO_RXQ_OVFL), e.g.
+ * when the receive buffer is full. recv returns it in info.drops. Call this
+ * before startRecv or startRecvBatch.
+ */
+static int udp_set_recv_drops(lua_State *L) {
+  uv_udp_t *handle;
+#if defined(COUV_HAVE_UDP_RECV_BATCH) && defined(SO_RXQ_OVFL)
+  couv_udp_handle_data_t *hdata;
+  int on;
+
+  handle = couvL_checkudataclass(L, 1, COUV_UDP_MTBL_NAME);
+  on = lua_toboolean(L, 2);
+  if (couv_setsockopt_int(couv_handle_fd(handle), SOL_SOCKET, SO_RXQ_OVFL,
+      on) < 0)
+    return luaL_error(L, couvL_sock_lasterrname());
+  hdata = couv_get_udp_handle_data(handle);
+  if (on)
+    hdata->recv_flags |= COUV_UDP_RECV_DROPS;
+  else
+    hdata->recv_flags &= ~COUV_UDP_RECV_DROPS;
+  return 0;
+#else
+  handle = couvL_checkudataclass(L, 1, COUV_UDP_MTBL_NAME);
+  return luaL_error(L, "ENOTSUP");
+#endif
+}
+
+/*
+ * Returns the count of truncated datagrams and the last count of dropped
+ * datagrams reported by the kernel.
+ */
+static int udp_get_recv_stats(lua_State *L) {
+  uv_udp_t *handle;
+  couv_udp_handle_data_t *hdata;
+
+  handle = couvL_checkudataclass(L, 1, COUV_UDP_MTBL_NAME);
+  hdata = couv_get_udp_handle_data(handle);
+  lua_createtable(L, 0, 2);
+  couvL_SET_FIELD(L, truncated, number, hdata->recv_truncated);
+  couvL_SET_FIELD(L, drops, number, hdata->recv_drops);
+  return 1;
+}
+
+/*
+ * Makes recv return the same SockAddr object for a repeat peer, for up to
+ * max peers. Pass 0 or nil to disable the cache.
+ */
+static int udp_set_addr_cache(lua_State *L) {
+  uv_udp_t *handle;
+  couv_udp_handle_data_t *hdata;
+  int max;
+
+  handle = couvL_checkudataclass(L, 1, COUV_UDP_MTBL_NAME);
+  max = luaL_optint(L, 2, 0);
+  luaL_argcheck(L, max >= 0, 2, "must not be negative");
+
+  hdata = couv_get_udp_handle_data(handle);
+  if (max == 0 || hdata->addr_cache_max == 0
+      || hdata->addr_cache_size > max) {
+    if (max == 0)
+      lua_pushnil(L);
+    else
+      lua_newtable(L);
+    couv_rawsetp(L, LUA_REGISTRYINDEX, COUV_ADDR_CACHE_REG_KEY(handle));
+    hdata->addr_cache_size = 0;
+  }
+  hdata->addr_cache_max = max;
+  return 0;
+}
+
+/*
+ * Enables kernel receive timestamps (SO_TIMESTAMPNS, or SO_TIMESTAMP with
+ * microseconds). recv returns them in the info table. Call this before
+ * startRecv or startRecvBatch.
+ */
+static int udp_set_timestamps(lua_State *L) {
+  uv_udp_t *handle;
+#ifdef COUV_HAVE_UDP_RECV_BATCH
+  couv_udp_handle_data_t *hdata;
+  int on;
+  int r;
+
+  handle = couvL_checkudataclass(L, 1, COUV_UDP_MTBL_NAME);
+  on = lua_toboolean(L, 2);
+#ifdef SO_TIMESTAMPNS
+  r = couv_setsockopt_int(couv_handle_fd(handle), SOL_SOCKET, SO_TIMESTAMPNS,
+      on);
+#else
+  r = couv_setsockopt_int(couv_handle_fd(handle), SOL_SOCKET, SO_TIMESTAMP,
+      on);
+#endif
+  if (r < 0)
+    return luaL_error(L, couvL_sock_lasterrname());
+  hdata = couv_get_udp_handle_data(handle);
+  if (on)
+    hdata->recv_flags |= COUV_UDP_RECV_TIMESTAMP;
+  else
+    hdata->recv_flags &= ~COUV_UDP_RECV_TIMESTAMP;
+  return 0;
+#else
+  handle = couvL_checkudataclass(L, 1, COUV_UDP_MTBL_NAME);
+  return luaL_error(L, "ENOTSUP");
+#endif
+}
+
+/*
+ * Enables receiving the local destination address and interface index of
+ * datagrams (IP_PKTINFO and IPV6_RECVPKTINFO), so that a handle bound to
+ * the any address can reply from the address a datagram arrived on. Call
+ * this after bind and before startRecv or startRecvBatch.
+ */
+static int udp_set_pkt_info(lua_State *L) {
+  uv_udp_t *handle;
+#ifdef COUV_HAVE_UDP_PKTINFO
+  couv_udp_handle_data_t *hdata;
+  struct sockaddr_storage ss;
+  socklen_t sslen;
+  uv_os_sock_t fd;
+  int on;
+
+  handle = couvL_checkudataclass(L, 1, COUV_UDP_MTBL_NAME);
+  on = lua_toboolean(L, 2);
+  fd = couv_handle_fd(handle);
+  sslen = sizeof(ss);
+  if (getsockname(fd, (struct sockaddr *)&ss, &sslen) < 0)
+    return luaL_error(L, couvL_sock_lasterrname());
+  if (ss.ss_family == AF_INET6) {
+    if (couv_setsockopt_int(fd, IPPROTO_IPV6, IPV6_RECVPKTINFO, on) < 0)
+      return luaL_error(L, couvL_sock_lasterrname());
+    /* for IPv4 datagrams on a dual stack socket, where supported. */
+    couv_setsockopt_int(fd, IPPROTO_IP, IP_PKTINFO, on);
+  } else if (couv_setsockopt_int(fd, IPPROTO_IP, IP_PKTINFO, on) < 0)
+    return luaL_error(L, couvL_sock_lasterrname());
+  hdata = couv_get_udp_handle_data(handle);
+  if (on)
+    hdata->recv_flags |= COUV_UDP_RECV_PKTINFO;
+  else
+    hdata->recv_flags &= ~COUV_UDP_RECV_PKTINFO;
+  return 0;
+#else
+  handle = couvL_checkudataclass(L, 1, COUV_UDP_MTBL_NAME);
+  return luaL_error(L, "ENOTSUP");
+#endif
+}
+
 static int udp_set_ttl(lua_State *L) {
   uv_udp_t *handle;
   int ttl;
@@ -326,17 +2427,36 @@ static int udp_set_ttl(lua_State *L) {
 
 static const struct luaL_Reg udp_methods[] = {
   { "bind", udp_bind },
+  { "connect", udp_connect },
+  { "disconnect", udp_disconnect },
+  { "getpeername", udp_getpeername },
+  { "getSendStats", udp_get_send_stats },
+  { "getRecvBufferSize", udp_get_recv_buffer_size },
+  { "getRecvRingStats", udp_get_recv_ring_stats },
+  { "getRecvStats", udp_get_recv_stats },
   { "getsockname", udp_getsockname },
   { "open", udp_open },
   { "_recv", udp_prim_recv },
+  { "_recvBatch", udp_prim_recv_batch },
   { "_send", udp_send },
+  { "_sendBatch", udp_send_batch },
+  { "_sendSegmented", udp_send_segmented },
+  { "setAddrCache", udp_set_addr_cache },
   { "setBroadcast", udp_set_broadcast },
+  { "setGro", udp_set_gro },
   { "setMembership", udp_set_membership },
   { "setMulticastLoop", udp_set_multicast_loop },
   { "setMulticastTtl", udp_set_multicast_ttl },
+  { "setPktInfo", udp_set_pkt_info },
+  { "setRecvBufferSize", udp_set_recv_buffer_size },
+  { "setRecvDrops", udp_set_recv_drops },
+  { "setRecvRing", udp_set_recv_ring },
+  { "setTimestamps", udp_set_timestamps },
   { "setTtl", udp_set_ttl },
   { "startRecv", udp_recv_start },
+  { "startRecvBatch", udp_recv_batch_start },
   { "stopRecv", udp_recv_stop },
+  { "trySend", udp_try_send },
   { NULL, NULL }
 };
 
@@ -350,6 +2470,7 @@ int luaopen_couv_udp(lua_State *L) {
   couvL_setfuncs(L, udp_functions, 0);
 
   couvL_SET_FIELD(L, IPV6ONLY, number, UV_UDP_IPV6ONLY);
+  couvL_SET_FIELD(L, REUSEPORT, number, COUV_UDP_REUSEPORT);
 
   couvL_SET_FIELD(L, JOIN_GROUP, number, UV_JOIN_GROUP);
   couvL_SET_FIELD(L, LEAVE_GROUP, number, UV_LEAVE_GROUP);
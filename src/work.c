@@ -0,0 +1,344 @@
+#include "couv-private.h"
+#include <lualib.h>
+
+/*
+ * Runs Lua functions on the threadpool. Each run takes a worker lua_State
+ * from the pool of the calling lua_State, which has couv loaded with a loop
+ * of its own and caches the loaded chunks by their source or bytecode. The
+ * arguments and results are marshalled, and the calling coroutine is
+ * resumed in after_work_cb.
+ */
+
+#define COUV_WORK_POOL_REGISTRY_KEY "couv.work.pool"
+#define COUV_WORK_CACHE_REGISTRY_KEY "couv.work.cache"
+
+/* the number of states created with the pool. */
+#define COUV_WORK_DEFAULT_STATES 4
+#define COUV_WORK_MAX_STATES 128
+
+typedef struct couv_work_pool_s {
+  uv_mutex_t mutex;
+  lua_State *states[COUV_WORK_MAX_STATES];
+  int nfree;
+  char *path;
+  char *cpath;
+  int pending;
+  int collected;
+} couv_work_pool_t;
+
+typedef struct couv_work_s {
+  uv_work_t req;
+  lua_State *L;
+  couv_work_pool_t *pool;
+  char *source;
+  size_t source_len;
+  couv_msg_t args;
+  couv_msg_t results;
+  char *err;
+  int nomem;
+} couv_work_t;
+
+static char *couv_work_strdup(lua_State *L, const char *str, size_t len) {
+  char *dup;
+
+  dup = couv_alloc(L, len + 1);
+  memcpy(dup, str, len);
+  dup[len] = '\0';
+  return dup;
+}
+
+static char *couv_work_package_field(lua_State *L, const char *k) {
+  const char *str;
+  size_t len;
+  char *dup;
+
+  dup = NULL;
+  lua_getglobal(L, "package");
+  if (lua_istable(L, -1)) {
+    lua_getfield(L, -1, k);
+    str = lua_tolstring(L, -1, &len);
+    if (str)
+      dup = couv_work_strdup(L, str, len);
+    lua_pop(L, 1);
+  }
+  lua_pop(L, 1);
+  return dup;
+}
+
+/* runs protected in a new worker state. */
+static int couv_work_setup_state(lua_State *L) {
+  couv_work_pool_t *pool;
+
+  pool = lua_touserdata(L, 1);
+  lua_getglobal(L, "package");
+  if (pool->path) {
+    lua_pushstring(L, pool->path);
+    lua_setfield(L, -2, "path");
+  }
+  if (pool->cpath) {
+    lua_pushstring(L, pool->cpath);
+    lua_setfield(L, -2, "cpath");
+  }
+  lua_pop(L, 1);
+
+  /* couv must be loaded before unpacking Buffers. */
+  lua_getglobal(L, "require");
+  lua_pushstring(L, "couv");
+  lua_call(L, 1, 0);
+
+  lua_newtable(L);
+  lua_setfield(L, LUA_REGISTRYINDEX, COUV_WORK_CACHE_REGISTRY_KEY);
+  return 0;
+}
+
+/*
+ * Closes a worker state and its loop. The loop runs once more to finish
+ * the handles closed by the garbage collector, like Channels.
+ */
+static void couv_work_close_state(lua_State *L) {
+  uv_loop_t *loop;
+
+  loop = couv_loop(L);
+  lua_close(L);
+  uv_run(loop);
+  uv_loop_delete(loop);
+}
+
+static lua_State *couv_work_new_state(couv_work_pool_t *pool) {
+  lua_State *L;
+  uv_loop_t *loop;
+
+  loop = uv_loop_new();
+  if (!loop)
+    return NULL;
+  L = luaL_newstate();
+  if (!L) {
+    uv_loop_delete(loop);
+    return NULL;
+  }
+  luaL_openlibs(L);
+  /* not the default loop, which belongs to the main thread. */
+  lua_pushlightuserdata(L, loop);
+  lua_setfield(L, LUA_REGISTRYINDEX, COUV_LOOP_REGISTRY_KEY);
+  lua_pushcfunction(L, couv_work_setup_state);
+  lua_pushlightuserdata(L, pool);
+  if (lua_pcall(L, 1, 0, 0) != 0) {
+    couv_work_close_state(L);
+    return NULL;
+  }
+  return L;
+}
+
+static lua_State *couv_work_acquire_state(couv_work_pool_t *pool) {
+  lua_State *L;
+
+  L = NULL;
+  uv_mutex_lock(&pool->mutex);
+  if (pool->nfree > 0)
+    L = pool->states[--pool->nfree];
+  uv_mutex_unlock(&pool->mutex);
+  return L ? L : couv_work_new_state(pool);
+}
+
+static void couv_work_release_state(couv_work_pool_t *pool, lua_State *L) {
+  uv_mutex_lock(&pool->mutex);
+  if (pool->nfree < COUV_WORK_MAX_STATES) {
+    pool->states[pool->nfree++] = L;
+    L = NULL;
+  }
+  uv_mutex_unlock(&pool->mutex);
+  if (L)
+    couv_work_close_state(L);
+}
+
+static void couv_work_pool_free(lua_State *L, couv_work_pool_t *pool) {
+  int i;
+
+  for (i = 0; i < pool->nfree; ++i)
+    couv_work_close_state(pool->states[i]);
+  uv_mutex_destroy(&pool->mutex);
+  couv_free(L, pool->path);
+  couv_free(L, pool->cpath);
+  couv_free(L, pool);
+}
+
+static int couv_work_pool_gc(lua_State *L) {
+  couv_work_pool_t *pool;
+
+  pool = *(couv_work_pool_t **)lua_touserdata(L, 1);
+  pool->collected = 1;
+  if (pool->pending == 0)
+    couv_work_pool_free(L, pool);
+  return 0;
+}
+
+static couv_work_pool_t *couv_work_get_pool(lua_State *L) {
+  couv_work_pool_t *pool;
+  couv_work_pool_t **ud;
+  lua_State *state;
+  int i;
+
+  lua_getfield(L, LUA_REGISTRYINDEX, COUV_WORK_POOL_REGISTRY_KEY);
+  if (!lua_isnil(L, -1)) {
+    pool = *(couv_work_pool_t **)lua_touserdata(L, -1);
+    lua_pop(L, 1);
+    return pool;
+  }
+  lua_pop(L, 1);
+
+  pool = couv_alloc(L, sizeof(couv_work_pool_t));
+  memset(pool, 0, sizeof(couv_work_pool_t));
+  if (uv_mutex_init(&pool->mutex) != 0) {
+    couv_free(L, pool);
+    luaL_error(L, "ENOMEM");
+  }
+  pool->path = couv_work_package_field(L, "path");
+  pool->cpath = couv_work_package_field(L, "cpath");
+  for (i = 0; i < COUV_WORK_DEFAULT_STATES; ++i) {
+    state = couv_work_new_state(pool);
+    if (state)
+      pool->states[pool->nfree++] = state;
+  }
+
+  /* the pool is freed when the calling state is closed. */
+  ud = lua_newuserdata(L, sizeof(couv_work_pool_t *));
+  *ud = pool;
+  lua_createtable(L, 0, 1);
+  lua_pushcfunction(L, couv_work_pool_gc);
+  lua_setfield(L, -2, "__gc");
+  lua_setmetatable(L, -2);
+  lua_setfield(L, LUA_REGISTRYINDEX, COUV_WORK_POOL_REGISTRY_KEY);
+  return pool;
+}
+
+/* runs protected in a worker state. */
+static int couv_work_run(lua_State *L) {
+  couv_work_t *w;
+  int base;
+  int nargs;
+
+  w = lua_touserdata(L, 1);
+  lua_settop(L, 0);
+
+  lua_getfield(L, LUA_REGISTRYINDEX, COUV_WORK_CACHE_REGISTRY_KEY);
+  lua_pushlstring(L, w->source, w->source_len);
+  lua_pushvalue(L, -1);
+  lua_rawget(L, 1);
+  if (lua_isnil(L, -1)) {
+    lua_pop(L, 1);
+    if (luaL_loadbuffer(L, w->source, w->source_len, "=work") != 0)
+      return lua_error(L);
+    lua_pushvalue(L, 2);
+    lua_pushvalue(L, -2);
+    lua_rawset(L, 1);
+  }
+
+  base = lua_gettop(L);
+  nargs = couv_msg_unpack(L, &w->args);
+  lua_call(L, nargs, LUA_MULTRET);
+  couv_msg_pack(L, &w->results, base, lua_gettop(L) - base + 1);
+  return 0;
+}
+
+static void couv_work_cb(uv_work_t *req) {
+  couv_work_t *w;
+  lua_State *L;
+  const char *err;
+
+  w = container_of(req, couv_work_t, req);
+  L = couv_work_acquire_state(w->pool);
+  if (!L) {
+    w->nomem = 1;
+    return;
+  }
+
+  lua_pushcfunction(L, couv_work_run);
+  lua_pushlightuserdata(L, w);
+  if (lua_pcall(L, 1, 0, 0) != 0) {
+    couv_msg_free(L, &w->results);
+    err = lua_tostring(L, -1);
+    if (!err)
+      err = "unknown error";
+    w->err = couv_work_strdup(L, err, strlen(err));
+  }
+  lua_settop(L, 0);
+  couv_work_release_state(w->pool, L);
+}
+
+static void couv_work_after_cb(uv_work_t *req, int status) {
+  couv_work_t *w;
+  couv_work_pool_t *pool;
+  lua_State *L;
+  int nresults;
+
+  w = container_of(req, couv_work_t, req);
+  L = w->L;
+  lua_pushnil(L);
+  couv_rawsetp(L, LUA_REGISTRYINDEX, COUV_THREAD_REG_KEY(w));
+
+  if (w->err || w->nomem) {
+    lua_pushboolean(L, 0);
+    lua_pushstring(L, w->err ? w->err : "ENOMEM");
+    nresults = 2;
+  } else {
+    lua_pushboolean(L, 1);
+    nresults = 1 + couv_msg_unpack(L, &w->results);
+  }
+
+  couv_msg_free(L, &w->args);
+  couv_free(L, w->source);
+  couv_free(L, w->err);
+  pool = w->pool;
+  couv_free(L, w);
+  if (--pool->pending == 0 && pool->collected)
+    couv_work_pool_free(L, pool);
+
+  couv_resume(L, L, nresults);
+}
+
+static int couv_work(lua_State *L) {
+  const char *source;
+  size_t source_len;
+  int nargs;
+  couv_msg_t args;
+  couv_work_pool_t *pool;
+  couv_work_t *w;
+
+  source = luaL_checklstring(L, 1, &source_len);
+  nargs = lua_gettop(L) - 1;
+  if (couvL_is_mainthread(L))
+    return luaL_error(L, "work must be called in coroutine.");
+  pool = couv_work_get_pool(L);
+  couv_msg_init(&args);
+  couv_msg_pack(L, &args, 2, nargs);
+
+  w = couv_alloc(L, sizeof(couv_work_t));
+  memset(w, 0, sizeof(couv_work_t));
+  w->args = args;
+  couv_msg_init(&w->results);
+  w->L = L;
+  w->pool = pool;
+  w->source = couv_work_strdup(L, source, source_len);
+  w->source_len = source_len;
+
+  if (uv_queue_work(couv_loop(L), &w->req, couv_work_cb,
+      couv_work_after_cb) < 0) {
+    couv_msg_free(L, &w->args);
+    couv_free(L, w->source);
+    couv_free(L, w);
+    return luaL_error(L, couvL_uv_lasterrname(couv_loop(L)));
+  }
+  ++pool->pending;
+  couv_rawsetp(L, LUA_REGISTRYINDEX, COUV_THREAD_REG_KEY(w));
+  return lua_yield(L, 0);
+}
+
+static const struct luaL_Reg work_functions[] = {
+  { "work", couv_work },
+  { NULL, NULL }
+};
+
+int luaopen_couv_work(lua_State *L) {
+  couvL_setfuncs(L, work_functions, 0);
+  return 0;
+}
@@ -0,0 +1,360 @@
+#include "couv-private.h"
+
+/*
+ * Zero-copy sends for Tcp (SO_ZEROCOPY / MSG_ZEROCOPY). Large writes of
+ * Buffers are passed to sendmsg without copying, and the Buffer memory is
+ * retained until the kernel reports the send completed on the socket error
+ * queue. Other writes go through uv_write as usual.
+ *
+ * The error queue is drained when the socket gets EPOLLERR. A uv_poll on
+ * the socket itself would also wake for unread data while reading is
+ * stopped, so the socket is added with no events to an epoll fd of its own,
+ * which becomes readable only on EPOLLERR, and that fd is polled instead.
+ */
+
+#if defined(__linux__) && defined(SO_ZEROCOPY) && defined(MSG_ZEROCOPY)
+#define COUV_HAVE_ZEROCOPY 1
+#include <linux/errqueue.h>
+#include <sys/epoll.h>
+#endif
+
+#define COUV_ZEROCOPY_MAX_IOV 64
+
+typedef struct couv_zerocopy_send_s {
+  ngx_queue_t *prev;
+  ngx_queue_t *next;
+  uint32_t id;
+  int memcnt;
+  void *mems[1];
+} couv_zerocopy_send_t;
+
+struct couv_tcp_zerocopy_s {
+  lua_State *L;
+  uv_tcp_t *tcp;
+  size_t threshold;
+  uint32_t next_id;
+  ngx_queue_t pending;
+  int pending_cnt;
+  int epfd;
+  uv_poll_t poll;
+  double sends;
+  double completions;
+  double copied;
+};
+
+static void couv_zerocopy_release(couv_tcp_zerocopy_t *zc,
+    couv_zerocopy_send_t *send) {
+  int i;
+
+  ngx_queue_remove(send);
+  --zc->pending_cnt;
+  for (i = 0; i < send->memcnt; ++i)
+    couv_buf_mem_release(zc->L, send->mems[i]);
+  couv_free(zc->L, send);
+}
+
+#ifdef COUV_HAVE_ZEROCOPY
+
+/* releases the sends whose ids are in [lo, hi], taking care of wraparound. */
+static void couv_zerocopy_complete(couv_tcp_zerocopy_t *zc, uint32_t lo,
+    uint32_t hi) {
+  ngx_queue_t *q;
+  ngx_queue_t *next;
+  couv_zerocopy_send_t *send;
+
+  for (q = ngx_queue_head(&zc->pending); q != ngx_queue_sentinel(&zc->pending);
+      q = next) {
+    next = ngx_queue_next(q);
+    send = (couv_zerocopy_send_t *)q;
+    if (send->id - lo <= hi - lo) {
+      couv_zerocopy_release(zc, send);
+      ++zc->completions;
+    }
+  }
+}
+
+/*
+ * reads completion notifications from the socket error queue. Returns the
+ * number of messages read.
+ */
+static int couv_zerocopy_drain(couv_tcp_zerocopy_t *zc) {
+  uv_os_sock_t sock;
+  struct msghdr msg;
+  struct cmsghdr *cmsg;
+  struct sock_extended_err *serr;
+  char control[128];
+  int cnt;
+
+  cnt = 0;
+  sock = couv_handle_fd(zc->tcp);
+  if (sock == -1)
+    return 0;
+  while (zc->pending_cnt > 0) {
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    if (recvmsg(sock, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0)
+      break;
+    ++cnt;
+    for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+      if (!((cmsg->cmsg_level == SOL_IP && cmsg->cmsg_type == IP_RECVERR)
+          || (cmsg->cmsg_level == SOL_IPV6
+          && cmsg->cmsg_type == IPV6_RECVERR)))
+        continue;
+      serr = (struct sock_extended_err *)CMSG_DATA(cmsg);
+      if (serr->ee_errno != 0 || serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY)
+        continue;
+      if (serr->ee_code & SO_EE_CODE_ZEROCOPY_COPIED)
+        zc->copied += serr->ee_data - serr->ee_info + 1;
+      couv_zerocopy_complete(zc, serr->ee_info, serr->ee_data);
+    }
+  }
+  if (zc->pending_cnt == 0)
+    uv_poll_stop(&zc->poll);
+  return cnt;
+}
+
+/*
+ * EPOLLHUP and a pending socket error, which is left for the reads and
+ * writes to report, keep the epoll fd readable with the error queue empty.
+ * The poll is stopped then, so that it does not spin, and is started again
+ * by the next send. The sends still pending are released at the latest
+ * when the handle is closed.
+ */
+static void couv_zerocopy_poll_cb(uv_poll_t *poll, int status, int events) {
+  couv_tcp_zerocopy_t *zc;
+
+  zc = container_of(poll, couv_tcp_zerocopy_t, poll);
+  if (couv_zerocopy_drain(zc) == 0)
+    uv_poll_stop(poll);
+}
+
+/*
+ * Tries to send the Buffers at the table at index with MSG_ZEROCOPY.
+ * Returns the number of bytes sent, or -1 when the write should be done
+ * with uv_write. Frees bufs and raises an error if sendmsg fails.
+ */
+static ssize_t couv_zerocopy_send(lua_State *L, couv_tcp_zerocopy_t *zc,
+    int index, uv_buf_t *bufs, size_t bufcnt) {
+  struct iovec iov[COUV_ZEROCOPY_MAX_IOV];
+  struct msghdr msg;
+  couv_zerocopy_send_t *send;
+  couv_buf_t *w_buf;
+  size_t total;
+  size_t i;
+  ssize_t n;
+
+  if (bufcnt == 0 || bufcnt > COUV_ZEROCOPY_MAX_IOV
+      || zc->tcp->write_queue_size > 0)
+    return -1;
+  total = 0;
+  for (i = 0; i < bufcnt; ++i) {
+    lua_rawgeti(L, index, (int)i + 1);
+    w_buf = couvL_testudataclass(L, -1, COUV_BUFFER_MTBL_NAME);
+    lua_pop(L, 1);
+    if (!w_buf || !w_buf->orig)
+      return -1;
+    iov[i].iov_base = bufs[i].base;
+    iov[i].iov_len = bufs[i].len;
+    total += bufs[i].len;
+  }
+  if (total < zc->threshold)
+    return -1;
+
+  couv_zerocopy_drain(zc);
+
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = iov;
+  msg.msg_iovlen = bufcnt;
+  n = sendmsg(couv_handle_fd(zc->tcp), &msg,
+      MSG_ZEROCOPY | MSG_DONTWAIT | MSG_NOSIGNAL);
+  if (n < 0) {
+    if (errno == EAGAIN || errno == EWOULDBLOCK || errno == ENOBUFS)
+      return -1;
+    couv_free(L, bufs);
+    luaL_error(L, couvL_sys_errname(errno));
+    return -1;
+  }
+
+  /* every successful call consumes one notification id. */
+  send = couv_alloc(L, offsetof(couv_zerocopy_send_t, mems)
+      + bufcnt * sizeof(void *));
+  send->id = zc->next_id++;
+  send->memcnt = (int)bufcnt;
+  for (i = 0; i < bufcnt; ++i) {
+    lua_rawgeti(L, index, (int)i + 1);
+    w_buf = lua_touserdata(L, -1);
+    lua_pop(L, 1);
+    couv_buf_mem_retain(L, w_buf->orig);
+    send->mems[i] = w_buf->orig;
+  }
+  ngx_queue_insert_tail(&zc->pending, (ngx_queue_t *)send);
+  ++zc->pending_cnt;
+  ++zc->sends;
+  if (!uv_is_active((uv_handle_t *)&zc->poll))
+    uv_poll_start(&zc->poll, UV_READABLE, couv_zerocopy_poll_cb);
+  return n;
+}
+
+#endif
+
+static couv_tcp_zerocopy_t *couv_get_tcp_zerocopy(uv_tcp_t *handle) {
+  return container_of(handle, couv_tcp_t, handle)->zerocopy;
+}
+
+static void couv_zerocopy_poll_close_cb(uv_handle_t *handle) {
+  couv_tcp_zerocopy_t *zc;
+
+  zc = container_of(handle, couv_tcp_zerocopy_t, poll);
+  close(zc->epfd);
+  couv_free(zc->L, zc);
+}
+
+void couv_clean_tcp_zerocopy(lua_State *L, uv_tcp_t *handle) {
+  couv_tcp_zerocopy_t *zc;
+
+  zc = couv_get_tcp_zerocopy(handle);
+  if (!zc)
+    return;
+
+  /* the socket is closed, so the kernel is done with the memory. */
+  while (!ngx_queue_empty(&zc->pending))
+    couv_zerocopy_release(zc,
+        (couv_zerocopy_send_t *)ngx_queue_head(&zc->pending));
+  container_of(handle, couv_tcp_t, handle)->zerocopy = NULL;
+  uv_close((uv_handle_t *)&zc->poll, couv_zerocopy_poll_close_cb);
+}
+
+static int tcp_write(lua_State *L) {
+  uv_tcp_t *handle;
+  couv_tcp_zerocopy_t *zc;
+  couv_pacer_t *pacer;
+  uv_buf_t *bufs;
+  size_t bufcnt;
+#ifdef COUV_HAVE_ZEROCOPY
+  ssize_t n;
+  size_t i;
+#endif
+
+  handle = couvL_checkudataclass(L, 1, COUV_TCP_MTBL_NAME);
+  bufs = couv_checkbuforstrtable(L, 2, &bufcnt);
+
+  pacer = container_of(handle, couv_tcp_t, handle)->pacer;
+  if (pacer)
+    return couv_pacer_write(L, pacer, (uv_stream_t *)handle, 2, bufs,
+        bufcnt);
+
+  zc = couv_get_tcp_zerocopy(handle);
+  if (!zc || zc->threshold == 0)
+    return couv_stream_write_bufs(L, (uv_stream_t *)handle, 2, bufs, bufcnt);
+
+#ifdef COUV_HAVE_ZEROCOPY
+  n = couv_zerocopy_send(L, zc, 2, bufs, bufcnt);
+  if (n < 0)
+    return couv_stream_write_bufs(L, (uv_stream_t *)handle, 2, bufs, bufcnt);
+
+  /* write the rest, which is retained already, with uv_write. */
+  for (i = 0; i < bufcnt && (size_t)n >= bufs[i].len; ++i)
+    n -= bufs[i].len;
+  if (i == bufcnt) {
+    couv_free(L, bufs);
+    return 0;
+  }
+  bufs[i].base += n;
+  bufs[i].len -= n;
+  memmove(bufs, bufs + i, (bufcnt - i) * sizeof(uv_buf_t));
+  return couv_stream_write_bufs(L, (uv_stream_t *)handle, 2, bufs, bufcnt - i);
+#else
+  return couv_stream_write_bufs(L, (uv_stream_t *)handle, 2, bufs, bufcnt);
+#endif
+}
+
+static int tcp_set_zero_copy(lua_State *L) {
+  uv_tcp_t *handle;
+  couv_tcp_zerocopy_t *zc;
+  lua_Number threshold;
+#ifdef COUV_HAVE_ZEROCOPY
+  struct epoll_event ev;
+  int epfd;
+#endif
+
+  handle = couvL_checkudataclass(L, 1, COUV_TCP_MTBL_NAME);
+  threshold = luaL_optnumber(L, 2, 0);
+  luaL_argcheck(L, threshold >= 0, 2, "must not be negative");
+
+  zc = couv_get_tcp_zerocopy(handle);
+  if (threshold == 0) {
+    if (zc)
+      zc->threshold = 0;
+    return 0;
+  }
+
+#ifdef COUV_HAVE_ZEROCOPY
+  if (couv_setsockopt_int(couv_handle_fd(handle), SOL_SOCKET, SO_ZEROCOPY,
+      1) < 0)
+    return luaL_error(L, couvL_sock_lasterrname());
+
+  if (!zc) {
+    epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (epfd == -1)
+      return luaL_error(L, couvL_sys_errname(errno));
+    /* EPOLLERR is reported without asking for it. */
+    memset(&ev, 0, sizeof(ev));
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, couv_handle_fd(handle), &ev) < 0) {
+      close(epfd);
+      return luaL_error(L, couvL_sys_errname(errno));
+    }
+
+    zc = couv_alloc(L, sizeof(couv_tcp_zerocopy_t));
+    memset(zc, 0, sizeof(couv_tcp_zerocopy_t));
+    zc->L = L;
+    zc->tcp = handle;
+    ngx_queue_init(&zc->pending);
+    zc->epfd = epfd;
+    if (uv_poll_init(couv_loop(L), &zc->poll, epfd) < 0) {
+      close(epfd);
+      couv_free(L, zc);
+      return luaL_error(L, couvL_uv_lasterrname(couv_loop(L)));
+    }
+    uv_unref((uv_handle_t *)&zc->poll);
+    container_of(handle, couv_tcp_t, handle)->zerocopy = zc;
+  }
+  zc->threshold = (size_t)threshold;
+  return 0;
+#else
+  return luaL_error(L, "ENOTSUP");
+#endif
+}
+
+static int tcp_get_zero_copy_stats(lua_State *L) {
+  uv_tcp_t *handle;
+  couv_tcp_zerocopy_t *zc;
+
+  handle = couvL_checkudataclass(L, 1, COUV_TCP_MTBL_NAME);
+  zc = couv_get_tcp_zerocopy(handle);
+  if (!zc) {
+    lua_pushnil(L);
+    return 1;
+  }
+
+  lua_createtable(L, 0, 4);
+  couvL_SET_FIELD(L, sends, number, zc->sends);
+  couvL_SET_FIELD(L, completions, number, zc->completions);
+  couvL_SET_FIELD(L, copied, number, zc->copied);
+  couvL_SET_FIELD(L, pending, number, zc->pending_cnt);
+  return 1;
+}
+
+static const struct luaL_Reg zerocopy_methods[] = {
+  { "getZeroCopyStats", tcp_get_zero_copy_stats },
+  { "setZeroCopy", tcp_set_zero_copy },
+  { "_write", tcp_write },
+  { NULL, NULL }
+};
+
+int luaopen_couv_zerocopy(lua_State *L) {
+  luaL_getmetatable(L, COUV_TCP_MTBL_NAME);
+  couvL_setfuncs(L, zerocopy_methods, 0);
+  lua_pop(L, 1);
+  return 0;
+}
@@ -0,0 +1,103 @@
+local uv = require 'couv'
+
+local SEGMENT_SIZE = 1200
+local SEGMENTS = 64
+local ROUNDS = 5000
+local TEST_PORT = 9123
+
+-- Yields until the next loop iteration, in which the receiver drains what
+-- was sent meanwhile. The timer calls back in the state which created it,
+-- so it must be created outside of the yielding coroutine.
+local function nextTick(timer)
+  local co = coroutine.running()
+  timer:start(function() coroutine.resume(co) end, 0, 0)
+  coroutine.yield()
+end
+
+-- Sends SEGMENTS datagrams per round on loopback, with sendBatch and
+-- recvBatch or with sendSegmented and GRO receives. The sender yields after
+-- each round, so that both modes are measured sending at the rate the
+-- receiver keeps up with. Reports the datagrams sent per second and the
+-- datagrams lost separately.
+local function run(offload)
+  local addr = uv.SockAddrV4.new('127.0.0.1', TEST_PORT)
+  local received = 0
+  local timer = uv.Timer.new()
+  local start, stop
+
+  coroutine.wrap(function()
+    local handle = uv.Udp.new()
+    handle:bind(addr)
+    if offload then
+      handle:setGro(true)
+    end
+    handle:startRecvBatch(64)
+    local entries, n
+    local done = false
+    repeat
+      entries, n = handle:recvBatch(entries)
+      for i = 1, n do
+        local entry = entries[i]
+        if entry.nread == 3 and entry.buf:toString(1, 3) == 'END' then
+          done = true
+        elseif entry.segmentSize then
+          received = received + math.ceil(entry.nread / entry.segmentSize)
+        else
+          received = received + 1
+        end
+      end
+    until done
+    handle:stopRecv()
+    handle:close()
+  end)()
+
+  coroutine.wrap(function()
+    local handle = uv.Udp.new()
+    handle:bind(uv.SockAddrV4.new('127.0.0.1', 0))
+    local payload = string.rep('x', SEGMENT_SIZE * SEGMENTS)
+    local msgs = {}
+    for i = 1, SEGMENTS do
+      msgs[i] = {string.rep('x', SEGMENT_SIZE), addr}
+    end
+
+    start = uv.hrtime()
+    for i = 1, ROUNDS do
+      if offload then
+        handle:sendSegmented(payload, addr, SEGMENT_SIZE)
+      else
+        handle:sendBatch(msgs)
+      end
+      nextTick(timer)
+    end
+    stop = uv.hrtime()
+    timer:close()
+    -- let the receiver drain, so the end marker is not coalesced.
+    uv.sleep(50)
+    handle:send({'END'}, addr)
+    handle:close()
+  end)()
+
+  uv.run()
+  local sent = SEGMENTS * ROUNDS
+  local secs = (stop - start) / 1e9
+  print(string.format(
+      "%s: sent %d datagrams in %.2fs, %.0f datagrams/s, %d lost",
+      offload and 'offload' or 'no offload', sent, secs, sent / secs,
+      sent - received))
+end
+
+run(false)
+
+local supported, err
+coroutine.wrap(function()
+  local handle = uv.Udp.new()
+  handle:bind(uv.SockAddrV4.new('127.0.0.1', 0))
+  supported, err = pcall(handle.setGro, handle, true)
+  handle:close()
+end)()
+uv.run()
+if supported then
+  run(true)
+else
+  print('offload: not supported, ' .. err)
+end
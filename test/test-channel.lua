@@ -0,0 +1,74 @@
+local uv = require 'couv'
+
+local exports = {}
+
+exports['channel.local'] = function(test)
+  coroutine.wrap(function()
+    local ch = uv.Channel.new()
+    ch:send(1, 'one')
+    ch:send({2, 'two'})
+    local n, s = ch:recv()
+    test.equal(n, 1)
+    test.equal(s, 'one')
+    local t = ch:recv()
+    test.equal(t[1], 2)
+    test.equal(t[2], 'two')
+
+    uv.Timer.new():start(function(handle)
+      ch:send('later')
+      handle:close()
+    end, 10, 0)
+    test.equal(ch:recv(), 'later')
+
+    ch:close()
+    test.equal(select('#', ch:recv()), 0)
+    test.ok(not pcall(ch.send, ch, 'closed'))
+  end)()
+
+  uv.run()
+  test.done()
+end
+
+exports['channel.buffer'] = function(test)
+  coroutine.wrap(function()
+    local ch = uv.Channel.new()
+    local buf = uv.Buffer.new('twice')
+    -- the second occurrence is copied, as the first one is moved.
+    ch:send(buf, {buf})
+    test.equal(buf:length(), 0)
+    local a, t = ch:recv()
+    test.equal(a:toString(), 'twice')
+    test.equal(t[1]:toString(), 'twice')
+    ch:close()
+  end)()
+
+  uv.run()
+  test.done()
+end
+
+exports['channel.thread'] = function(test)
+  local COUNT = 100
+
+  coroutine.wrap(function()
+    local ch = uv.Channel.new()
+    local thread = uv.Thread.spawn(function(ch, count)
+      local uv = require 'couv'
+      for i = 1, count do
+        ch:send(i, uv.Buffer.new(tostring(i)))
+      end
+    end, ch, COUNT)
+
+    for i = 1, COUNT do
+      local n, buf = ch:recv()
+      test.equal(n, i)
+      test.equal(buf:toString(), tostring(i))
+    end
+    test.ok(thread:join())
+    ch:close()
+  end)()
+
+  uv.run()
+  test.done()
+end
+
+return exports
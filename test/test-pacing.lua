@@ -0,0 +1,147 @@
+local uv = require 'couv'
+
+local exports = {}
+
+local TEST_PORT = 9123
+
+exports['pacing.udp_quantum'] = function(test)
+  local COUNT = 5
+  local payload = string.rep('x', 100)
+
+  coroutine.wrap(function()
+    local handle = uv.Udp.new()
+    handle:bind(uv.SockAddrV4.new('127.0.0.1', 62001))
+    handle:startRecv()
+    for i = 1, COUNT do
+      local nread = handle:recv()
+      test.equal(nread, #payload)
+    end
+    handle:stopRecv()
+    handle:close()
+  end)()
+
+  coroutine.wrap(function()
+    local handle = uv.Udp.new()
+    handle:bind(uv.SockAddrV4.new('127.0.0.1', 0))
+    -- one datagram per 10 msecs.
+    test.equal(handle:setPacing{quantum = #payload, interval = 10},
+        'userland')
+    local start = uv.now()
+    for i = 1, COUNT do
+      handle:send({payload}, uv.SockAddrV4.new('127.0.0.1', 62001))
+    end
+    test.ok(uv.now() - start >= (COUNT - 2) * 10)
+    local stats = handle:getPacingStats()
+    test.equal(stats.mode, 'userland')
+    test.equal(stats.queued, 0)
+    test.equal(stats.released, COUNT * #payload)
+    test.ok(stats.delayed > 0)
+    handle:close()
+  end)()
+
+  uv.run()
+  test.done()
+end
+
+exports['pacing.udp_batch'] = function(test)
+  local COUNT = 5
+  local payload = string.rep('x', 100)
+
+  coroutine.wrap(function()
+    local handle = uv.Udp.new()
+    handle:bind(uv.SockAddrV4.new('127.0.0.1', 62001))
+    handle:startRecv()
+    for i = 1, COUNT * 2 do
+      local nread = handle:recv()
+      test.equal(nread, #payload)
+    end
+    handle:stopRecv()
+    handle:close()
+  end)()
+
+  coroutine.wrap(function()
+    local addr = uv.SockAddrV4.new('127.0.0.1', 62001)
+    local handle = uv.Udp.new()
+    handle:bind(uv.SockAddrV4.new('127.0.0.1', 0))
+    -- one batch of two datagrams per 10 msecs.
+    handle:setPacing{quantum = 2 * #payload, interval = 10}
+    local start = uv.now()
+    for i = 1, COUNT do
+      if i % 2 == 0 then
+        handle:sendBatch({{{payload}, addr}, {{payload}, addr}})
+      else
+        handle:sendSegmented(payload .. payload, addr, #payload)
+      end
+    end
+    test.ok(uv.now() - start >= (COUNT - 2) * 10)
+    local stats = handle:getPacingStats()
+    test.equal(stats.released, COUNT * 2 * #payload)
+    test.ok(stats.delayed > 0)
+    handle:close()
+  end)()
+
+  uv.run()
+  test.done()
+end
+
+exports['pacing.udp_rate'] = function(test)
+  local handle = uv.Udp.new()
+  handle:bind(uv.SockAddrV4.new('127.0.0.1', 0))
+  test.ok(not pcall(handle.setPacing, handle, {rate = 100000, burst = 0}))
+  -- Udp is paced in userland unless the kernel is asked for.
+  test.equal(handle:setPacing{rate = 100000}, 'userland')
+  handle:setPacing(nil)
+  handle:close()
+  uv.run()
+  test.done()
+end
+
+exports['pacing.tcp_rate'] = function(test)
+  local addr = uv.SockAddrV4.new('127.0.0.1', TEST_PORT)
+  local COUNT = 5
+  local payload = string.rep('x', 1000)
+
+  coroutine.wrap(function()
+    local server = uv.Tcp.new()
+    server:bind(addr)
+    server:listen(128, function(server)
+      coroutine.wrap(function()
+        local stream = uv.Tcp.new()
+        server:accept(stream)
+        stream:startRead()
+        local total = 0
+        repeat
+          local nread = stream:read()
+          if nread and nread > 0 then
+            total = total + nread
+          end
+        until nread and nread < 0
+        test.equal(total, COUNT * #payload)
+        stream:close()
+        server:close()
+      end)()
+    end)
+  end)()
+
+  coroutine.wrap(function()
+    local handle = uv.Tcp.new()
+    handle:connect(addr)
+    -- 100KB/s in userland, so the writes take about 40 msecs.
+    test.equal(handle:setPacing{rate = 100000, burst = #payload,
+        kernel = false}, 'userland')
+    local start = uv.now()
+    for i = 1, COUNT do
+      handle:write({payload})
+    end
+    test.ok(uv.now() - start >= 30)
+    test.ok(handle:getPacingStats().delayed > 0)
+    handle:setPacing(nil)
+    test.equal(handle:getPacingStats().mode, 'off')
+    handle:close()
+  end)()
+
+  uv.run()
+  test.done()
+end
+
+return exports
@@ -0,0 +1,100 @@
+local uv = require 'couv'
+
+local exports = {}
+
+local TEST_PORT = 9123
+
+exports['proxy'] = function(test)
+  local addr = uv.SockAddrV4.new('127.0.0.1', TEST_PORT)
+  local accepted = {}
+  local stats
+
+  coroutine.wrap(function()
+    local server = uv.Tcp.new()
+    server:bind(addr)
+    server:listen(128, function(server)
+      local stream = uv.Tcp.new()
+      server:accept(stream)
+      accepted[#accepted + 1] = stream
+      if #accepted == 2 then
+        coroutine.wrap(function()
+          server:close()
+          stats = uv.proxy(accepted[1], accepted[2], {idleTimeout = 1000})
+          accepted[1]:close()
+          accepted[2]:close()
+        end)()
+      end
+    end)
+  end)()
+
+  local function peer(msg, expected)
+    return function()
+      local handle = uv.Tcp.new()
+      handle:connect(addr)
+      handle:startRead()
+      handle:write({msg})
+      local nread, buf = handle:read()
+      test.equal(buf:toString(1, nread), expected)
+      handle:shutdown()
+      nread = handle:read()
+      test.ok(nread < 0)
+      handle:close()
+    end
+  end
+
+  coroutine.wrap(peer('PING', 'PONG'))()
+  coroutine.wrap(function()
+    -- connect second so that the first peer is the stream a.
+    uv.sleep(10)
+    peer('PONG', 'PING')()
+  end)()
+
+  uv.run()
+  test.equal(stats.aToB, 4)
+  test.equal(stats.bToA, 4)
+  test.equal(stats.reason, 'EOF')
+  test.done()
+end
+
+exports['proxy.close'] = function(test)
+  local addr = uv.SockAddrV4.new('127.0.0.1', TEST_PORT)
+  local accepted = {}
+  local stats
+
+  coroutine.wrap(function()
+    local server = uv.Tcp.new()
+    server:bind(addr)
+    server:listen(128, function(server)
+      local stream = uv.Tcp.new()
+      server:accept(stream)
+      accepted[#accepted + 1] = stream
+      if #accepted == 2 then
+        server:close()
+        coroutine.wrap(function()
+          stats = uv.proxy(accepted[1], accepted[2])
+          accepted[2]:close()
+        end)()
+        -- nothing is written, so only closing ends the proxy.
+        accepted[1]:closeNoWait()
+      end
+    end)
+  end)()
+
+  local function peer()
+    local handle = uv.Tcp.new()
+    handle:connect(addr)
+    handle:startRead()
+    local nread = handle:read()
+    test.ok(nread < 0)
+    handle:close()
+  end
+
+  coroutine.wrap(peer)()
+  coroutine.wrap(peer)()
+
+  uv.run()
+  test.equal(stats.reason, 'ECANCELED')
+  test.done()
+end
+
+return exports
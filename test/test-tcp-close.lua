@@ -32,4 +32,86 @@ exports['tcp.close'] = function(test)
   test.done()
 end
 
+exports['tcp.reset'] = function(test)
+  local addr = uv.SockAddrV4.new('127.0.0.1', TEST_PORT)
+
+  coroutine.wrap(function()
+    local handle = uv.Tcp.new()
+    handle:bind(addr)
+    handle:listen(128, function(server)
+      coroutine.wrap(function()
+        local stream = uv.Tcp.new()
+        server:accept(stream)
+        stream:startRead()
+        local nread, buf, err = stream:read()
+        test.ok(nread < 0)
+        test.equal(err, 'ECONNRESET')
+        stream:close()
+        handle:close()
+      end)()
+    end)
+  end)()
+
+  coroutine.wrap(function()
+    local handle = uv.Tcp.new()
+    handle:connect(addr)
+    handle:reset()
+    test.equal(handle:isClosing(), true)
+  end)()
+
+  uv.run()
+  test.done()
+end
+
+exports['tcp.close_no_wait'] = function(test)
+  local closed = false
+
+  coroutine.wrap(function()
+    local handle = uv.Tcp.new()
+    handle:closeNoWait()
+    closed = true
+    test.equal(handle:isClosing(), true)
+  end)()
+
+  -- the coroutine is not yielded by closeNoWait.
+  test.ok(closed)
+  uv.run()
+  test.done()
+end
+
+exports['tcp.close_while_reading'] = function(test)
+  local addr = uv.SockAddrV4.new('127.0.0.1', TEST_PORT)
+  local nread, buf, err
+
+  coroutine.wrap(function()
+    local server = uv.Tcp.new()
+    server:bind(addr)
+    server:listen(128, function(server)
+      coroutine.wrap(function()
+        local stream = uv.Tcp.new()
+        server:accept(stream)
+        stream:startRead()
+        stream:read()
+        stream:close()
+        server:close()
+      end)()
+    end)
+  end)()
+
+  coroutine.wrap(function()
+    local handle = uv.Tcp.new()
+    handle:connect(addr)
+    handle:startRead()
+    coroutine.wrap(function()
+      nread, buf, err = handle:read()
+    end)()
+    handle:closeNoWait()
+  end)()
+
+  uv.run()
+  test.equal(nread, -1)
+  test.equal(err, 'ECANCELED')
+  test.done()
+end
+
 return exports
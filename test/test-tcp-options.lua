@@ -0,0 +1,132 @@
+local uv = require 'couv'
+
+local exports = {}
+
+local TEST_PORT = 9123
+
+exports['tcp.options'] = function(test)
+  coroutine.wrap(function()
+    local handle = uv.Tcp.new()
+
+    -- the buffer sizes are kept until bind creates the socket.
+    handle:setSendBufferSize(65536)
+    handle:setRecvBufferSize(65536)
+    handle:setNotSentLowat(16384)
+    test.equal(handle:getRecvBufferSize(), 65536)
+
+    handle:bind(uv.SockAddrV4.new('127.0.0.1', TEST_PORT))
+    test.ok(handle:getSendBufferSize() >= 65536)
+    test.ok(handle:getRecvBufferSize() >= 65536)
+    test.equal(handle:getNotSentLowat(), 16384)
+
+    -- the kernel rounds the timeout to its retransmission schedule.
+    handle:setDeferAccept(1)
+    test.ok(handle:getDeferAccept() > 0)
+    handle:setDeferAccept(0)
+    test.equal(handle:getDeferAccept(), 0)
+
+    handle:setFastOpen(16)
+    test.equal(handle:getFastOpen(), 16)
+
+    handle:close()
+  end)()
+
+  coroutine.wrap(function()
+    local handle = uv.Tcp.new()
+    test.equal(handle:getFastOpenConnect(), false)
+    handle:setFastOpenConnect(true)
+    test.equal(handle:getFastOpenConnect(), true)
+    handle:close()
+  end)()
+
+  uv.run()
+  test.done()
+end
+
+exports['tcp.options_before_connect'] = function(test)
+  local addr = uv.SockAddrV4.new('127.0.0.1', TEST_PORT)
+
+  coroutine.wrap(function()
+    local server = uv.Tcp.new()
+    server:bind(addr)
+    server:listen(128, function(server)
+      coroutine.wrap(function()
+        local stream = uv.Tcp.new()
+        server:accept(stream)
+        stream:close()
+        server:close()
+      end)()
+    end)
+  end)()
+
+  coroutine.wrap(function()
+    local handle = uv.Tcp.new()
+    handle:setRecvBufferSize(65536)
+    handle:setNotSentLowat(16384)
+    handle:connect(addr)
+    test.ok(handle:getRecvBufferSize() >= 65536)
+    test.equal(handle:getNotSentLowat(), 16384)
+    handle:close()
+  end)()
+
+  uv.run()
+  test.done()
+end
+
+exports['tcp.keepalive_options'] = function(test)
+  coroutine.wrap(function()
+    local handle = uv.Tcp.new()
+    handle:bind(uv.SockAddrV4.new('127.0.0.1', TEST_PORT))
+
+    handle:keepalive(true, 10, 2, 3)
+    test.equal(handle:getKeepaliveInterval(), 2)
+    test.equal(handle:getKeepaliveCount(), 3)
+
+    handle:setUserTimeout(5000)
+    test.equal(handle:getUserTimeout(), 5000)
+
+    handle:close()
+  end)()
+
+  coroutine.wrap(function()
+    local handle = uv.Tcp.new()
+
+    -- kept until bind creates the socket.
+    handle:keepalive(true, 10, 2, 3)
+    handle:bind(uv.SockAddrV4.new('127.0.0.1', TEST_PORT + 1))
+    test.equal(handle:getKeepaliveInterval(), 2)
+    test.equal(handle:getKeepaliveCount(), 3)
+
+    handle:close()
+  end)()
+
+  uv.run()
+  test.done()
+end
+
+exports['tcp.info'] = function(test)
+  coroutine.wrap(function()
+    local handle = uv.Tcp.new()
+    handle:bind(uv.SockAddrV4.new('127.0.0.1', TEST_PORT))
+    handle:listen(128, function(server)
+    end)
+
+    local info = handle:getInfo()
+    test.is_table(info)
+    test.is_number(info.rtt)
+    test.is_number(info.rttvar)
+    test.is_number(info.sndCwnd)
+    test.is_number(info.totalRetrans)
+    test.is_number(info.unacked)
+
+    -- the passed table is filled and reused.
+    test.equal(rawequal(handle:getInfo(info), info), true)
+
+    handle:close()
+  end)()
+
+  uv.run()
+  test.done()
+end
+
+return exports
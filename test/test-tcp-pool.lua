@@ -0,0 +1,111 @@
+local uv = require 'couv'
+
+local exports = {}
+
+local TEST_PORT = 9123
+
+exports['tcp.pool'] = function(test)
+  local addr = uv.SockAddrV4.new('127.0.0.1', TEST_PORT)
+  local accepted = 0
+
+  coroutine.wrap(function()
+    local handle = uv.Tcp.new()
+    handle:bind(addr)
+    handle:listen(128, function(server)
+      accepted = accepted + 1
+      coroutine.wrap(function()
+        local stream = uv.Tcp.new()
+        server:accept(stream)
+        stream:startRead()
+        local nread, buf
+        repeat
+          nread, buf = stream:read()
+          if nread and nread > 0 then
+            stream:write({buf:toString(1, nread)})
+          end
+        until nread and nread < 0
+        stream:close()
+      end)()
+    end)
+    handle:unref()
+  end)()
+
+  local pool = uv.TcpPool.new{maxPerHost = 1}
+  local first
+
+  local function ping(msg)
+    local handle = pool:checkout(addr)
+    handle:startRead()
+    handle:write({msg})
+    local nread, buf = handle:read()
+    test.equal(buf:toString(1, nread), msg)
+    handle:stopRead()
+    return handle
+  end
+
+  coroutine.wrap(function()
+    first = ping('PING1')
+    -- let the second coroutine wait for the exhausted pool.
+    uv.sleep(10)
+    pool:release(first)
+  end)()
+
+  coroutine.wrap(function()
+    local handle = ping('PING2')
+    -- the connection of the first coroutine is handed over.
+    test.equal(handle, first)
+    test.equal(accepted, 1)
+    pool:release(handle)
+    pool:close()
+  end)()
+
+  uv.run()
+  test.done()
+end
+
+exports['tcp.pool_close'] = function(test)
+  local addr = uv.SockAddrV4.new('127.0.0.1', TEST_PORT + 1)
+  local server
+  local ok, err
+
+  coroutine.wrap(function()
+    server = uv.Tcp.new()
+    server:bind(addr)
+    server:listen(128, function(server)
+      coroutine.wrap(function()
+        local stream = uv.Tcp.new()
+        server:accept(stream)
+        stream:startRead()
+        local nread
+        repeat
+          nread = stream:read()
+        until nread and nread < 0
+        stream:close()
+      end)()
+    end)
+  end)()
+
+  local pool = uv.TcpPool.new{maxPerHost = 1}
+
+  coroutine.wrap(function()
+    local handle = pool:checkout(addr)
+    -- the second coroutine waits for the exhausted pool meanwhile.
+    pool:close()
+    test.equal(ok, false)
+    test.ok(string.find(err, 'ECANCELED'))
+    -- released handles are closed, and checkouts fail.
+    pool:release(handle)
+    test.ok(handle:isClosing())
+    test.ok(not pcall(pool.checkout, pool, addr))
+    server:close()
+  end)()
+
+  coroutine.wrap(function()
+    ok, err = pcall(pool.checkout, pool, addr)
+  end)()
+
+  uv.run()
+  test.done()
+end
+
+return exports
@@ -67,4 +67,201 @@ exports['tcp.echo'] = function(test)
   test.done()
 end
 
+exports['tcp.connect_host'] = function(test)
+  coroutine.wrap(function()
+    local server = uv.Tcp.new()
+    server:bind(uv.SockAddrV4.new('127.0.0.1', 9123))
+    server:listen(128, function(server)
+      coroutine.wrap(function()
+        local stream = uv.Tcp.new()
+        server:accept(stream)
+        stream:close()
+      end)()
+    end)
+
+    -- ::1 is refused if localhost has it, and 127.0.0.1 is tried at once.
+    local handle = uv.Tcp.connectHost('localhost', 9123, {delay = 50})
+    test.equal(handle:getpeername():port(), 9123)
+    handle:close()
+
+    server:close()
+
+    local ok, err = pcall(uv.Tcp.connectHost, '127.0.0.1', 9123)
+    test.ok(not ok)
+    test.equal(string.sub(err, -#'ECONNREFUSED'), 'ECONNREFUSED')
+  end)()
+
+  uv.run()
+  test.done()
+end
+
+exports['tcp.listen_batch'] = function(test)
+  local CLIENT_COUNT = 5
+  local accepted = 0
+  local batches = 0
+
+  coroutine.wrap(function()
+    local server = uv.Tcp.new()
+    server:bind(uv.SockAddrV4.new('127.0.0.1', 9123))
+    server:listenBatch(128, function(server, clients, err)
+      test.is_nil(err)
+      batches = batches + 1
+      accepted = accepted + #clients
+      for i = 1, #clients do
+        coroutine.wrap(function()
+          clients[i]:close()
+        end)()
+      end
+      if accepted == CLIENT_COUNT then
+        coroutine.wrap(function()
+          server:close()
+        end)()
+      end
+    end, 16)
+  end)()
+
+  for i = 1, CLIENT_COUNT do
+    coroutine.wrap(function()
+      local handle = uv.Tcp.new()
+      handle:connect(uv.SockAddrV4.new('127.0.0.1', 9123))
+      handle:close()
+    end)()
+  end
+
+  uv.run()
+  test.equal(accepted, CLIENT_COUNT)
+  test.ok(batches <= CLIENT_COUNT)
+  test.done()
+end
+
+exports['tcp.admission'] = function(test)
+  local addr = uv.SockAddrV4.new('127.0.0.1', 9123)
+  local server
+
+  coroutine.wrap(function()
+    server = uv.Tcp.new()
+    server:bind(addr)
+    server:setAdmission{maxConnections = 1, maxPerIp = 1, reset = true}
+    server:listen(128, function(server)
+      coroutine.wrap(function()
+        local stream = uv.Tcp.new()
+        server:accept(stream)
+        stream:startRead()
+        stream:read()
+        stream:close()
+      end)()
+    end)
+  end)()
+
+  coroutine.wrap(function()
+    local first = uv.Tcp.new()
+    first:connect(addr)
+
+    -- the second connection is over the limits and reset by the server.
+    local second = uv.Tcp.new()
+    second:connect(addr)
+    second:startRead()
+    local nread, buf, err = second:read()
+    test.ok(nread < 0)
+    second:close()
+
+    local stats = server:getAdmissionStats()
+    test.equal(stats.admitted, 1)
+    test.equal(stats.live, 1)
+    test.equal(stats.rejectedConnections, 1)
+
+    first:close()
+    server:close()
+  end)()
+
+  uv.run()
+  test.done()
+end
+
+exports['tcp.read_while_writing'] = function(test)
+  local addr = uv.SockAddrV4.new('127.0.0.1', 9123)
+  local got
+
+  coroutine.wrap(function()
+    local server = uv.Tcp.new()
+    server:bind(addr)
+    server:listen(128, function(server)
+      coroutine.wrap(function()
+        local stream = uv.Tcp.new()
+        server:accept(stream)
+        stream:startRead()
+        local nread, buf = stream:read()
+        stream:write({buf:toString(1, nread)})
+        stream:close()
+        server:close()
+      end)()
+    end)
+  end)()
+
+  coroutine.wrap(function()
+    local handle = uv.Tcp.new()
+    handle:connect(addr)
+    handle:startRead()
+
+    -- the reader waits while another coroutine writes on the handle.
+    coroutine.wrap(function()
+      local nread, buf = handle:read()
+      got = buf:toString(1, nread)
+      handle:close()
+    end)()
+    coroutine.wrap(function()
+      handle:write({'PING'})
+    end)()
+  end)()
+
+  uv.run()
+  test.equal(got, 'PING')
+  test.done()
+end
+
+exports['tcp.zero_copy'] = function(test)
+  local SIZE = 256 * 1024
+  local addr = uv.SockAddrV4.new('127.0.0.1', 9123)
+  local received = 0
+
+  coroutine.wrap(function()
+    local server = uv.Tcp.new()
+    server:bind(addr)
+    server:listen(128, function(server)
+      coroutine.wrap(function()
+        local stream = uv.Tcp.new()
+        server:accept(stream)
+        stream:startRead()
+        local nread
+        repeat
+          nread = stream:read()
+          if nread > 0 then
+            received = received + nread
+          end
+        until nread < 0
+        stream:close()
+        server:close()
+      end)()
+    end)
+  end)()
+
+  coroutine.wrap(function()
+    local handle = uv.Tcp.new()
+    handle:connect(addr)
+    handle:setZeroCopy(64 * 1024)
+
+    -- strings and small writes are copied.
+    handle:write({'PING'})
+    handle:write({uv.Buffer.new(SIZE)})
+
+    test.is_table(handle:getZeroCopyStats())
+    handle:shutdown()
+    handle:close()
+  end)()
+
+  uv.run()
+  test.equal(received, SIZE + 4)
+  test.done()
+end
+
 return exports
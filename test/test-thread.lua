@@ -0,0 +1,58 @@
+local uv = require 'couv'
+
+local exports = {}
+
+exports['thread.join'] = function(test)
+  coroutine.wrap(function()
+    local thread = uv.Thread.spawn(function(a, t)
+      local uv = require 'couv'
+      -- the loop of the thread runs until the timer is closed.
+      uv.Timer.new():start(function(handle) handle:close() end, 10, 0)
+      return a * 2, {n = #t, s = t[1] .. t[2]}
+    end, 21, {'foo', 'bar'})
+    test.equal(thread:isDone(), false)
+    local ok, n, t = thread:join()
+    test.ok(ok)
+    test.equal(n, 42)
+    test.equal(t.n, 2)
+    test.equal(t.s, 'foobar')
+    test.ok(thread:isDone())
+  end)()
+
+  uv.run()
+  test.done()
+end
+
+exports['thread.buffer'] = function(test)
+  coroutine.wrap(function()
+    local buf = uv.Buffer.new('hello')
+    local thread = uv.Thread.spawn(
+        'local buf = ...; return buf:toString(), buf:length()', buf)
+    -- buf had no other user, so it was moved to the thread.
+    test.equal(buf:length(), 0)
+    local ok, str, len = thread:join()
+    test.ok(ok)
+    test.equal(str, 'hello')
+    test.equal(len, 5)
+  end)()
+
+  uv.run()
+  test.done()
+end
+
+exports['thread.error'] = function(test)
+  coroutine.wrap(function()
+    local thread = uv.Thread.spawn('error("boom", 0)')
+    local ok, err = thread:join()
+    test.equal(ok, false)
+    test.equal(err, 'boom')
+
+    -- functions cannot be marshalled.
+    test.ok(not pcall(uv.Thread.spawn, 'return', function() end))
+  end)()
+
+  uv.run()
+  test.done()
+end
+
+return exports
@@ -26,6 +26,437 @@ exports['udp.send_and_recv'] = function(test)
   test.done()
 end
 
+exports['udp.close_while_receiving'] = function(test)
+  local ok, err
+
+  coroutine.wrap(function()
+    local handle = uv.Udp.new()
+    handle:bind(uv.SockAddrV4.new('127.0.0.1', 62001))
+    handle:startRecv()
+    coroutine.wrap(function()
+      ok, err = pcall(handle.recv, handle)
+    end)()
+    handle:close()
+  end)()
+
+  uv.run()
+  test.equal(ok, false)
+  test.ok(string.find(err, 'ECANCELED'))
+  test.done()
+end
+
+exports['udp.recv_batch'] = function(test)
+  local COUNT = 10
+
+  coroutine.wrap(function()
+    local handle = uv.Udp.new()
+    handle:bind(uv.SockAddrV4.new('127.0.0.1', 62001))
+    handle:startRecvBatch(4, 512)
+    local received = 0
+    local entries, n
+    while received < COUNT do
+      entries, n = handle:recvBatch(entries)
+      test.ok(n <= COUNT)
+      for i = 1, n do
+        local entry = entries[i]
+        test.equal(entry.buf:toString(1, entry.nread), 'msg' .. (received + i))
+        test.equal(entry.addr:host(), '127.0.0.1')
+      end
+      received = received + n
+    end
+    test.equal(received, COUNT)
+    handle:stopRecv()
+    handle:close()
+  end)()
+
+  coroutine.wrap(function()
+    local handle = uv.Udp.new()
+    for i = 1, COUNT do
+      handle:send({'msg' .. i}, uv.SockAddrV4.new('127.0.0.1', 62001))
+    end
+    handle:close()
+  end)()
+
+  uv.run()
+  test.done()
+end
+
+exports['udp.send_batch'] = function(test)
+  local COUNT = 8
+
+  coroutine.wrap(function()
+    local handle = uv.Udp.new()
+    handle:bind(uv.SockAddrV4.new('127.0.0.1', 62001))
+    handle:startRecv()
+    for i = 1, COUNT do
+      local nread, buf = handle:recv()
+      test.equal(buf:toString(1, nread), 'hello' .. i)
+    end
+    handle:stopRecv()
+    handle:close()
+  end)()
+
+  coroutine.wrap(function()
+    local handle = uv.Udp.new()
+    handle:bind(uv.SockAddrV4.new('127.0.0.1', 0))
+    local addr = uv.SockAddrV4.new('127.0.0.1', 62001)
+    local msgs = {}
+    for i = 1, COUNT do
+      msgs[i] = {{'hello', tostring(i)}, addr}
+    end
+    local statuses = handle:sendBatch(msgs)
+    test.equal(#statuses, COUNT)
+    for i = 1, COUNT do
+      test.equal(statuses[i], true)
+    end
+    handle:close()
+  end)()
+
+  uv.run()
+  test.done()
+end
+
+exports['udp.send_segmented'] = function(test)
+  local MSG = 'abcdefghij'
+
+  coroutine.wrap(function()
+    local handle = uv.Udp.new()
+    handle:bind(uv.SockAddrV4.new('127.0.0.1', 62001))
+    -- segments are either received one by one or coalesced by GRO.
+    local gro = pcall(handle.setGro, handle, true)
+    handle:startRecv()
+    local received = ''
+    local segments = {}
+    while #received < #MSG do
+      local nread, buf, addr, info = handle:recv()
+      local data = buf:toString(1, nread)
+      received = received .. data
+      local segmentSize = gro and info.segmentSize or nread
+      for i = 1, nread, segmentSize do
+        segments[#segments + 1] = string.sub(data, i, i + segmentSize - 1)
+      end
+    end
+    test.equal(received, MSG)
+    test.equal(#segments, 3)
+    test.equal(segments[3], 'ij')
+    handle:stopRecv()
+    handle:close()
+  end)()
+
+  coroutine.wrap(function()
+    local handle = uv.Udp.new()
+    handle:bind(uv.SockAddrV4.new('127.0.0.1', 0))
+    handle:sendSegmented(MSG, uv.SockAddrV4.new('127.0.0.1', 62001), 4)
+    handle:close()
+  end)()
+
+  uv.run()
+  test.done()
+end
+
+exports['udp.recv_ring'] = function(test)
+  local COUNT = 5
+
+  coroutine.wrap(function()
+    local handle = uv.Udp.new()
+    handle:bind(uv.SockAddrV4.new('127.0.0.1', 62001))
+    handle:setRecvRing(2, 64)
+    handle:startRecv()
+    for i = 1, COUNT do
+      local nread, buf = handle:recv()
+      test.equal(buf:toString(1, nread), 'msg' .. i)
+      -- receiving pauses until the slot is back in the ring.
+      buf:release()
+      test.equal(#buf, 0)
+    end
+    local stats = handle:getRecvRingStats()
+    test.equal(stats.slots, 2)
+    test.equal(stats.free, 2)
+    test.equal(stats.slotSize, 64)
+    handle:stopRecv()
+    handle:close()
+  end)()
+
+  coroutine.wrap(function()
+    local handle = uv.Udp.new()
+    for i = 1, COUNT do
+      handle:send({'msg' .. i}, uv.SockAddrV4.new('127.0.0.1', 62001))
+    end
+    handle:close()
+  end)()
+
+  uv.run()
+  test.done()
+end
+
+exports['udp.addr_cache'] = function(test)
+  coroutine.wrap(function()
+    local handle = uv.Udp.new()
+    handle:bind(uv.SockAddrV4.new('127.0.0.1', 62001))
+    handle:setAddrCache(16)
+    handle:startRecv()
+    local _, _, addr1 = handle:recv()
+    local _, _, addr2 = handle:recv()
+    -- the same peer gets the same object, usable as a table key.
+    test.ok(rawequal(addr1, addr2))
+    test.equal(addr1:host(), '127.0.0.1')
+    handle:stopRecv()
+    handle:close()
+  end)()
+
+  coroutine.wrap(function()
+    local handle = uv.Udp.new()
+    handle:bind(uv.SockAddrV4.new('127.0.0.1', 0))
+    handle:send({'hello'}, uv.SockAddrV4.new('127.0.0.1', 62001))
+    handle:send({'world'}, uv.SockAddrV4.new('127.0.0.1', 62001))
+    handle:close()
+  end)()
+
+  uv.run()
+  test.done()
+end
+
+exports['udp.connect'] = function(test)
+  coroutine.wrap(function()
+    local handle = uv.Udp.new()
+    handle:bind(uv.SockAddrV4.new('127.0.0.1', 62001))
+    handle:startRecv()
+    local nread, buf, addr = handle:recv()
+    test.equal(buf:toString(1, nread), 'hello')
+    handle:send({'world'}, addr)
+    handle:stopRecv()
+    handle:close()
+  end)()
+
+  coroutine.wrap(function()
+    local handle = uv.Udp.new()
+    handle:connect(uv.SockAddrV4.new('127.0.0.1', 62001))
+    test.equal(handle:getpeername():port(), 62001)
+    handle:startRecv()
+    handle:send({'hello'})
+    local nread, buf = handle:recv()
+    test.equal(buf:toString(1, nread), 'world')
+
+    -- nothing listens on the port, so the ICMP error is raised.
+    handle:disconnect()
+    handle:connect(uv.SockAddrV4.new('127.0.0.1', 62002))
+    handle:send({'hello'})
+    local ok, err = pcall(handle.recv, handle)
+    test.ok(not ok)
+    test.equal(string.sub(err, -#'ECONNREFUSED'), 'ECONNREFUSED')
+    handle:stopRecv()
+    handle:close()
+  end)()
+
+  uv.run()
+  test.done()
+end
+
+exports['udp.try_send'] = function(test)
+  local COUNT = 3
+
+  coroutine.wrap(function()
+    local handle = uv.Udp.new()
+    handle:bind(uv.SockAddrV4.new('127.0.0.1', 62001))
+    handle:startRecv()
+    for i = 1, COUNT do
+      local nread, buf = handle:recv()
+      test.equal(buf:toString(1, nread), 'metric' .. i)
+    end
+    handle:stopRecv()
+    handle:close()
+  end)()
+
+  coroutine.wrap(function()
+    local handle = uv.Udp.new()
+    handle:bind(uv.SockAddrV4.new('127.0.0.1', 0))
+    local addr = uv.SockAddrV4.new('127.0.0.1', 62001)
+    for i = 1, COUNT do
+      handle:trySend({'metric', tostring(i)}, addr)
+    end
+    -- let the queued sends, if any, complete.
+    uv.sleep(10)
+    local stats = handle:getSendStats()
+    test.equal(stats.sent, COUNT)
+    test.equal(stats.failed, 0)
+    test.equal(stats.pending, 0)
+    handle:close()
+  end)()
+
+  uv.run()
+  test.done()
+end
+
+exports['udp.spawn_shards'] = function(test)
+  local SHARDS = 2
+  local COUNT = 64
+
+  coroutine.wrap(function()
+    local addr = uv.SockAddrV4.new('127.0.0.1', 62001)
+    local ch = uv.Channel.new()
+    local threads = uv.Udp.spawnShards(addr, SHARDS, function(handle, ch)
+      local n = 0
+      ch:send('ready')
+      while true do
+        local nread, buf, addr = handle:recv()
+        if buf:toString(1, nread) == 'stop' then
+          break
+        end
+        n = n + 1
+        ch:send(addr:port())
+      end
+      handle:close()
+      return n
+    end, nil, ch)
+    for i = 1, SHARDS do
+      test.equal(ch:recv(), 'ready')
+    end
+
+    -- each sender is a flow of its own, so the datagrams spread by hash.
+    local senders = {}
+    for i = 1, COUNT do
+      senders[i] = uv.Udp.new()
+      senders[i]:send({'msg'}, addr)
+    end
+    for i = 1, COUNT do
+      test.ok(ch:recv() > 0)
+    end
+    for i = 1, COUNT do
+      senders[i]:send({'stop'}, addr)
+    end
+
+    local total = 0
+    for i = 1, SHARDS do
+      local ok, n = threads[i]:join()
+      test.ok(ok)
+      test.ok(n > 0)
+      total = total + n
+    end
+    test.equal(total, COUNT)
+    for i = 1, COUNT do
+      senders[i]:close()
+    end
+    ch:close()
+  end)()
+
+  uv.run()
+  test.done()
+end
+
+exports['udp.timestamps'] = function(test)
+  local COUNT = 4
+
+  coroutine.wrap(function()
+    local handle = uv.Udp.new()
+    handle:bind(uv.SockAddrV4.new('127.0.0.1', 62001))
+    handle:setTimestamps(true)
+    handle:startRecv()
+    local hist = uv.Histogram.new()
+    for i = 1, COUNT do
+      local nread, buf, addr, info = handle:recv()
+      test.equal(buf:toString(1, nread), 'msg' .. i)
+      test.is_number(info.timestamp)
+      test.ok(info.delay >= 0)
+      hist:record(info.delay)
+    end
+    test.equal(hist:count(), COUNT)
+    test.ok(hist:percentile(50) <= hist:max())
+    handle:stopRecv()
+    handle:close()
+  end)()
+
+  coroutine.wrap(function()
+    local handle = uv.Udp.new()
+    for i = 1, COUNT do
+      handle:send({'msg' .. i}, uv.SockAddrV4.new('127.0.0.1', 62001))
+    end
+    handle:close()
+  end)()
+
+  uv.run()
+  test.done()
+end
+
+exports['udp.pkt_info'] = function(test)
+  coroutine.wrap(function()
+    local handle = uv.Udp.new()
+    handle:bind(uv.SockAddrV4.new('0.0.0.0', 62001))
+    handle:setPktInfo(true)
+    handle:startRecv()
+    local nread, buf, addr, info = handle:recv()
+    test.equal(buf:toString(1, nread), 'PING')
+    test.equal(info.dstAddr:host(), '127.0.0.1')
+    test.ok(info.ifindex > 0)
+    handle:send({'PONG'}, addr, info.dstAddr)
+    handle:stopRecv()
+    handle:close()
+  end)()
+
+  coroutine.wrap(function()
+    local handle = uv.Udp.new()
+    handle:bind(uv.SockAddrV4.new('127.0.0.1', 0))
+    handle:startRecv()
+    handle:send({'PING'}, uv.SockAddrV4.new('127.0.0.1', 62001))
+    local nread, buf, addr = handle:recv()
+    test.equal(buf:toString(1, nread), 'PONG')
+    -- the reply comes from the address the request was sent to.
+    test.equal(addr:host(), '127.0.0.1')
+    test.equal(addr:port(), 62001)
+    handle:stopRecv()
+    handle:close()
+  end)()
+
+  uv.run()
+  test.done()
+end
+
+exports['udp.truncation'] = function(test)
+  coroutine.wrap(function()
+    local handle = uv.Udp.new()
+    -- kept until bind creates the socket.
+    handle:setRecvBufferSize(65536)
+    test.equal(handle:getRecvBufferSize(), 65536)
+    handle:bind(uv.SockAddrV4.new('127.0.0.1', 62001))
+    test.ok(handle:getRecvBufferSize() >= 65536)
+    -- slots shorter than the datagram.
+    handle:setRecvRing(2, 16)
+    handle:startRecv()
+    local nread, buf = handle:recv()
+    test.equal(nread, 16)
+    buf:release()
+    test.equal(handle:getRecvStats().truncated, 1)
+
+    handle:stopRecv()
+    handle:setRecvDrops(true)
+    handle:startRecv()
+    local _, buf, _, info = handle:recv()
+    test.equal(info.truncated, false)
+    test.equal(info.drops, 0)
+    test.equal(handle:getRecvStats().truncated, 1)
+    buf:release()
+    -- received with recvmsg, still into the slots of the ring.
+    nread, buf, _, info = handle:recv()
+    test.equal(nread, 16)
+    test.equal(info.truncated, true)
+    buf:release()
+    handle:stopRecv()
+    handle:close()
+  end)()
+
+  coroutine.wrap(function()
+    local handle = uv.Udp.new()
+    handle:send({string.rep('x', 100)}, uv.SockAddrV4.new('127.0.0.1', 62001))
+    uv.sleep(10)
+    handle:send({'short'}, uv.SockAddrV4.new('127.0.0.1', 62001))
+    uv.sleep(10)
+    handle:send({string.rep('x', 100)}, uv.SockAddrV4.new('127.0.0.1', 62001))
+    handle:close()
+  end)()
+
+  uv.run()
+  test.done()
+end
+
 --[[
 exports['udp.send_and_recv_twice'] = function(test)
   coroutine.wrap(function()
@@ -0,0 +1,80 @@
+local uv = require 'couv'
+
+local exports = {}
+
+local function sum(n)
+  local s = 0
+  for i = 1, n do
+    s = s + i
+  end
+  return s, n
+end
+
+exports['work.results'] = function(test)
+  coroutine.wrap(function()
+    local s, n = uv.work(sum, 1000)
+    test.equal(s, 500500)
+    test.equal(n, 1000)
+
+    -- the cached chunk runs again with other arguments.
+    s, n = uv.work(sum, 10)
+    test.equal(s, 55)
+    test.equal(n, 10)
+
+    local buf = uv.work(function(buf)
+      local uv = require 'couv'
+      return uv.Buffer.new(buf:toString():upper())
+    end, uv.Buffer.new('abc'))
+    test.equal(buf:toString(), 'ABC')
+  end)()
+
+  uv.run()
+  test.done()
+end
+
+exports['work.concurrent'] = function(test)
+  local COUNT = 8
+  local done = 0
+
+  for i = 1, COUNT do
+    coroutine.wrap(function()
+      test.equal(uv.work('local a, b = ...; return a * b', i, 2), i * 2)
+      done = done + 1
+    end)()
+  end
+
+  uv.run()
+  test.equal(done, COUNT)
+  test.done()
+end
+
+exports['work.channel'] = function(test)
+  coroutine.wrap(function()
+    local ch = uv.Channel.new()
+    -- the worker may send to the channel, but not receive from it.
+    local err = uv.work(function(ch)
+      ch:send('hello')
+      local ok, err = pcall(ch.recv, ch)
+      return err
+    end, ch)
+    test.ok(err:find('EPERM'))
+    test.equal(ch:recv(), 'hello')
+    ch:close()
+  end)()
+
+  uv.run()
+  test.done()
+end
+
+exports['work.error'] = function(test)
+  coroutine.wrap(function()
+    local ok, err = pcall(uv.work, 'error("boom", 0)')
+    test.equal(ok, false)
+    test.ok(err:find('boom'))
+  end)()
+
+  uv.run()
+  test.done()
+end
+
+return exports